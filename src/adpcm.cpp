@@ -35,7 +35,7 @@ const int32_t adpcm::m_neg_table[5] = { 0, 0, -52, -55, -60 };
 // Construction.
 //
 
-adpcm::adpcm(const std::vector<uint8_t> &data, uint32_t play_count) :
+adpcm::adpcm(const data_span &data, uint32_t play_count) :
     m_data(data), m_play_count(play_count),
     m_current(0), m_repeat(-1),
     m_s0(0), m_s1(0),
@@ -191,7 +191,7 @@ adpcm::edit_adpcm(std::vector<uint8_t> &adpcm, size_t silence_start, size_t remo
 //
 
 int32_t
-adpcm::repeat_offset(const std::vector<uint8_t> &adpcm)
+adpcm::repeat_offset(const data_span &adpcm)
 {
     // Two conditions must be met for a valid repeat: a repeat start flag must
     // be set on a block, and second the final block must have the repeat jump
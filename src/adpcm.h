@@ -20,6 +20,7 @@
 #define PSXDMH_SRC_ADPCM_H
 
 
+#include "mapped_file.h"
 #include "module.h"
 
 
@@ -40,13 +41,13 @@ class adpcm : public module_mono
 {
 public:
 
-    // Construction. The data vector contains ADPCM-encoded blocks of audio
-    // data. Note that this class does not copy the data, instead relying on its
-    // owner to keep the vector valid for the lifetime of this object. The
+    // Construction. The data span contains ADPCM-encoded blocks of audio data.
+    // Note that this class does not copy the span, instead relying on its owner
+    // to keep it valid for the lifetime of this object. The
     // play_count controls how many times repeating sounds are played. A value
     // of 0 plays indefinitely, while any other value plays exactly that number
     // of times. This is ignored for non-repeating sounds.
-    adpcm(const std::vector<uint8_t> &data, uint32_t play_count = 0);
+    adpcm(const data_span &data, uint32_t play_count = 0);
 
     // Test whether the module is still generating output.
     virtual bool is_running() const { return !is_buffer_empty() || m_current >= 0; }
@@ -69,7 +70,7 @@ public:
 
     // Find the offset of a repeat point within ADPCM data. If no repeat is
     // found the return value will be negative.
-    static int32_t repeat_offset(const std::vector<uint8_t> &adpcm);
+    static int32_t repeat_offset(const data_span &adpcm);
 
 private:
 
@@ -86,7 +87,7 @@ private:
     void next_block();
 
     // ADPCM-encoded audio data.
-    const std::vector<uint8_t> &m_data;
+    const data_span &m_data;
 
     // Current position within the data. When this is negative it means that all
     // audio data has been exhausted.
@@ -0,0 +1,168 @@
+// psxdmh/src/arena.cpp
+// Pooled memory allocation for short-lived objects.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "global.h"
+
+#include "arena.h"
+
+
+namespace psxdmh
+{
+
+
+//
+// Construction.
+//
+
+arena::arena() :
+    m_chunk_next(nullptr), m_chunk_remaining(0),
+    m_allocated(0)
+{
+    std::fill(m_free, m_free + numberof(m_free), nullptr);
+}
+
+
+//
+// Destruction.
+//
+
+arena::~arena()
+{
+    assert(m_allocated == 0);
+    for (auto chunk = m_chunks.begin(); chunk != m_chunks.end(); ++chunk)
+    {
+        free(*chunk);
+    }
+}
+
+
+//
+// Allocate a block of memory.
+//
+
+void *
+arena::allocate(size_t size)
+{
+    // Large blocks come straight from the heap.
+    assert(size > 0);
+    if (size > m_largest_block)
+    {
+        return ::operator new(size);
+    }
+
+    // Reuse a free block of the same size if there is one.
+    m_allocated++;
+    size = (size + m_granularity - 1) / m_granularity * m_granularity;
+    free_block *&free_list = m_free[size / m_granularity - 1];
+    if (free_list != nullptr)
+    {
+        free_block *block = free_list;
+        free_list = block->next;
+        return block;
+    }
+
+    // Carve a new block out of the current chunk, starting a new chunk if
+    // there isn't enough room. Any space left over at the end of the old chunk
+    // is simply abandoned.
+    if (m_chunk_remaining < size)
+    {
+        uint8_t *chunk = static_cast<uint8_t *>(malloc(m_chunk_size));
+        if (chunk == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        m_chunks.push_back(chunk);
+        m_chunk_next = chunk;
+        m_chunk_remaining = m_chunk_size;
+    }
+    void *block = m_chunk_next;
+    m_chunk_next += size;
+    m_chunk_remaining -= size;
+    return block;
+}
+
+
+//
+// Release a block of memory.
+//
+
+void
+arena::release(void *block, size_t size)
+{
+    if (block != nullptr)
+    {
+        assert(size > 0);
+        if (size > m_largest_block)
+        {
+            ::operator delete(block);
+        }
+        else
+        {
+            assert(m_allocated > 0);
+            m_allocated--;
+            size = (size + m_granularity - 1) / m_granularity * m_granularity;
+            free_block *&free_list = m_free[size / m_granularity - 1];
+            free_block *released = static_cast<free_block *>(block);
+            released->next = free_list;
+            free_list = released;
+        }
+    }
+}
+
+
+//
+// Allocate an object that records where it was allocated.
+//
+
+void *
+arena::allocate_object(arena *pool, size_t size)
+{
+    size_t total = size + m_header_size;
+    uint8_t *block = static_cast<uint8_t *>(pool != nullptr ? pool->allocate(total) : ::operator new(total));
+    object_header *header = reinterpret_cast<object_header *>(block);
+    header->pool = pool;
+    header->size = total;
+    return block + m_header_size;
+}
+
+
+//
+// Release an object allocated by allocate_object.
+//
+
+void
+arena::release_object(void *object)
+{
+    if (object != nullptr)
+    {
+        uint8_t *block = static_cast<uint8_t *>(object) - m_header_size;
+        object_header *header = reinterpret_cast<object_header *>(block);
+        if (header->pool != nullptr)
+        {
+            header->pool->release(block, header->size);
+        }
+        else
+        {
+            ::operator delete(block);
+        }
+    }
+}
+
+
+}; //namespace psxdmh
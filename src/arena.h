@@ -0,0 +1,151 @@
+// psxdmh/src/arena.h
+// Pooled memory allocation for short-lived objects.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef PSXDMH_SRC_ARENA_H
+#define PSXDMH_SRC_ARENA_H
+
+
+#include "utility.h"
+
+
+namespace psxdmh
+{
+
+
+// Memory pool for the many small, short-lived objects created while rendering,
+// such as the modules making up each note that is played. Memory is carved out
+// of large chunks and recycled through free lists for each size of block, so
+// after the first few notes the allocation of a note's modules rarely needs to
+// touch the heap. All chunks are returned to the heap in one go when the arena
+// is destroyed. An arena is not thread-safe, and must outlive every object
+// allocated from it.
+class arena : public uncopyable
+{
+public:
+
+    // Construction.
+    arena();
+
+    // Destruction.
+    ~arena();
+
+    // Allocate a block of memory. The block is suitably aligned for any type.
+    void *allocate(size_t size);
+
+    // Release a block of memory. The size must match the size used when the
+    // block was allocated.
+    void release(void *block, size_t size);
+
+    // Allocate and release objects that record where they were allocated. When
+    // the arena is nullptr the memory comes from the heap. Objects released
+    // with release_object always return to wherever they came from, so the
+    // owner of an object does not need to know how it was allocated.
+    static void *allocate_object(arena *pool, size_t size);
+    static void release_object(void *object);
+
+private:
+
+    // Link in a free list.
+    struct free_block
+    {
+        free_block *next;
+    };
+
+    // Header preceding objects allocated by allocate_object. The header is
+    // padded to the alignment granularity.
+    struct object_header
+    {
+        arena *pool;
+        size_t size;
+    };
+
+    // Allocation granularity, and the size of the largest pooled block.
+    // Anything larger comes straight from the heap.
+    static const size_t m_granularity = 16;
+    static const size_t m_largest_block = 1024;
+
+    // Size of the chunks of memory divided up into blocks.
+    static const size_t m_chunk_size = 64 * 1024;
+
+    // Size of the object header, padded to the granularity.
+    static const size_t m_header_size = (sizeof(object_header) + m_granularity - 1) / m_granularity * m_granularity;
+
+    // Free lists for each size of block, indexed by size / granularity - 1.
+    free_block *m_free[m_largest_block / m_granularity];
+
+    // Chunks allocated from the heap.
+    std::vector<uint8_t *> m_chunks;
+
+    // Unused space remaining in the most recent chunk.
+    uint8_t *m_chunk_next;
+    size_t m_chunk_remaining;
+
+    // Number of blocks currently allocated.
+    size_t m_allocated;
+};
+
+
+// Standard library allocator drawing memory from an arena. When the arena is
+// nullptr the memory comes from the heap.
+template <typename T> class arena_allocator
+{
+public:
+
+    // Type being allocated.
+    typedef T value_type;
+
+    // Construction.
+    arena_allocator(arena *pool = nullptr) : m_pool(pool) {}
+    template <typename U> arena_allocator(const arena_allocator<U> &other) : m_pool(other.pool()) {}
+
+    // Allocation.
+    T *allocate(size_t n)
+    {
+        size_t size = n * sizeof(T);
+        return static_cast<T *>(m_pool != nullptr ? m_pool->allocate(size) : ::operator new(size));
+    }
+    void deallocate(T *p, size_t n)
+    {
+        if (m_pool != nullptr)
+        {
+            m_pool->release(p, n * sizeof(T));
+        }
+        else
+        {
+            ::operator delete(p);
+        }
+    }
+
+    // Arena used for allocations.
+    arena *pool() const { return m_pool; }
+
+private:
+
+    // Arena used for allocations. May be nullptr.
+    arena *m_pool;
+};
+
+template <typename T, typename U> inline bool operator==(const arena_allocator<T> &a, const arena_allocator<U> &b) { return a.pool() == b.pool(); }
+template <typename T, typename U> inline bool operator!=(const arena_allocator<T> &a, const arena_allocator<U> &b) { return a.pool() != b.pool(); }
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_ARENA_H
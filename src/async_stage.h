@@ -0,0 +1,331 @@
+// psxdmh/src/async_stage.h
+// Audio module running its source on a separate thread.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PSXDMH_SRC_ASYNC_STAGE_H
+#define PSXDMH_SRC_ASYNC_STAGE_H
+
+
+#include "module.h"
+#include "utility.h"
+
+
+namespace psxdmh
+{
+
+
+// Audio module that runs its source, and everything upstream of it, on a worker
+// thread. The worker generates blocks of samples ahead of time and hands them
+// over through a lock-free ring buffer with a single producer (the worker) and
+// a single consumer (whichever thread calls next). Placing these stages at a
+// few points in the graph lets the parts of the graph between them run in
+// parallel, while the output is identical to running them on one thread.
+//
+// Once the stage has been constructed the source belongs to the worker, so no
+// other thread may touch any module upstream of the stage. Any exception thrown
+// by the source is passed on to the consumer when it reaches that point in the
+// audio.
+template <typename S> class async_stage : public module<S>
+{
+public:
+
+    // Construction. The name identifies the stage in statistics. The ring
+    // buffer holds the given number of blocks, each of block_size samples.
+    async_stage(module<S> *source, std::string name, size_t block_size = 4096, size_t blocks = 8) :
+        module<S>(source),
+        m_name(name),
+        m_blocks(blocks),
+        m_produced(0), m_consumed(0),
+        m_producer_done(false), m_stop(false),
+        m_input_stall(0.0), m_output_stall(0.0),
+        m_current(0), m_position(0), m_holding(false), m_finished(false),
+        m_blocks_taken(0), m_depth_total(0)
+    {
+        assert(source != nullptr);
+        assert(block_size > 0 && blocks > 1);
+        for (auto &b : m_blocks)
+        {
+            b.samples.resize(block_size);
+            b.count = 0;
+        }
+        m_worker = start_worker(&async_stage::produce, this);
+    }
+
+    // Destruction. The worker is stopped before the source is destroyed.
+    virtual ~async_stage()
+    {
+        m_stop.store(true, std::memory_order_release);
+        if (m_worker.joinable())
+        {
+            m_worker.join();
+        }
+    }
+
+    // Test whether the module is still generating output. This waits for the
+    // worker if it hasn't yet decided.
+    virtual bool is_running() const { return ready(); }
+
+    // Get the next sample.
+    virtual bool next(S &s)
+    {
+        if (!ready())
+        {
+            s = 0.0;
+            return false;
+        }
+        s = m_blocks[m_current % m_blocks.size()].samples[m_position++];
+        return true;
+    }
+
+    // Silence is passed across in the blocks like any other audio, so only the
+    // silence already waiting in the current block is known ahead of time.
+    virtual uint32_t silence_ahead(uint32_t limit) const
+    {
+        if (!ready())
+        {
+            return 0;
+        }
+        const block &b = m_blocks[m_current % m_blocks.size()];
+        size_t end = m_position + std::min(size_t(limit), b.count - m_position);
+        size_t pos = m_position;
+        while (pos < end && b.samples[pos] == 0.0f)
+        {
+            ++pos;
+        }
+        return uint32_t(pos - m_position);
+    }
+    virtual void skip_silence(uint32_t count) { assert(count <= silence_ahead(count)); m_position += count; }
+
+    // Name of the stage.
+    const std::string &name() const { return m_name; }
+
+    // Number of blocks in the ring buffer.
+    size_t capacity() const { return m_blocks.size(); }
+
+    // Average number of blocks waiting in the ring buffer each time the
+    // consumer took a block. A value close to the capacity means the consumer
+    // is the bottleneck, while a value close to 0 means the worker is.
+    double average_depth() const { return m_blocks_taken > 0 ? double(m_depth_total) / m_blocks_taken : 0.0; }
+
+    // Time in seconds the consumer spent waiting for the worker to produce
+    // audio, and the time the worker spent waiting for room in the ring
+    // buffer. The worker's time is only valid once the stage has stopped
+    // running.
+    double input_stall() const { return m_input_stall; }
+    double output_stall() const { return m_output_stall; }
+
+private:
+
+    // Block of samples in the ring buffer.
+    struct block
+    {
+        std::vector<S> samples;
+        size_t count;
+    };
+
+    // Wait briefly while spinning on the other thread. Spinning gives the
+    // lowest latency when the other thread is almost ready, while sleeping
+    // avoids burning a core when it isn't.
+    static void pause(unsigned &spins)
+    {
+        if (++spins < 64)
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    // Worker thread generating blocks of audio from the source.
+    void produce()
+    {
+        try
+        {
+            module<S> *source = this->source();
+            size_t index = 0;
+            bool live = true;
+            while (live)
+            {
+                // Wait for room in the ring buffer.
+                if (index - m_consumed.load(std::memory_order_acquire) == m_blocks.size())
+                {
+                    double start = time_now();
+                    unsigned spins = 0;
+                    while (index - m_consumed.load(std::memory_order_acquire) == m_blocks.size())
+                    {
+                        if (m_stop.load(std::memory_order_acquire))
+                        {
+                            return;
+                        }
+                        pause(spins);
+                    }
+                    double stall = time_now() - start;
+                    m_output_stall += stall;
+                    add_output_wait_time(stall);
+                }
+                if (m_stop.load(std::memory_order_acquire))
+                {
+                    return;
+                }
+
+                // Fill the block, passing known silence across in bulk.
+                block &b = m_blocks[index % m_blocks.size()];
+                size_t count = 0;
+                while (count < b.samples.size())
+                {
+                    uint32_t silent = source->silence_ahead(uint32_t(b.samples.size() - count));
+                    if (silent > 0)
+                    {
+                        source->skip_silence(silent);
+                        std::fill(b.samples.begin() + count, b.samples.begin() + count + silent, S(0.0f));
+                        count += silent;
+                    }
+                    else if (source->next(b.samples[count]))
+                    {
+                        ++count;
+                    }
+                    else
+                    {
+                        live = false;
+                        break;
+                    }
+                }
+
+                // Publish the block.
+                b.count = count;
+                if (count > 0)
+                {
+                    m_produced.store(++index, std::memory_order_release);
+                }
+            }
+        }
+        catch (...)
+        {
+            m_error = std::current_exception();
+        }
+        m_producer_done.store(true, std::memory_order_release);
+    }
+
+    // Make sure the current block has a sample available, taking the next
+    // block from the ring buffer as required. Returns false once the worker
+    // has finished and every block has been consumed.
+    bool ready() const
+    {
+        while (!m_finished)
+        {
+            // Use the current block while it has samples left, otherwise hand
+            // it back to the worker.
+            if (m_holding)
+            {
+                if (m_position < m_blocks[m_current % m_blocks.size()].count)
+                {
+                    return true;
+                }
+                m_holding = false;
+                m_position = 0;
+                m_consumed.store(++m_current, std::memory_order_release);
+            }
+
+            // Wait for the worker to produce another block or to finish.
+            size_t produced = m_produced.load(std::memory_order_acquire);
+            if (produced == m_current)
+            {
+                double start = time_now();
+                unsigned spins = 0;
+                for (;;)
+                {
+                    bool done = m_producer_done.load(std::memory_order_acquire);
+                    produced = m_produced.load(std::memory_order_acquire);
+                    if (produced != m_current || done)
+                    {
+                        break;
+                    }
+                    pause(spins);
+                }
+                m_input_stall += time_now() - start;
+                if (produced == m_current)
+                {
+                    // The worker has finished. Pass on any error it hit.
+                    m_finished = true;
+                    if (m_error)
+                    {
+                        std::rethrow_exception(m_error);
+                    }
+                    break;
+                }
+            }
+            m_depth_total += produced - m_current;
+            m_blocks_taken++;
+            m_holding = true;
+        }
+        return false;
+    }
+
+    // Name of the stage for statistics.
+    std::string m_name;
+
+    // Ring buffer of blocks.
+    std::vector<block> m_blocks;
+
+    // Number of blocks published by the worker, and the number handed back by
+    // the consumer. The difference is the number of blocks in the buffer.
+    std::atomic<size_t> m_produced;
+    mutable std::atomic<size_t> m_consumed;
+
+    // Set by the worker when it has published its last block.
+    std::atomic<bool> m_producer_done;
+
+    // Set to ask the worker to stop early.
+    std::atomic<bool> m_stop;
+
+    // Exception thrown by the source, if any. Only read once the worker has
+    // finished.
+    std::exception_ptr m_error;
+
+    // Time spent by the consumer waiting for input, and by the worker waiting
+    // for room in the buffer.
+    mutable double m_input_stall;
+    double m_output_stall;
+
+    // Consumer state: the number of the current block, the read position in
+    // it, whether the consumer holds it, and whether the end has been reached.
+    mutable size_t m_current;
+    mutable size_t m_position;
+    mutable bool m_holding;
+    mutable bool m_finished;
+
+    // Number of blocks taken by the consumer, and the total of the buffer depth
+    // seen when each was taken.
+    mutable uint64_t m_blocks_taken;
+    mutable uint64_t m_depth_total;
+
+    // Worker thread. This is started last, once everything it uses is ready.
+    std::thread m_worker;
+};
+
+
+// Types for mono and stereo asynchronous stages.
+typedef async_stage<mono_t> async_stage_mono;
+typedef async_stage<stereo_t> async_stage_stereo;
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_ASYNC_STAGE_H
@@ -0,0 +1,196 @@
+// psxdmh/src/async_writer.cpp
+// Write-behind output to a file from a background thread.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "global.h"
+
+#include "async_writer.h"
+#include "utility.h"
+
+
+namespace psxdmh
+{
+
+
+// Total bytes written and time spent blocked.
+std::atomic<uint64_t> async_writer::m_bytes_written(0);
+std::atomic<uint64_t> async_writer::m_blocked_ns(0);
+
+
+//
+// Construction.
+//
+
+async_writer::async_writer(safe_file &file, size_t buffer_size, size_t buffers) :
+    m_file(file),
+    m_buffers(buffers, std::vector<uint8_t>(buffer_size)),
+    m_lengths(buffers, 0),
+    m_fill(0),
+    m_queued(0), m_written(0),
+    m_stop(false)
+{
+    assert(buffer_size > 0 && buffers > 1);
+    m_worker = start_worker(&async_writer::run, this);
+}
+
+
+//
+// Destruction.
+//
+
+async_writer::~async_writer()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stop = true;
+        m_changed.notify_all();
+    }
+    m_worker.join();
+}
+
+
+//
+// Write bytes to the file.
+//
+
+void
+async_writer::write(const void *data, size_t bytes)
+{
+    // Copy the data into the current buffer, handing each buffer over as it
+    // fills up.
+    assert(data != nullptr || bytes == 0);
+    const uint8_t *source = static_cast<const uint8_t *>(data);
+    while (bytes > 0)
+    {
+        std::vector<uint8_t> &buffer = m_buffers[m_queued % m_buffers.size()];
+        size_t count = std::min(bytes, buffer.size() - m_fill);
+        memcpy(buffer.data() + m_fill, source, count);
+        m_fill += count;
+        source += count;
+        bytes -= count;
+        if (m_fill == buffer.size())
+        {
+            submit();
+        }
+    }
+}
+
+
+//
+// Wait for all data to be written to the file.
+//
+
+void
+async_writer::flush()
+{
+    if (m_fill > 0)
+    {
+        submit();
+    }
+    std::unique_lock<std::mutex> lock(m_lock);
+    wait_for_queue(lock, 1);
+    if (m_error)
+    {
+        std::rethrow_exception(m_error);
+    }
+}
+
+
+//
+// Background thread writing the buffers.
+//
+
+void
+async_writer::run()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    for (;;)
+    {
+        // Wait for a buffer to write.
+        m_changed.wait(lock, [this]() { return m_stop || m_written != m_queued; });
+        if (m_stop)
+        {
+            break;
+        }
+
+        // Write the buffer without holding the lock. Buffers queued after an
+        // error are dropped, as the error is reported instead.
+        size_t index = m_written % m_buffers.size();
+        size_t length = m_lengths[index];
+        if (!m_error)
+        {
+            lock.unlock();
+            std::exception_ptr error;
+            try
+            {
+                m_file.write(m_buffers[index].data(), length);
+                m_bytes_written += length;
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+            lock.lock();
+            m_error = error;
+        }
+        m_written++;
+        m_changed.notify_all();
+    }
+}
+
+
+//
+// Hand the buffer being filled to the background thread.
+//
+
+void
+async_writer::submit()
+{
+    // Queue the buffer, then wait for the next one to be free. Any error from
+    // the background thread is passed on straight away.
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_lengths[m_queued % m_buffers.size()] = m_fill;
+    m_queued++;
+    m_fill = 0;
+    m_changed.notify_all();
+    wait_for_queue(lock, m_buffers.size());
+    if (m_error)
+    {
+        std::rethrow_exception(m_error);
+    }
+}
+
+
+//
+// Wait until fewer than the given number of buffers are queued.
+//
+
+void
+async_writer::wait_for_queue(std::unique_lock<std::mutex> &lock, size_t limit)
+{
+    if (m_queued - m_written >= limit)
+    {
+        double start = time_now();
+        m_changed.wait(lock, [this, limit]() { return m_queued - m_written < limit; });
+        double blocked = time_now() - start;
+        m_blocked_ns += uint64_t(blocked * 1e9);
+        add_output_wait_time(blocked);
+    }
+}
+
+
+}; //namespace psxdmh
@@ -0,0 +1,120 @@
+// psxdmh/src/async_writer.h
+// Write-behind output to a file from a background thread.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PSXDMH_SRC_ASYNC_WRITER_H
+#define PSXDMH_SRC_ASYNC_WRITER_H
+
+
+#include "safe_file.h"
+#include "sample.h"
+
+
+namespace psxdmh
+{
+
+
+// Write-behind output to a file. Data is collected into a pool of large
+// buffers, and full buffers are written to the file by a background thread so
+// that generating the data and writing it overlap. The data is written at the
+// file's position when the writer was created, in the order it was given. No
+// other use may be made of the file until flush has been called.
+//
+// Errors from the file are reported by a thrown std::string, either from a
+// later write or from flush.
+class async_writer : public uncopyable
+{
+public:
+
+    // Construction. The caller must ensure that the file remains valid for the
+    // life of this object.
+    async_writer(safe_file &file, size_t buffer_size = 1 << 20, size_t buffers = 4);
+
+    // Destruction. Any data not yet flushed is discarded.
+    ~async_writer();
+
+    // Write bytes to the file.
+    void write(const void *data, size_t bytes);
+
+    // Write a sample in native byte order.
+    void write_sample(const mono_t &s) { write(&s, sizeof(s)); }
+    void write_sample(const stereo_t &s) { write_sample(s.left); write_sample(s.right); }
+
+    // Wait for all data to be written to the file.
+    void flush();
+
+    // Total bytes written by all writers, and the total time in seconds that
+    // they spent blocked waiting for the file. The counts are atomic as
+    // writers may be used on several threads at once.
+    static uint64_t bytes_written() { return m_bytes_written; }
+    static double blocked_time() { return m_blocked_ns / 1e9; }
+    static void reset_statistics() { m_bytes_written = 0; m_blocked_ns = 0; }
+
+private:
+
+    // Background thread writing the buffers.
+    void run();
+
+    // Hand the buffer being filled to the background thread, and wait until
+    // another buffer is free.
+    void submit();
+
+    // Wait until fewer than the given number of buffers are queued, recording
+    // the time spent blocked. The lock must be held.
+    void wait_for_queue(std::unique_lock<std::mutex> &lock, size_t limit);
+
+    // File being written.
+    safe_file &m_file;
+
+    // Pool of buffers used as a ring. The number of bytes in each queued
+    // buffer is held in m_lengths.
+    std::vector<std::vector<uint8_t>> m_buffers;
+    std::vector<size_t> m_lengths;
+
+    // Number of bytes in the buffer being filled.
+    size_t m_fill;
+
+    // Lock protecting the state below, and the condition signalled whenever it
+    // changes.
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+
+    // Number of buffers queued for writing, and the number written. The buffer
+    // being filled is the one after the last queued.
+    size_t m_queued;
+    size_t m_written;
+
+    // Set to stop the background thread.
+    bool m_stop;
+
+    // Error from writing the file, if any.
+    std::exception_ptr m_error;
+
+    // Total bytes written and time spent blocked, in nanoseconds.
+    static std::atomic<uint64_t> m_bytes_written;
+    static std::atomic<uint64_t> m_blocked_ns;
+
+    // Background thread. This is started last, once everything it uses is
+    // ready.
+    std::thread m_worker;
+};
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_ASYNC_WRITER_H
@@ -45,60 +45,114 @@ const channel::filter_fix channel::m_filter_fixes[] =
 };
 
 
+// Allowance for overshoot when deciding whether a channel can be culled. The
+// Butterworth patch filter and the sinc resampler can both produce output
+// larger than their input, though by much less than this.
+const mono_t channel::m_cull_headroom = 8.0f;
+
+
 // Current and maximum number of channels instantiated simultaneously.
-int channel::m_current_channels = 0;
-int channel::m_maximum_channels = 0;
+std::atomic<int> channel::m_current_channels(0);
+std::atomic<int> channel::m_maximum_channels(0);
+
+
+// Number of channels started and culled.
+std::atomic<int> channel::m_started_channels(0);
+std::atomic<int> channel::m_culled_channels(0);
+
+
+//
+// Construction of a voice.
+//
+
+channel::voice::voice(const patch *patch, uint16_t spu_ads, uint16_t spu_sr, bool repair) :
+    source_patch(patch),
+    patch_filter(filter_type::low_pass, m_adpcm_filter_cutoff),
+    envelope_settings(spu_ads, spu_sr),
+    peak(0.0f)
+{
+    // The output of the ADPCM decoder is filtered before resampling to reduce
+    // artifacts from low quality patches. Doing this before resampling gives
+    // better results than trying to do it after resampling (and is
+    // considerably easier to manage). One patch used in song 98 has a special
+    // fix to remove high-pitched noise.
+    assert(patch != nullptr);
+    if (repair)
+    {
+        for (size_t f = 0; f < numberof(m_filter_fixes); ++f)
+        {
+            if (m_filter_fixes[f].id == patch->id)
+            {
+                patch_filter.adjust(m_filter_fixes[f].cutoff);
+                break;
+            }
+        }
+    }
+
+    // Find the peak of the patch. Repeating patches are played through twice
+    // as the repeated section starts from a different decoder state.
+    adpcm decoder(patch->adpcm, 2);
+    mono_t s;
+    while (decoder.next(s))
+    {
+        peak = std::max(peak, magnitude(s));
+    }
+}
 
 
 //
 // Construction.
 //
 
-channel::channel(const patch *patch, uint32_t frequency, mono_t volume, uint8_t pan, uint16_t spu_ads, uint16_t spu_sr, uint32_t sample_rate, uint32_t sinc_window, bool apply_psx_limit, bool repair) :
+channel::channel(const voice &voice, uint32_t frequency, mono_t volume, uint8_t pan, mono_t cull_threshold, uint32_t sample_rate, uint32_t sinc_window, bool apply_psx_limit, arena *pool) :
     m_resampler(nullptr),
-    m_raw_envelope(new envelope(spu_ads, spu_sr)), m_envelope(nullptr),
+    m_raw_envelope(new (pool) envelope(voice.envelope_settings)), m_envelope(nullptr),
     m_pan(pan),
     m_volume(0.0),
     m_limit_frequency(apply_psx_limit),
     m_sinc_window(sinc_window),
-    m_user_data(0)
+    m_user_data(0),
+    m_cull_level(0.0f),
+    m_limiter(nullptr)
 {
-    assert(patch != nullptr);
+    assert(voice.source_patch != nullptr);
     assert(frequency > 0);
     assert(volume >= 0.0);
     assert(pan <= 0x7f);
+    assert(cull_threshold >= 0.0);
 
     // Monitor the maximum number of channels in use simultaneously.
     assert(m_current_channels >= 0);
-    if (++m_current_channels > m_maximum_channels)
+    int current = ++m_current_channels;
+    int maximum = m_maximum_channels;
+    while (current > maximum && !m_maximum_channels.compare_exchange_weak(maximum, current))
     {
-        m_maximum_channels = m_current_channels;
     }
+    m_started_channels++;
 
-    // Prepare the resampler. The output of the ADPCM decoder is filtered before
-    // resampling to reduce artifacts from low quality patches. Doing this now
-    // gives better results than trying to do it after resampling (and is
-    // considerably easier to manage). One patch used in song 98 has a special
-    // fix to remove high-pitched noise.
-    module_mono *module = new adpcm(patch->adpcm);
-    double cutoff = m_adpcm_filter_cutoff;
-    if (repair)
+    // Prepare the resampler, fed by the filtered output of the ADPCM decoder.
+    module_mono *module = new (pool) adpcm(voice.source_patch->adpcm);
+    module = new (pool) filter_mono(module, voice.patch_filter);
+    resampler_mono *resampler;
+    if (m_sinc_window > 0)
     {
-        for (size_t f = 0; f < numberof(m_filter_fixes); ++f)
-        {
-            if (m_filter_fixes[f].id == patch->id)
-            {
-                cutoff = m_filter_fixes[f].cutoff;
-                break;
-            }
-        }
+        resampler = new (pool) resampler_sinc_mono(module, m_sinc_window, limit_frequency(frequency), sample_rate, pool);
+    }
+    else
+    {
+        resampler = new (pool) resampler_linear_mono(module, limit_frequency(frequency), sample_rate);
     }
-    module = new filter_mono(module, filter_type::low_pass, cutoff);
-    resampler_mono *resampler = new resampler_sinc_mono(module, m_sinc_window, limit_frequency(frequency), sample_rate);
     m_resampler.reset(resampler);
 
-    // Calculate the left and right volumes.
+    // Calculate the left and right volumes, and from them the envelope level
+    // below which the channel can never again produce output above the cull
+    // threshold.
     master_volume(volume);
+    mono_t gain = std::max(m_volume.left, m_volume.right) * voice.peak * m_cull_headroom;
+    if (cull_threshold > 0.0 && gain > 0.0)
+    {
+        m_cull_level = cull_threshold / gain;
+    }
 
     // Resample the envelope if its sample rate does not match ours. A linear
     // resampler is not good for regular audio but is fine here since the
@@ -106,7 +160,7 @@ channel::channel(const patch *patch, uint32_t frequency, mono_t volume, uint8_t
     // undershoot, unlike fancier resamplers.
     if (sample_rate != m_raw_envelope->sample_rate())
     {
-        m_envelope.reset(new resampler_linear_mono(m_raw_envelope, m_raw_envelope->sample_rate(), sample_rate));
+        m_envelope.reset(new (pool) resampler_linear_mono(m_raw_envelope, m_raw_envelope->sample_rate(), sample_rate));
     }
     // Otherwise use the envelope directly.
     else
@@ -124,6 +178,10 @@ channel::~channel()
 {
     assert(m_current_channels > 0);
     m_current_channels--;
+    if (m_limiter != nullptr)
+    {
+        m_limiter->detach(this);
+    }
 }
 
 
@@ -154,6 +212,14 @@ channel::next(stereo_t &s)
     {
         m_resampler.reset();
     }
+    // Also stop the channel when it has been released and the envelope has
+    // dropped so low that the channel's output will always be inaudible. The
+    // envelope only falls once released.
+    else if (m_raw_envelope->is_released() && m_raw_envelope->level() < m_cull_level)
+    {
+        m_resampler.reset();
+        m_culled_channels++;
+    }
     return true;
 }
 
@@ -210,4 +276,125 @@ channel::limit_frequency(uint32_t frequency) const
 }
 
 
+//  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+
+// Number of channels stolen and notes dropped.
+std::atomic<int> channel_limiter::m_stolen_channels(0);
+std::atomic<int> channel_limiter::m_dropped_notes(0);
+
+
+//
+// Construction.
+//
+
+channel_limiter::channel_limiter(uint32_t maximum_channels) :
+    m_maximum_channels(maximum_channels),
+    m_next_order(0)
+{
+    assert(maximum_channels > 0);
+}
+
+
+//
+// Destruction.
+//
+
+channel_limiter::~channel_limiter()
+{
+    assert(m_channels.empty());
+}
+
+
+//
+// Make room for a new channel.
+//
+
+bool
+channel_limiter::make_room(uint8_t priority)
+{
+    // Only channels that are still playing count towards the limit. Channels
+    // which have stopped are waiting to be removed by their track.
+    size_t playing = 0;
+    const attached_channel *victim = nullptr;
+    for (auto &attached : m_channels)
+    {
+        if (attached.c->is_running())
+        {
+            ++playing;
+            if (victim == nullptr || better_victim(attached, *victim))
+            {
+                victim = &attached;
+            }
+        }
+    }
+    if (playing < m_maximum_channels)
+    {
+        return true;
+    }
+
+    // Steal the best victim unless it's more important than the new note.
+    assert(victim != nullptr);
+    if (victim->priority > priority)
+    {
+        ++m_dropped_notes;
+        return false;
+    }
+    victim->c->stop();
+    ++m_stolen_channels;
+    return true;
+}
+
+
+//
+// Attach a new channel.
+//
+
+void
+channel_limiter::attach(channel *c, uint8_t priority)
+{
+    assert(c != nullptr);
+    assert(c->m_limiter == nullptr);
+    c->m_limiter = this;
+    m_channels.push_back(attached_channel { c, priority, m_next_order++ });
+}
+
+
+//
+// Detach a channel.
+//
+
+void
+channel_limiter::detach(channel *c)
+{
+    auto predicate = [c](const attached_channel &attached) { return attached.c == c; };
+    auto iter = std::find_if(m_channels.begin(), m_channels.end(), predicate);
+    assert(iter != m_channels.end());
+    m_channels.erase(iter);
+}
+
+
+//
+// Test whether one channel should be stolen in preference to another.
+//
+
+bool
+channel_limiter::better_victim(const attached_channel &a, const attached_channel &b)
+{
+    if (a.priority != b.priority)
+    {
+        return a.priority < b.priority;
+    }
+    if (a.c->is_released() != b.c->is_released())
+    {
+        return a.c->is_released();
+    }
+    if (a.c->envelope_level() != b.c->envelope_level())
+    {
+        return a.c->envelope_level() < b.c->envelope_level();
+    }
+    return a.order < b.order;
+}
+
+
 }; //namespace psxdmh
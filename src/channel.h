@@ -21,6 +21,7 @@
 
 
 #include "envelope.h"
+#include "filter.h"
 #include "module.h"
 #include "resampler.h"
 
@@ -30,6 +31,7 @@ namespace psxdmh
 
 
 // Forwards.
+class channel_limiter;
 class envelope;
 struct patch;
 
@@ -39,10 +41,36 @@ class channel : public module_stereo
 {
 public:
 
+    // Details of a voice that are the same every time it plays a note. These
+    // are resolved once when a track is loaded so that starting a note doesn't
+    // need to repeat the work.
+    struct voice
+    {
+        // Construction. The two SPU ADSR registers configure the envelope.
+        // Filtering fixes for noisy patches are included if repair is set.
+        voice(const patch *patch, uint16_t spu_ads, uint16_t spu_sr, bool repair);
+
+        // Patch played by the voice.
+        const patch *source_patch;
+
+        // Filter applied to the patch when decoded from ADPCM.
+        filter_core<mono_t> patch_filter;
+
+        // Decoded envelope registers.
+        envelope::settings envelope_settings;
+
+        // Peak magnitude of the decoded patch.
+        mono_t peak;
+    };
+
     // Construction. The channel starts playing immediately. The volume ranges
     // from 0.0 to 1.0. The pan ranges from full left at 0x00 to centre at 0x40
-    // to full right at 0x7f.
-    channel(const patch *patch, uint32_t frequency, mono_t volume, uint8_t pan, uint16_t spu_ads, uint16_t spu_sr, uint32_t sample_rate, uint32_t sinc_window, bool apply_psx_limit, bool repair);
+    // to full right at 0x7f. Once the channel has been released and can no
+    // longer produce output above the cull threshold it is stopped early. A
+    // threshold of 0 disables this. A sinc window of 0 selects linear
+    // interpolation for draft quality. The modules making up the channel are
+    // allocated from the arena if one is given.
+    channel(const voice &voice, uint32_t frequency, mono_t volume, uint8_t pan, mono_t cull_threshold, uint32_t sample_rate, uint32_t sinc_window, bool apply_psx_limit, arena *pool = nullptr);
 
     // Destruction.
     virtual ~channel();
@@ -61,6 +89,15 @@ public:
     // Start the release phase of the envelope.
     void release() { m_raw_envelope->release(); }
 
+    // Stop the channel immediately.
+    void stop() { m_resampler.reset(); }
+
+    // Test whether the release phase of the envelope has started.
+    bool is_released() const { return m_raw_envelope->is_released(); }
+
+    // Current level of the envelope, from 0.0 to 1.0.
+    mono_t envelope_level() const { return m_raw_envelope->level(); }
+
     // Alter the playback frequency of the patch currently being played.
     void frequency(uint32_t new_frequency);
 
@@ -71,12 +108,17 @@ public:
     // Maximum playback frequency of the PSX SPU.
     static uint32_t spu_max_frequency() { return 4 * 44100; }
 
-    // Maximum number of channels instantiated simultaneously.
+    // Maximum number of channels instantiated simultaneously, and the number
+    // of channels started and culled.
     static int maximum_channels() { return m_maximum_channels; }
-    static void reset_maximum_channels() { m_maximum_channels = 0; }
+    static int started_channels() { return m_started_channels; }
+    static int culled_channels() { return m_culled_channels; }
+    static void reset_statistics() { m_maximum_channels = 0; m_started_channels = 0; m_culled_channels = 0; }
 
 private:
 
+    friend class channel_limiter;
+
     // Details of filtering fixes to apply to patches.
     struct filter_fix
     {
@@ -117,15 +159,101 @@ private:
     // User-defined value.
     uint32_t m_user_data;
 
+    // Envelope level below which the channel is culled once released. This is
+    // 0 when culling is disabled.
+    mono_t m_cull_level;
+
+    // Limiter the channel is attached to, if any.
+    channel_limiter *m_limiter;
+
     // Filter cut off used to filter patches when decoded from ADPCM.
     static const double m_adpcm_filter_cutoff;
 
     // Filtering fixes for noisy patches.
     static const filter_fix m_filter_fixes[];
 
-    // Current and maximum number of channels instantiated simultaneously.
-    static int m_current_channels;
-    static int m_maximum_channels;
+    // Allowance for the patch filter and resampler overshooting the peak of
+    // the decoded patch.
+    static const mono_t m_cull_headroom;
+
+    // Current and maximum number of channels instantiated simultaneously. The
+    // counts are atomic as channels may be played on several threads at once.
+    static std::atomic<int> m_current_channels;
+    static std::atomic<int> m_maximum_channels;
+
+    // Number of channels started and culled.
+    static std::atomic<int> m_started_channels;
+    static std::atomic<int> m_culled_channels;
+};
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+
+// Limit on the number of channels playing at once. A real SPU has 24 channels,
+// and the PSX sound driver stole channels from playing notes when it ran out.
+// When the limit is reached a new note takes the channel with the lowest
+// priority, preferring released notes, then the quietest envelope, then the
+// oldest note. A new note with a lower priority than every playing channel is
+// dropped. A single limiter is shared by all the tracks of a song.
+class channel_limiter : public uncopyable
+{
+public:
+
+    // Construction.
+    channel_limiter(uint32_t maximum_channels);
+
+    // Destruction.
+    ~channel_limiter();
+
+    // Make room for a new channel with the given priority, stealing a playing
+    // channel if the limit has been reached. Returns false if the note must be
+    // dropped.
+    bool make_room(uint8_t priority);
+
+    // Attach a new channel. The channel detaches itself when destroyed.
+    void attach(channel *c, uint8_t priority);
+
+    // Number of channels stolen and notes dropped since the last reset.
+    static int stolen_channels() { return m_stolen_channels; }
+    static int dropped_notes() { return m_dropped_notes; }
+    static void reset_statistics() { m_stolen_channels = 0; m_dropped_notes = 0; }
+
+private:
+
+    friend class channel;
+
+    // Details of an attached channel.
+    struct attached_channel
+    {
+        // The channel.
+        channel *c;
+
+        // Priority of the sub-instrument that started the channel.
+        uint8_t priority;
+
+        // Order in which the channel was started.
+        uint64_t order;
+    };
+
+    // Detach a channel.
+    void detach(channel *c);
+
+    // Test whether one channel should be stolen in preference to another.
+    static bool better_victim(const attached_channel &a, const attached_channel &b);
+
+    // Maximum number of channels playing at once.
+    uint32_t m_maximum_channels;
+
+    // Channels currently attached.
+    std::vector<attached_channel> m_channels;
+
+    // Order to give the next channel attached.
+    uint64_t m_next_order;
+
+    // Number of channels stolen and notes dropped, across all limiters.
+    static std::atomic<int> m_stolen_channels;
+    static std::atomic<int> m_dropped_notes;
 };
 
 
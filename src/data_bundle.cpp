@@ -0,0 +1,261 @@
+// psxdmh/src/data_bundle.cpp
+// Single-file bundle of the music data.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "global.h"
+
+#include "data_bundle.h"
+#include "safe_file.h"
+
+
+namespace psxdmh
+{
+
+
+// Signature ("PXBD") and version of a bundle.
+#define PSXDMH_BUNDLE_SIGNATURE     (0x44425850)
+#define PSXDMH_BUNDLE_VERSION       (1)
+
+// Size of the header, the size of each directory entry, and the alignment of
+// the WMD and patch data.
+#define PSXDMH_BUNDLE_HEADER_SIZE   (28)
+#define PSXDMH_BUNDLE_ENTRY_SIZE    (12)
+#define PSXDMH_BUNDLE_ALIGNMENT     (64)
+
+
+//
+// Construction.
+//
+
+data_bundle::data_bundle(std::string file_name) :
+    m_file_name(file_name)
+{
+    // Map the bundle and check the header.
+    auto file = std::make_shared<const mapped_file>(file_name);
+    m_data = data_span(file, 0, file->size());
+    data_reader reader(m_data, file_name);
+    if (reader.size() < PSXDMH_BUNDLE_HEADER_SIZE || reader.read_32_le() != PSXDMH_BUNDLE_SIGNATURE)
+    {
+        throw std::string("Not a bundle: '") + file_name + "'.";
+    }
+    if (reader.read_32_le() != PSXDMH_BUNDLE_VERSION)
+    {
+        throw std::string("Bundle '") + file_name + "' uses an unsupported version.";
+    }
+    size_t wmd_offset = reader.read_32_le();
+    size_t wmd_size = reader.read_32_le();
+    size_t patch_count = reader.read_32_le();
+    size_t directory_offset = reader.read_32_le();
+    if (reader.read_32_le() != reader.size() || wmd_offset > reader.size() || wmd_size > reader.size() - wmd_offset)
+    {
+        throw std::string("Failed reading from '") + file_name + "'.";
+    }
+    m_wmd = m_data.subspan(wmd_offset, wmd_size);
+
+    // Read the patch directory. The patches themselves are checked as they
+    // are loaded.
+    reader.seek(directory_offset);
+    m_patches.resize(patch_count);
+    for (auto &location : m_patches)
+    {
+        location.id = reader.read_16_le();
+        reader.read_16_le();
+        location.offset = reader.read_32_le();
+        location.size = reader.read_32_le();
+    }
+}
+
+
+//
+// Test if a file is a bundle.
+//
+
+bool
+data_bundle::is_bundle(std::string file_name)
+{
+    try
+    {
+        safe_file file(file_name, file_mode::read);
+        return file.size() >= PSXDMH_BUNDLE_HEADER_SIZE && file.read_32_le() == PSXDMH_BUNDLE_SIGNATURE;
+    }
+    catch (const std::string &)
+    {
+        return false;
+    }
+}
+
+
+//
+// Write a bundle.
+//
+
+data_bundle::write_details
+data_bundle::write(std::string file_name, const wmd_file &wmd, const lcd_file &lcd)
+{
+    // Collect the patches in ID order. Where the LCD set holds more than one
+    // patch with an ID, the one used for playback is kept.
+    std::vector<const patch *> patches;
+    for (uint32_t id = 0; id <= lcd.maximum_patch_id(); ++id)
+    {
+        const patch *p = lcd.patch_by_id(uint16_t(id));
+        if (p != nullptr)
+        {
+            patches.push_back(p);
+        }
+    }
+
+    // Write the WMD and patch data, leaving space for the header and the
+    // directory. Each part is aligned. Data shared by several patches is
+    // written once, for the patch that holds it.
+    std::vector<size_t> holders = share_patches(patches);
+    write_details details = { 0, patches.size(), 0, 0 };
+    safe_file file(file_name, file_mode::write);
+    auto align = [&file]()
+    {
+        size_t pos = file.tell();
+        file.write_zeros((PSXDMH_BUNDLE_ALIGNMENT - pos % PSXDMH_BUNDLE_ALIGNMENT) % PSXDMH_BUNDLE_ALIGNMENT);
+    };
+    file.write_zeros(PSXDMH_BUNDLE_HEADER_SIZE + patches.size() * PSXDMH_BUNDLE_ENTRY_SIZE);
+    align();
+    size_t wmd_offset = file.tell();
+    wmd.write(file);
+    size_t wmd_size = file.tell() - wmd_offset;
+    std::vector<patch_location> locations(patches.size());
+    for (size_t index = 0; index < patches.size(); ++index)
+    {
+        const patch *p = patches[index];
+        locations[index] = patch_location{p->id, 0, uint32_t(p->adpcm.size())};
+        if (holders[index] == index)
+        {
+            align();
+            locations[index].offset = uint32_t(file.tell());
+            file.write(p->adpcm.data(), p->adpcm.size());
+            details.bodies++;
+        }
+        else
+        {
+            details.bytes_saved += p->adpcm.size();
+        }
+    }
+    for (size_t index = 0; index < patches.size(); ++index)
+    {
+        locations[index].offset = locations[holders[index]].offset;
+    }
+    size_t total_size = file.tell();
+    if (total_size > UINT32_MAX)
+    {
+        throw std::string("Bundle '") + file_name + "' is too large.";
+    }
+
+    // Go back and fill in the header and the directory.
+    file.seek(0);
+    file.write_32_le(PSXDMH_BUNDLE_SIGNATURE);
+    file.write_32_le(PSXDMH_BUNDLE_VERSION);
+    file.write_32_le(uint32_t(wmd_offset));
+    file.write_32_le(uint32_t(wmd_size));
+    file.write_32_le(uint32_t(locations.size()));
+    file.write_32_le(PSXDMH_BUNDLE_HEADER_SIZE);
+    file.write_32_le(uint32_t(total_size));
+    for (auto &location : locations)
+    {
+        file.write_16_le(location.id);
+        file.write_16_le(0);
+        file.write_32_le(location.offset);
+        file.write_32_le(location.size);
+    }
+    file.close();
+    details.size = total_size;
+    return details;
+}
+
+
+//
+// Find the patches that can share the ADPCM data of another patch.
+//
+
+std::vector<size_t>
+data_bundle::share_patches(const std::vector<const patch *> &patches)
+{
+    // Consider the longest patches first, so that each patch is compared with
+    // all of those that could hold its data. Candidates are found by hashing
+    // the first block of data, which they must have in common, and are then
+    // compared in full.
+    std::vector<size_t> order(patches.size());
+    for (size_t index = 0; index < order.size(); ++index)
+    {
+        order[index] = index;
+    }
+    auto longer = [&patches](size_t i0, size_t i1) { return patches[i0]->adpcm.size() > patches[i1]->adpcm.size(); };
+    std::stable_sort(order.begin(), order.end(), longer);
+    std::vector<size_t> holders(patches.size());
+    std::map<uint64_t, std::vector<size_t>> stored;
+    for (auto index : order)
+    {
+        // Hash the first block with FNV-1a.
+        const data_span &adpcm = patches[index]->adpcm;
+        assert(adpcm.size() >= PSXDMH_ADPCM_BLOCK_SIZE);
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t byte = 0; byte < PSXDMH_ADPCM_BLOCK_SIZE; ++byte)
+        {
+            hash = (hash ^ adpcm[byte]) * 0x100000001b3ULL;
+        }
+
+        // Share the data of a stored patch if it starts with this patch's data.
+        std::vector<size_t> &candidates = stored[hash];
+        auto matches = [&](size_t candidate)
+        {
+            const data_span &other = patches[candidate]->adpcm;
+            return other.size() >= adpcm.size() && memcmp(other.data(), adpcm.data(), adpcm.size()) == 0;
+        };
+        auto found = std::find_if(candidates.cbegin(), candidates.cend(), matches);
+        if (found != candidates.cend())
+        {
+            holders[index] = *found;
+        }
+        else
+        {
+            holders[index] = index;
+            candidates.push_back(index);
+        }
+    }
+    return holders;
+}
+
+
+//
+// Load the WMD file from the bundle.
+//
+
+void
+data_bundle::load_wmd(wmd_file &wmd) const
+{
+    wmd.parse(m_wmd, m_file_name);
+}
+
+
+//
+// Load the patches from the bundle.
+//
+
+void
+data_bundle::load_lcd(lcd_file &lcd, const std::vector<bool> *wanted) const
+{
+    lcd.parse_located(m_data, m_file_name, m_patches, wanted);
+}
+
+
+}; //namespace psxdmh
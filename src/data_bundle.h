@@ -0,0 +1,107 @@
+// psxdmh/src/data_bundle.h
+// Single-file bundle of the music data.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PSXDMH_SRC_DATA_BUNDLE_H
+#define PSXDMH_SRC_DATA_BUNDLE_H
+
+
+#include "lcd_file.h"
+#include "mapped_file.h"
+#include "utility.h"
+#include "wmd_file.h"
+
+
+namespace psxdmh
+{
+
+
+// Bundle holding a WMD file and a set of patches in a single file, designed to
+// be memory mapped and used in place. The bundle consists of:
+//
+//  - A header: the signature "PXBD", the format version, the offset and size
+//    of the WMD data, the number of patches and the offset of the patch
+//    directory, and the total size of the bundle. All values are 32-bit
+//    little-endian.
+//  - The patch directory, in ID order. Each entry is the 16-bit patch ID, 16
+//    bits of padding, and the 32-bit offset and size of the patch's ADPCM
+//    data.
+//  - The WMD data, in the same form as a WMD file.
+//  - The ADPCM data for each patch.
+//
+// The WMD data and each patch start on a 64 byte boundary. The ADPCM data is
+// only stored once when it is shared by several patches, so directory entries
+// may overlap. Patches and song tracks loaded from a bundle refer directly to
+// the mapped file. All errors are reported by a thrown std::string.
+class data_bundle : public uncopyable
+{
+public:
+
+    // Construction. The bundle is mapped and its header and patch directory
+    // are checked. Note that the constructor will throw an exception if it
+    // encounters an error.
+    data_bundle(std::string file_name);
+
+    // Test if a file is a bundle. This only checks the signature.
+    static bool is_bundle(std::string file_name);
+
+    // Details of a bundle that has been written: its size, the number of
+    // patches, the number of distinct bodies of ADPCM data stored for them,
+    // and the bytes of ADPCM data saved by sharing.
+    struct write_details
+    {
+        size_t size;
+        size_t patches;
+        size_t bodies;
+        size_t bytes_saved;
+    };
+
+    // Write a bundle holding a WMD file and the patches in an LCD set. Patches
+    // whose ADPCM data is identical to another patch's, or to the start of a
+    // longer patch's, share the stored data.
+    static write_details write(std::string file_name, const wmd_file &wmd, const lcd_file &lcd);
+
+    // Load the WMD file from the bundle.
+    void load_wmd(wmd_file &wmd) const;
+
+    // Load the patches from the bundle. If a set of wanted patch IDs is given,
+    // only those patches are loaded.
+    void load_lcd(lcd_file &lcd, const std::vector<bool> *wanted = nullptr) const;
+
+private:
+
+    // Find the patches that can share the ADPCM data of another patch. The
+    // result gives the index of the patch holding the data for each patch,
+    // which is its own index if the data is stored for it.
+    static std::vector<size_t> share_patches(const std::vector<const patch *> &patches);
+
+    // Name of the bundle.
+    std::string m_file_name;
+
+    // Contents of the bundle, and the WMD data within it.
+    data_span m_data;
+    data_span m_wmd;
+
+    // Directory of patches.
+    std::vector<patch_location> m_patches;
+};
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_DATA_BUNDLE_H
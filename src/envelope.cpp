@@ -30,9 +30,29 @@ namespace psxdmh
 //
 
 envelope::envelope(uint16_t spu_ads, uint16_t spu_sr) :
+    envelope(settings(spu_ads, spu_sr))
+{
+}
+
+
+//
+// Construction from decoded registers.
+//
+
+envelope::envelope(const settings &decoded) :
     m_phase(ep_attack),
     m_volume(0),
     m_cycle_repeats(1), m_cycle_wait(1), m_cycle_current_wait(1), m_cycle_step(0)
+{
+    std::copy(decoded.m_config, decoded.m_config + ep_number_of_phases, m_config);
+}
+
+
+//
+// Decode the SPU ADSR registers.
+//
+
+envelope::settings::settings(uint16_t spu_ads, uint16_t spu_sr)
 {
     // Configure each phase.
     m_config[ep_attack].method = (spu_ads & 0x8000) == 0 ? method::linear : method::exponential;
@@ -36,6 +36,11 @@ public:
     // parameters correspond to the two SPU ADSR registers.
     envelope(uint16_t spu_ads, uint16_t spu_sr);
 
+    // Construction from registers that have already been decoded. This avoids
+    // decoding the same registers every time a note is played.
+    class settings;
+    envelope(const settings &decoded);
+
     // Test if the envelope is currently running. Once started, the envelope
     // will run until the release phase drops the envelope volume to 0.
     virtual bool is_running() const { return m_phase != ep_stopped; }
@@ -48,6 +53,12 @@ public:
     // triggered.
     void release();
 
+    // Test whether the release phase has started.
+    bool is_released() const { return m_phase == ep_release || m_phase == ep_stopped; }
+
+    // Current envelope volume, from 0.0 to 1.0.
+    mono_t level() const { return mono_t(m_volume) / 0x7fff; }
+
     // Dump details about the envelope.
     void dump(std::string indent);
 
@@ -120,6 +131,23 @@ private:
 };
 
 
+// Envelope configuration decoded from the two SPU ADSR registers.
+class envelope::settings
+{
+public:
+
+    // Construction.
+    settings(uint16_t spu_ads, uint16_t spu_sr);
+
+private:
+
+    friend class envelope;
+
+    // Configuration for each phase.
+    config m_config[ep_number_of_phases];
+};
+
+
 }; //namespace psxdmh
 
 
@@ -19,17 +19,25 @@
 #include "global.h"
 
 #include "adpcm.h"
+#include "async_stage.h"
+#include "async_writer.h"
 #include "channel.h"
 #include "extract_audio.h"
+#include "flac_file.h"
 #include "lcd_file.h"
 #include "normalizer.h"
 #include "options.h"
+#include "pipeline.h"
+#include "resampler.h"
 #include "reverb.h"
+#include "shard_renderer.h"
 #include "silencer.h"
 #include "song_player.h"
 #include "statistics.h"
+#include "stem_player.h"
 #include "track_player.h"
 #include "utility.h"
+#include "version.h"
 #include "volume.h"
 #include "wav_file.h"
 #include "wmd_file.h"
@@ -46,12 +54,27 @@ namespace psxdmh
 #endif // Target.
 
 
+// Factory creating a song or track player that has been fast forwarded by the
+// given number of samples. Held notes are rebuilt over at most the length of
+// the shard warm-up.
+typedef std::function<module_stereo *(uint64_t skip)> player_factory;
+
+
 // Forwards.
-static void extract_music(module_stereo *source, uint16_t song_index, std::string wav_file_name, const options &opts);
-static module_stereo *construct_graph(module_stereo *module, uint16_t song_index, std::string wav_file_name, const options &opts, statistics_stereo *&statistics, normalizer_stereo *&normalizer);
-static uint32_t write_wav_file(module_stereo *module, std::string wav_file_name, const options &opts);
-static void display_music_statistics(const options &opts, uint32_t ticks, song_player *song_module, statistics_stereo *statistics, normalizer_stereo *normalizer);
-static std::string default_song_name(uint16_t song_index);
+static void extract_music(player_factory make_player, uint16_t song_index, std::string wav_file_name, const options &opts);
+static module_stereo *construct_graph(module_stereo *module, player_factory make_player, uint16_t song_index, std::string wav_file_name, const options &opts, bool quiet, statistics_stereo *&statistics, normalizer_stereo *&normalizer, std::vector<const async_stage_stereo *> &stages, shard_renderer *&shards);
+static module_stereo *construct_render(module_stereo *module, const options &opts, reverb_preset preset, mono_t reverb_volume);
+static module_stereo *add_async_stage(module_stereo *module, std::string name, const options &opts, std::vector<const async_stage_stereo *> &stages);
+static module_stereo *construct_pipeline(module_stereo *module, const options &opts, statistics_stereo *statistics);
+template <typename Chain> static module_stereo *pipeline_add_volume(module_stereo *module, const options &opts, Chain chain);
+template <typename Chain> static module_stereo *pipeline_add_low_pass(module_stereo *module, const options &opts, Chain chain);
+template <typename Chain> static module_stereo *pipeline_add_high_pass(module_stereo *module, const options &opts, Chain chain);
+static uint32_t write_wav_file(module_stereo *module, std::string wav_file_name, const options &opts, const normalizer_stereo *normalizer, bool catch_interrupt = true);
+static void display_music_statistics(const options &opts, uint32_t ticks, song_player *song_module, const realtime_governor *governor, statistics_stereo *statistics, normalizer_stereo *normalizer, const std::vector<const async_stage_stereo *> &stages, const shard_renderer *shards);
+static std::string default_song_name(uint16_t song_index, const options &opts);
+static std::string output_extension(const options &opts);
+static bool has_extension(std::string name, std::string extension);
+static bool is_flac_name(std::string name, const options &opts);
 static void default_reverb(uint16_t song_index, reverb_preset &preset, mono_t &volume);
 static void status_callback(uint32_t seconds, double rate, std::string operation);
 #ifdef PSXDMH_CATCH_CTRL_C
@@ -59,12 +82,6 @@ static void signal_handler(int);
 #endif // PSXDMH_CATCH_CTRL_C
 
 
-// Global setjmp buffer.
-#ifdef PSXDMH_CATCH_CTRL_C
-static jmp_buf g_env;
-#endif // PSXDMH_CATCH_CTRL_C
-
-
 //
 // Extract a range of songs.
 //
@@ -80,10 +97,16 @@ extract_songs(const std::vector<uint16_t> &song_indexes, const wmd_file &wmd, co
         {
             message::writef(verbosity::normal, "\n");
         }
-        std::string wav_name = !output_name.empty() ? output_name : default_song_name(*iter);
+        std::string wav_name = !output_name.empty() ? output_name : default_song_name(*iter, opts);
         message::writef(verbosity::normal, "Extracting song %u (%s)\n", *iter, wav_name.c_str());
-        module_stereo *module = new song_player(*iter, wmd, lcd, opts);
-        extract_music(module, *iter, wav_name, opts);
+        uint16_t song_index = *iter;
+        auto make_player = [song_index, &wmd, &lcd, &opts](uint64_t skip)
+        {
+            song_player *player = new song_player(song_index, wmd, lcd, opts);
+            player->fast_forward(skip, uint64_t(opts.shard_warm_up) * opts.render_rate);
+            return static_cast<module_stereo *>(player);
+        };
+        extract_music(make_player, song_index, wav_name, opts);
     }
 }
 
@@ -105,9 +128,137 @@ extract_track(uint16_t song_index, uint16_t track_index, const wmd_file &wmd, co
         throw std::string("Invalid track index.");
     }
 
-    // Create the track player and extract the music.
-    module_stereo *module = new track_player(song_index, track_index, wmd, lcd, opts);
-    extract_music(module, song_index, wav_file_name, opts);
+    // Extract the music using track players.
+    auto make_player = [song_index, track_index, &wmd, &lcd, &opts](uint64_t skip)
+    {
+        track_player *player = new track_player(song_index, track_index, wmd, lcd, opts);
+        player->fast_forward(skip, uint64_t(opts.shard_warm_up) * opts.render_rate);
+        return static_cast<module_stereo *>(player);
+    };
+    extract_music(make_player, song_index, wav_file_name, opts);
+}
+
+
+//
+// Extract every track of a song to its own file, along with the full mix, in a
+// single pass.
+//
+
+void
+extract_stems(uint16_t song_index, const wmd_file &wmd, const lcd_file &lcd, std::string output_name, const options &opts)
+{
+    // Validate the song index. The tracks are named after the mix.
+    if (song_index >= wmd.songs())
+    {
+        throw std::string("Invalid song index.");
+    }
+    assert(opts.shard_length == 0);
+    std::string mix_name = !output_name.empty() ? output_name : default_song_name(song_index, opts);
+    std::string extension = is_flac_name(mix_name, opts) ? ".flac" : ".wav";
+    std::string base_name = mix_name;
+    if (has_extension(base_name, extension))
+    {
+        base_name.erase(base_name.length() - extension.length());
+    }
+    message::writef(verbosity::normal, "Extracting stems of song %u (%s)\n", song_index, mix_name.c_str());
+
+    // Details of each output. The mix is first, followed by the tracks.
+    struct output
+    {
+        std::string wav_name;
+        std::unique_ptr<module_stereo> module;
+        statistics_stereo *statistics;
+        normalizer_stereo *normalizer;
+        std::vector<const async_stage_stereo *> stages;
+        uint32_t ticks;
+        std::exception_ptr error;
+        std::thread worker;
+    };
+
+    // Create every output of the player, then start it. The player has to be
+    // running before the graphs are constructed, as some modules, such as the
+    // resamplers, read their first samples when they are created.
+    stem_player player(song_index, wmd, lcd, opts);
+    std::vector<std::unique_ptr<output>> outputs;
+    for (size_t index = 0; index <= player.tracks(); ++index)
+    {
+        std::unique_ptr<output> out(new output);
+        out->wav_name = index == 0 ? mix_name : base_name + " - Track " + int_to_string(int(index - 1)) + extension;
+        out->ticks = 0;
+        out->module.reset(index == 0 ? player.mix_output() : player.track_output(index - 1));
+        outputs.push_back(std::move(out));
+    }
+    player.start();
+
+    // Construct the usual graph for each output, all fed by the one player.
+    // Only the graph for the mix reports progress.
+    for (size_t index = 0; index < outputs.size(); ++index)
+    {
+        output &out = *outputs[index];
+        shard_renderer *shards;
+        module_stereo *graph = construct_graph(out.module.get(), nullptr, song_index, out.wav_name, opts, index > 0, out.statistics, out.normalizer, out.stages, shards);
+        out.module.release();
+        out.module.reset(graph);
+    }
+
+    // Write the tracks on worker threads and the mix on this thread, so that
+    // all of the outputs are consumed together. A track that fails releases
+    // its graph straight away so that it doesn't hold up the player.
+    auto write_track = [&opts](output *out)
+    {
+        try
+        {
+            out->ticks = write_wav_file(out->module.get(), out->wav_name, opts, out->normalizer, false);
+        }
+        catch (...)
+        {
+            out->error = std::current_exception();
+            out->module.reset();
+        }
+    };
+    for (size_t index = 1; index < outputs.size(); ++index)
+    {
+        outputs[index]->worker = start_worker(write_track, outputs[index].get());
+    }
+    auto join_tracks = [&outputs]()
+    {
+        for (size_t index = 1; index < outputs.size(); ++index)
+        {
+            outputs[index]->worker.join();
+        }
+    };
+    try
+    {
+        outputs.front()->ticks = write_wav_file(outputs.front()->module.get(), mix_name, opts, outputs.front()->normalizer);
+    }
+    catch (...)
+    {
+        player.stop();
+        join_tracks();
+        throw;
+    }
+    join_tracks();
+    for (auto &out : outputs)
+    {
+        if (out->error)
+        {
+            std::rethrow_exception(out->error);
+        }
+    }
+
+    // Display a summary of what was written.
+    const output &mix = *outputs.front();
+    display_music_statistics(opts, mix.ticks, nullptr, player.governor(), mix.statistics, mix.normalizer, mix.stages, nullptr);
+    for (size_t index = 1; index < outputs.size(); ++index)
+    {
+        std::string time = ticks_to_time(outputs[index]->ticks, opts.sample_rate);
+        message::writef(verbosity::normal, "  Track %u: %s (%s)\n", unsigned(index - 1), time.c_str(), outputs[index]->wav_name.c_str());
+    }
+    if (player.failed_to_repeat())
+    {
+        assert(opts.play_count > 1);
+        message::writef(verbosity::normal, "Warning: song does not contain a repeat point; play-count ignored.\n");
+    }
 }
 
 
@@ -141,36 +292,51 @@ extract_patch(const std::vector<uint16_t> &patch_ids, const lcd_file &lcd, std::
         {
             message::writef(verbosity::normal, "\n");
         }
-        std::string wav_name = !output_name.empty() ? output_name : std::string("Patch ") + int_to_string(*iter) + ".wav";
+        std::string wav_name = !output_name.empty() ? output_name : std::string("Patch ") + int_to_string(*iter) + output_extension(opts);
         message::writef(verbosity::normal, "Extracting patch %u (%s)\n", *iter, wav_name.c_str());
         std::unique_ptr<module_mono> module(new adpcm(patch->adpcm, opts.play_count));
-        wav_file_mono wav_file_writer;
-        uint32_t length = wav_file_writer.write(module.get(), wav_name, opts.sample_rate);
+        uint32_t length;
+        if (is_flac_name(wav_name, opts))
+        {
+            flac_file_mono flac_file_writer;
+            length = flac_file_writer.write(module.get(), wav_name, opts.sample_rate);
+        }
+        else
+        {
+            wav_file_mono wav_file_writer;
+            length = wav_file_writer.write(module.get(), wav_name, opts.sample_rate, opts.raw_stream);
+        }
         message::writef(verbosity::normal, "Extracted %u samples (%.3lf seconds).\n", length, length / double(opts.sample_rate));
     }
 }
 
 
 //
-// Handle the common part of song and track extraction. This function takes
-// ownership of the module.
+// Handle the common part of song and track extraction.
 //
 
 static void
-extract_music(module_stereo *source, uint16_t song_index, std::string wav_file_name, const options &opts)
+extract_music(player_factory make_player, uint16_t song_index, std::string wav_file_name, const options &opts)
 {
-    // Remember if module was a song_player.
-    assert(source != nullptr);
+    // Create the player. When rendering in shards each shard creates its own,
+    // and this one is only needed as a reference to verify them against.
+    module_stereo *source = opts.shard_length == 0 || opts.verify_shards ? make_player(0) : nullptr;
+
+    // Remember if module was a song_player, and find any real time governor.
     song_player *song_module = dynamic_cast<song_player *>(source);
+    track_player *track_module = dynamic_cast<track_player *>(source);
+    const realtime_governor *governor = song_module != nullptr ? song_module->governor() : track_module != nullptr ? track_module->governor() : nullptr;
 
     // Construct the graph of audio modules.
     statistics_stereo *statistics;
     normalizer_stereo *normalizer;
-    std::unique_ptr<module_stereo> module(construct_graph(source, song_index, wav_file_name, opts, statistics, normalizer));
+    std::vector<const async_stage_stereo *> stages;
+    shard_renderer *shards;
+    std::unique_ptr<module_stereo> module(construct_graph(source, make_player, song_index, wav_file_name, opts, false, statistics, normalizer, stages, shards));
 
     // Extract the music and display a summary of what was written.
-    uint32_t ticks = write_wav_file(module.get(), wav_file_name, opts);
-    display_music_statistics(opts, ticks, song_module, statistics, normalizer);
+    uint32_t ticks = write_wav_file(module.get(), wav_file_name, opts, normalizer);
+    display_music_statistics(opts, ticks, song_module, governor, statistics, normalizer, stages, shards);
 }
 
 
@@ -179,35 +345,67 @@ extract_music(module_stereo *source, uint16_t song_index, std::string wav_file_n
 //
 
 static module_stereo *
-construct_graph(module_stereo *module, uint16_t song_index, std::string wav_file_name, const options &opts, statistics_stereo *&statistics, normalizer_stereo *&normalizer)
+construct_graph(module_stereo *module, player_factory make_player, uint16_t song_index, std::string wav_file_name, const options &opts, bool quiet, statistics_stereo *&statistics, normalizer_stereo *&normalizer, std::vector<const async_stage_stereo *> &stages, shard_renderer *&shards)
 {
     // Decide whether to show progress messages. This is only done when the
-    // verbosity is high enough, and when the output is going to a terminal.
-    assert(module != nullptr);
-    bool show_progress = message::verbosity() >= verbosity::normal && is_interactive(stdout);
+    // verbosity is high enough, and when messages are going to a terminal.
+    // Quiet graphs, used for the secondary outputs of a single render, never
+    // show progress. The module is only optional when rendering in shards.
+    assert(module != nullptr || opts.shard_length > 0);
+    bool show_progress = !quiet && message::verbosity() >= verbosity::normal && is_interactive(message::output());
+
+    // Reset the channel and output statistics. This must be done before any
+    // stage starts generating audio on another thread. Quiet graphs share the
+    // statistics of the main graph.
+    if (!quiet)
+    {
+        channel::reset_statistics();
+        channel_limiter::reset_statistics();
+        async_writer::reset_statistics();
+    }
 
     // Add maximum gap processing. This needs to be done before reverb to
     // prevent the reverb effect from prolonging the gaps.
     if (opts.maximum_gap >= 0.0)
     {
-        int32_t gap = std::max(int32_t(opts.maximum_gap * opts.sample_rate), 1);
+        assert(opts.shard_length == 0);
+        int32_t gap = std::max(int32_t(opts.maximum_gap * opts.render_rate), 1);
         module = new silencer_stereo(module, -1, -1, gap);
     }
 
-    // Add reverb.
+    // Decide on the reverb.
     reverb_preset preset = opts.reverb_preset;
     mono_t reverb_volume = opts.reverb_volume;
     if (preset == rp_auto)
     {
         default_reverb(song_index, preset, reverb_volume);
-        if (reverb_volume > 0.0)
+        if (reverb_volume > 0.0 && !quiet)
         {
             message::writef(verbosity::verbose, "Reverb defaulted to %s at %.1lf dB.\n", reverb_to_string(preset).c_str(), amplitude_to_decibels(reverb_volume));
         }
     }
-    if (preset != rp_off)
+
+    // Render the notes and reverb, either serially or in shards. Each shard
+    // starts its own player at the start of its warm-up.
+    shards = nullptr;
+    if (opts.shard_length == 0)
     {
-        module = new reverb(module, opts.sample_rate, preset, reverb_volume, opts.sinc_window);
+        module = add_async_stage(module, "Notes", opts, stages);
+        module = construct_render(module, opts, preset, reverb_volume);
+        if (preset != rp_off)
+        {
+            module = add_async_stage(module, "Reverb", opts, stages);
+        }
+    }
+    else
+    {
+        auto make_shard = [make_player, &opts, preset, reverb_volume](uint32_t start)
+        {
+            return construct_render(make_player(uint64_t(start) * opts.render_rate), opts, preset, reverb_volume);
+        };
+        module_stereo *reference = module != nullptr ? construct_render(module, opts, preset, reverb_volume) : nullptr;
+        shards = new shard_renderer(make_shard, opts.sample_rate, opts.shard_length, opts.shard_warm_up, std::thread::hardware_concurrency(), reference);
+        module = shards;
     }
 
     // Add lead-in and lead-out processing. The lead-out needs to be done after
@@ -221,6 +419,21 @@ construct_graph(module_stereo *module, uint16_t song_index, std::string wav_file
         module = new silencer_stereo(module, lead_in, lead_out, -1);
     }
 
+    // Unless normalization is in use, the remaining stages are simple enough to
+    // be run as a single statically composed pipeline.
+    normalizer = nullptr;
+    statistics = nullptr;
+    if (!opts.normalize && !opts.dynamic_graph)
+    {
+        if (message::verbosity() >= verbosity::normal)
+        {
+            statistics_mode mode = message::verbosity() >= verbosity::verbose ? statistics_mode::detailed : statistics_mode::progress;
+            statistics_stereo::callback callback = show_progress ? status_callback : nullptr;
+            statistics = new statistics_stereo(nullptr, mode, opts.sample_rate, callback, "Extracted");
+        }
+        return add_async_stage(construct_pipeline(module, opts, statistics), "Output", opts, stages);
+    }
+
     // Add filtering.
     if (opts.high_pass != 0)
     {
@@ -231,16 +444,25 @@ construct_graph(module_stereo *module, uint16_t song_index, std::string wav_file
         module = new filter_stereo(module, filter_type::low_pass, double(opts.low_pass) / opts.sample_rate);
     }
 
-    // Apply normalization, and use a statistics module to report progress of
-    // the extraction upstream of the normalizer.
-    normalizer = nullptr;
-    if (opts.normalize)
+    // Apply normalization. A WAV file is written once at the original level
+    // and rescaled in place afterwards. Otherwise the audio is buffered in a
+    // temporary file, with a statistics module to report progress of the
+    // extraction upstream of the normalizer. The file goes beside the output,
+    // or in the system's temporary directory when writing to standard output.
+    bool deferred = opts.normalize && !is_standard_output(wav_file_name) && !is_flac_name(wav_file_name, opts);
+    if (deferred)
     {
-        if (message::verbosity() >= verbosity::normal)
+        normalizer = new normalizer_stereo(module);
+        module = normalizer;
+    }
+    else if (opts.normalize)
+    {
+        if (message::verbosity() >= verbosity::normal && !quiet)
         {
             module = new statistics_stereo(module, statistics_mode::progress, opts.sample_rate, status_callback, "Extracted");
         }
-        normalizer = new normalizer_stereo(module, wav_file_name + ".tmp");
+        std::string temp_prefix = is_standard_output(wav_file_name) ? combine_paths(temp_directory(), PSXDMH_NAME ".") : wav_file_name + ".";
+        normalizer = new normalizer_stereo(module, temp_prefix);
         module = normalizer;
     }
 
@@ -251,58 +473,183 @@ construct_graph(module_stereo *module, uint16_t song_index, std::string wav_file
     }
 
     // Display progress and collect statistics if required.
-    statistics = nullptr;
     if (message::verbosity() >= verbosity::normal)
     {
         statistics_mode mode = message::verbosity() >= verbosity::verbose ? statistics_mode::detailed : statistics_mode::progress;
         statistics_stereo::callback callback = show_progress ? status_callback : nullptr;
-        std::string operation = opts.normalize ? "Normalized" : "Extracted";
+        std::string operation = opts.normalize && !deferred ? "Normalized" : "Extracted";
         statistics = new statistics_stereo(module, mode, opts.sample_rate, callback, operation);
         module = statistics;
     }
-    channel::reset_maximum_channels();
+    return add_async_stage(module, "Output", opts, stages);
+}
+
+
+//
+// Add the reverb and conversion to the output rate to the graph.
+//
+
+static module_stereo *
+construct_render(module_stereo *module, const options &opts, reverb_preset preset, mono_t reverb_volume)
+{
+    // Add reverb.
+    assert(module != nullptr);
+    if (preset != rp_off)
+    {
+        module = new reverb(module, opts.render_rate, preset, reverb_volume, opts.sinc_window);
+    }
+
+    // Convert from the render rate to the output rate. Everything up to this
+    // point runs at the render rate so that high output rates don't multiply
+    // the cost of every note and of the reverb.
+    if (opts.render_rate != opts.sample_rate)
+    {
+        assert(opts.render_rate < opts.sample_rate);
+        module = new resampler_sinc_stereo(module, opts.sinc_window, opts.render_rate, opts.sample_rate);
+    }
     return module;
 }
 
 
 //
-// Write the output of an audio module to a WAV file.
+// Add an asynchronous stage to the graph so that everything upstream of it runs
+// on a separate thread. Nothing is added unless the options ask for it.
+//
+
+static module_stereo *
+add_async_stage(module_stereo *module, std::string name, const options &opts, std::vector<const async_stage_stereo *> &stages)
+{
+    assert(module != nullptr);
+    if (!opts.async)
+    {
+        return module;
+    }
+    async_stage_stereo *stage = new async_stage_stereo(module, name);
+    stages.push_back(stage);
+    return stage;
+}
+
+
+//
+// Construct a pipeline for the filtering, volume, and statistics stages of the
+// graph. Each of the pipeline_add functions adds one optional stage before
+// handing on to the function for the preceding stage. As each stage is chosen
+// the type of the chain changes, so every combination of options results in a
+// separately compiled pipeline. The statistics object may be nullptr.
+//
+
+static module_stereo *
+construct_pipeline(module_stereo *module, const options &opts, statistics_stereo *statistics)
+{
+    assert(module != nullptr);
+    if (statistics != nullptr)
+    {
+        typedef pipeline_statistics<stereo_t, pipeline_end<stereo_t>> chain;
+        return pipeline_add_volume(module, opts, chain(statistics, pipeline_end<stereo_t>()));
+    }
+    return pipeline_add_volume(module, opts, pipeline_end<stereo_t>());
+}
+
+template <typename Chain>
+static module_stereo *
+pipeline_add_volume(module_stereo *module, const options &opts, Chain chain)
+{
+    if (opts.volume != 1.0)
+    {
+        return pipeline_add_low_pass(module, opts, pipeline_volume<stereo_t, Chain>(opts.volume, std::move(chain)));
+    }
+    return pipeline_add_low_pass(module, opts, std::move(chain));
+}
+
+template <typename Chain>
+static module_stereo *
+pipeline_add_low_pass(module_stereo *module, const options &opts, Chain chain)
+{
+    if (opts.low_pass != 0)
+    {
+        double cut_off = double(opts.low_pass) / opts.sample_rate;
+        return pipeline_add_high_pass(module, opts, pipeline_filter<stereo_t, Chain>(filter_type::low_pass, cut_off, std::move(chain)));
+    }
+    return pipeline_add_high_pass(module, opts, std::move(chain));
+}
+
+template <typename Chain>
+static module_stereo *
+pipeline_add_high_pass(module_stereo *module, const options &opts, Chain chain)
+{
+    if (opts.high_pass != 0)
+    {
+        double cut_off = double(opts.high_pass) / opts.sample_rate;
+        typedef pipeline_filter<stereo_t, Chain> stage;
+        return new pipeline<stereo_t, stage>(module, stage(filter_type::high_pass, cut_off, std::move(chain)));
+    }
+    return new pipeline<stereo_t, Chain>(module, std::move(chain));
+}
+
+
+//
+// Write the output of an audio module to a WAV or FLAC file. A deferred
+// normalizer's adjustment is applied to the file once it has been written.
 //
 
 static uint32_t
-write_wav_file(module_stereo *module, std::string wav_file_name, const options &opts)
+write_wav_file(module_stereo *module, std::string wav_file_name, const options &opts, const normalizer_stereo *normalizer, bool catch_interrupt)
 {
     assert(module != nullptr);
     uint32_t ticks;
     wav_file_stereo wav_file_writer;
+    flac_file_stereo flac_file_writer;
     try
     {
 #ifdef PSXDMH_CATCH_CTRL_C
-        // Convert SIGINT into an exception to provoke the clean up code.
-        if (setjmp(g_env) != 0)
+        // Convert SIGINT into an exception to provoke the clean up code. The
+        // handler requests an interrupt, and the writers throw when they next
+        // check for one. This is only done on the main thread.
+        if (catch_interrupt)
         {
-            // Throw an exception to terminate.
-            signal(SIGINT, SIG_DFL);
-            throw std::string("Aborted.");
+            signal(SIGINT, signal_handler);
         }
-        signal(SIGINT, signal_handler);
 #endif // PSXDMH_CATCH_CTRL_C
 
         // Extract the music.
-        ticks = wav_file_writer.write(module, wav_file_name, opts.sample_rate);
+        if (is_flac_name(wav_file_name, opts))
+        {
+            ticks = flac_file_writer.write(module, wav_file_name, opts.sample_rate);
+        }
+        else if (normalizer != nullptr && normalizer->is_deferred())
+        {
+            ticks = wav_file_writer.write(module, wav_file_name, opts.sample_rate, false, true);
+            wav_file_writer.rescale(normalizer->adjustment());
+        }
+        else
+        {
+            ticks = wav_file_writer.write(module, wav_file_name, opts.sample_rate, opts.raw_stream);
+        }
 
 #ifdef PSXDMH_CATCH_CTRL_C
         // Remove the signal handler.
-        signal(SIGINT, SIG_DFL);
+        if (catch_interrupt)
+        {
+            signal(SIGINT, SIG_DFL);
+        }
 #endif // PSXDMH_CATCH_CTRL_C
     }
     catch (...)
     {
-        // If an error occurs remove the WAV file.
-        if (wav_file_writer.is_file_open())
+#ifdef PSXDMH_CATCH_CTRL_C
+        // Remove the signal handler.
+        if (catch_interrupt)
+        {
+            signal(SIGINT, SIG_DFL);
+        }
+#endif // PSXDMH_CATCH_CTRL_C
+
+        // If an error occurs remove the file.
+        if (wav_file_writer.is_file_open() || flac_file_writer.is_file_open())
         {
             message::writef(verbosity::verbose, "Aborting: removing '%s'.\n", wav_file_name.c_str());
             wav_file_writer.abort();
+            flac_file_writer.abort();
         }
         throw;
     }
@@ -315,7 +662,7 @@ write_wav_file(module_stereo *module, std::string wav_file_name, const options &
 //
 
 static void
-display_music_statistics(const options &opts, uint32_t ticks, song_player *song_module, statistics_stereo *statistics, normalizer_stereo *normalizer)
+display_music_statistics(const options &opts, uint32_t ticks, song_player *song_module, const realtime_governor *governor, statistics_stereo *statistics, normalizer_stereo *normalizer, const std::vector<const async_stage_stereo *> &stages, const shard_renderer *shards)
 {
     // Display a summary of what was written.
     std::string time = ticks_to_time(ticks, opts.sample_rate);
@@ -332,14 +679,67 @@ display_music_statistics(const options &opts, uint32_t ticks, song_player *song_
     {
         message::writef(verbosity::verbose, "  Normalization: %.1lf dB\n", normalizer->adjustment_db());
     }
-    if (message::verbosity() >= verbosity::verbose)
+    if (message::verbosity() >= verbosity::verbose && shards == nullptr)
     {
+        // Channel counts are left out for shards as their warm-ups overlap.
         message::writef(verbosity::verbose, "  Maximum Channels: %d\n", channel::maximum_channels());
+        if (channel::started_channels() > 0)
+        {
+            message::writef(verbosity::verbose, "  Culled Channels: %d of %d (%.1lf%%)\n", channel::culled_channels(), channel::started_channels(), 100.0 * channel::culled_channels() / channel::started_channels());
+        }
+        if (opts.max_voices > 0)
+        {
+            message::writef(verbosity::verbose, "  Stolen Channels: %d\n", channel_limiter::stolen_channels());
+            message::writef(verbosity::verbose, "  Dropped Notes: %d\n", channel_limiter::dropped_notes());
+        }
+    }
+    if (message::verbosity() >= verbosity::verbose && governor != nullptr)
+    {
+        for (size_t level = 0; level < realtime_governor::levels; ++level)
+        {
+            uint32_t window = governor->level_sinc_window(level);
+            std::string method = window > 0 ? std::string("sinc window ") + int_to_string(window) : std::string("linear");
+            std::string time = ticks_to_time(uint32_t(governor->samples_at_level(level)), opts.render_rate);
+            message::writef(verbosity::verbose, "  Quality Level %u (%s): %s\n", unsigned(level), method.c_str(), time.c_str());
+        }
+    }
+    if (message::verbosity() >= verbosity::verbose)
+    {
+        for (auto stage : stages)
+        {
+            message::writef(verbosity::verbose, "  %s Thread: Queue Depth %.1lf of %u, Input Stall %.2lfs, Output Stall %.2lfs\n",
+                stage->name().c_str(), stage->average_depth(), unsigned(stage->capacity()), stage->input_stall(), stage->output_stall());
+        }
+    }
+    if (message::verbosity() >= verbosity::verbose)
+    {
+        message::writef(verbosity::verbose, "  Output: %.1lf MB written, %.2lfs blocked on I/O\n", async_writer::bytes_written() / 1048576.0, async_writer::blocked_time());
     }
     if (message::verbosity() >= verbosity::verbose && statistics != nullptr)
     {
-        message::writef(verbosity::verbose, "  Maximum Level: %.1lf dB / %.1lf%%\n", statistics->maximum_db(), statistics->maximum_amplitude() * 100.0);
-        message::writef(verbosity::verbose, "  RMS: %.1lf dB\n", statistics->rms_db());
+        // The statistics of deferred normalization were measured before the
+        // adjustment was applied.
+        bool deferred = normalizer != nullptr && normalizer->is_deferred();
+        double gain_db = deferred ? normalizer->adjustment_db() : 0.0;
+        double maximum = deferred ? statistics->maximum_amplitude() * normalizer->adjustment() : statistics->maximum_amplitude();
+        message::writef(verbosity::verbose, "  Maximum Level: %.1lf dB / %.1lf%%\n", statistics->maximum_db() + gain_db, maximum * 100.0);
+        message::writef(verbosity::verbose, "  RMS: %.1lf dB\n", statistics->rms_db() + gain_db);
+    }
+    if (shards != nullptr && opts.verify_shards)
+    {
+        for (size_t seam = 0; seam < shards->seams(); ++seam)
+        {
+            std::string time = ticks_to_time(uint32_t(shards->seam_position(seam)), opts.sample_rate);
+            mono_t deviation = shards->seam_deviation(seam);
+            if (deviation > 0.0f)
+            {
+                message::writef(verbosity::normal, "  Seam at %s: maximum deviation %.1lf dB\n", time.c_str(), amplitude_to_decibels(deviation));
+            }
+            else
+            {
+                message::writef(verbosity::normal, "  Seam at %s: exact\n", time.c_str());
+            }
+        }
     }
     if (song_module != nullptr && song_module->failed_to_repeat())
     {
@@ -355,7 +755,7 @@ display_music_statistics(const options &opts, uint32_t ticks, song_player *song_
 //
 
 static std::string
-default_song_name(uint16_t song_index)
+default_song_name(uint16_t song_index, const options &opts)
 {
     static const std::string default_song_names[120] =
     {
@@ -483,10 +883,44 @@ default_song_name(uint16_t song_index)
 
     if (song_index < numberof(default_song_names))
     {
-        return std::string(default_song_names[song_index]) + ".wav";
+        return std::string(default_song_names[song_index]) + output_extension(opts);
     }
     assert(!"Unhandled song name.");
-    return std::string("S") + int_to_string(song_index) + ".wav";
+    return std::string("S") + int_to_string(song_index) + output_extension(opts);
+}
+
+
+//
+// Get the extension for generated output file names.
+//
+
+static std::string
+output_extension(const options &opts)
+{
+    return opts.flac ? ".flac" : ".wav";
+}
+
+
+//
+// Test if a file name has an extension, ignoring case.
+//
+
+static bool
+has_extension(std::string name, std::string extension)
+{
+    return name.length() > extension.length() && strcasecmp(name.substr(name.length() - extension.length()).c_str(), extension.c_str()) == 0;
+}
+
+
+//
+// Decide whether to write a file as FLAC. A .flac or .wav extension decides
+// this, otherwise the flac option does.
+//
+
+static bool
+is_flac_name(std::string name, const options &opts)
+{
+    return has_extension(name, ".flac") || (opts.flac && !has_extension(name, ".wav"));
 }
 
 
@@ -575,13 +1009,15 @@ status_callback(uint32_t seconds, double rate, std::string operation)
 #ifdef PSXDMH_CATCH_CTRL_C
 
 //
-// Signal handler to longjmp back to the caller.
+// Signal handler to request an interrupt. A second Ctrl-C terminates as
+// usual, in case the writer never gets to check for the interrupt.
 //
 
 static void
 signal_handler(int)
 {
-    longjmp(g_env, 1);
+    signal(SIGINT, SIG_DFL);
+    request_interrupt();
 }
 
 #endif // PSXDMH_CATCH_CTRL_C
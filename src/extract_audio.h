@@ -36,6 +36,10 @@ extern void extract_songs(const std::vector<uint16_t> &song_indexes, const wmd_f
 // Extract one track from a song.
 extern void extract_track(uint16_t song_index, uint16_t track_index, const wmd_file &wmd, const lcd_file &lcd, std::string wav_file_name, const options &opts);
 
+// Extract every track of a song to its own file, along with the full mix, in a
+// single pass.
+extern void extract_stems(uint16_t song_index, const wmd_file &wmd, const lcd_file &lcd, std::string output_name, const options &opts);
+
 // Extract a range of patches from an LCD file.
 extern void extract_patch(const std::vector<uint16_t> &patch_ids, const lcd_file &lcd, std::string output_name, const options &opts);
 
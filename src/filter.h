@@ -35,7 +35,9 @@ enum class filter_type
 };
 
 
-// Butterworth IIR filtering (second order).
+// Butterworth IIR filter calculations (second order). This holds the filter
+// coefficients and state, and is used both by the filter module and by any
+// code that needs to embed a filter directly rather than as a separate module.
 //
 // This filter reduces the amplitude of the source by -3.01 dB at the cut off
 // frequency. This equates to a reduction in amplitude to 0.7071. The response
@@ -49,47 +51,48 @@ enum class filter_type
 // cut_off+1   -12 dB   : 0.2512
 // cut_off+2   -24 dB   : 0.0631
 // cut_off+3   -36 dB   : 0.0158
-template <typename S> class filter : public module<S>
+template <typename S> class filter_core
 {
 public:
 
     // Construction. The cut_off represents the frequency as a fraction of the
     // sample rate where the filter reduces the amplitude by -3 dB. The cut_off
     // must be in the range [0.0, 0.5).
-    filter(module<S> *source, filter_type type, double cut_off) :
-        module<S>(source),
+    filter_core(filter_type type, double cut_off) :
         m_type(type)
     {
         // Initialize the filter coefficients and clear the filter.
-        assert(source != nullptr);
         assert(type == filter_type::low_pass || type == filter_type::high_pass);
         assert(cut_off >= 0.0 && cut_off < 0.5);
         adjust(cut_off);
         clear();
     }
 
-    // Test whether the module is still generating output.
-    virtual bool is_running() const
+    // Test whether the filter is still generating output from previous input.
+    bool is_running() const
     {
-        // Run while the filter is non-silent or the source is running.
-        return !is_silent(m_x1) || !is_silent(m_x2) || !is_silent(m_y1) || !is_silent(m_y2)
-            || this->source()->is_running();
+        return !is_silent(m_x1) || !is_silent(m_x2) || !is_silent(m_y1) || !is_silent(m_y2);
     }
 
-    // Get the next sample.
-    virtual bool next(S &s)
+    // Test whether the filter has fully settled, so that silent input produces
+    // silent output without changing the filter's state.
+    bool is_settled() const
+    {
+        return m_x1 == 0.0f && m_x2 == 0.0f && m_y1 == 0.0f && m_y2 == 0.0f;
+    }
+
+    // Filter a sample.
+    S process(const S &source_sample)
     {
         // Calculate the new output value.
-        S source_sample;
-        bool source_live = this->source()->next(source_sample);
-        s = flush_denorm(m_a0 * source_sample + m_a1 * m_x1 + m_a2 * m_x2 - m_b1 * m_y1 - m_b2 * m_y2);
+        S s = flush_denorm(m_a0 * source_sample + m_a1 * m_x1 + m_a2 * m_x2 - m_b1 * m_y1 - m_b2 * m_y2);
 
         // Shift the stored previous values along by one.
         m_x2 = m_x1;
         m_x1 = source_sample;
         m_y2 = m_y1;
         m_y1 = s;
-        return source_live || !is_silent(m_x1) || !is_silent(m_x2) || !is_silent(m_y1) || !is_silent(m_y2);
+        return s;
     }
 
     // Set a new cut off without clearing the filter.
@@ -127,8 +130,6 @@ public:
         m_b2 = mono_t(b2 / b0);
     }
 
-private:
-
     // Clear the filter's previous input and output values.
     void clear()
     {
@@ -138,6 +139,8 @@ private:
         m_y2 = 0.0;
     }
 
+private:
+
     // Filter type: high pass or low pass.
     filter_type m_type;
 
@@ -160,6 +163,67 @@ private:
 };
 
 
+// Butterworth IIR filtering module. See filter_core for details of the filter.
+template <typename S> class filter : public module<S>
+{
+public:
+
+    // Construction. The cut_off represents the frequency as a fraction of the
+    // sample rate where the filter reduces the amplitude by -3 dB. The cut_off
+    // must be in the range [0.0, 0.5).
+    filter(module<S> *source, filter_type type, double cut_off) :
+        module<S>(source),
+        m_core(type, cut_off),
+        m_tail_running(false)
+    {
+        assert(source != nullptr);
+    }
+
+    // Construction from a filter core whose coefficients have already been
+    // calculated. The core must be clear.
+    filter(module<S> *source, const filter_core<S> &core) :
+        module<S>(source),
+        m_core(core),
+        m_tail_running(false)
+    {
+        assert(source != nullptr);
+        assert(m_core.is_settled());
+    }
+
+    // Test whether the module is still generating output.
+    virtual bool is_running() const
+    {
+        // Run while the filter is non-silent or the source is running.
+        return m_tail_running || this->source_running();
+    }
+
+    // Get the next sample.
+    virtual bool next(S &s)
+    {
+        S source_sample;
+        bool source_live = this->source()->next(source_sample);
+        s = m_core.process(source_sample);
+        m_tail_running = m_core.is_running();
+        return source_live || m_tail_running;
+    }
+
+    // Silence passes through unchanged once the filter has settled.
+    virtual uint32_t silence_ahead(uint32_t limit) const { return m_core.is_settled() ? this->source()->silence_ahead(limit) : 0; }
+    virtual void skip_silence(uint32_t count) { assert(m_core.is_settled()); this->source()->skip_silence(count); }
+
+    // Set a new cut off without clearing the filter.
+    void adjust(double cut_off) { m_core.adjust(cut_off); }
+
+private:
+
+    // Filter calculations.
+    filter_core<S> m_core;
+
+    // Whether the filter was still non-silent after the last sample.
+    bool m_tail_running;
+};
+
+
 // Types for mono and stereo filters.
 typedef filter<mono_t> filter_mono;
 typedef filter<stereo_t> filter_stereo;
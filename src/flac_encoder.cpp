@@ -0,0 +1,955 @@
+// psxdmh/src/flac_encoder.cpp
+// FLAC encoder.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "global.h"
+
+#include "flac_encoder.h"
+
+
+namespace psxdmh
+{
+
+
+// Number of samples per channel in each frame, and the number of frames
+// encoded together by a worker thread.
+#define PSXDMH_FLAC_BLOCK_SIZE          (4096)
+#define PSXDMH_FLAC_BATCH_FRAMES        (16)
+
+// Limits on prediction and residual coding.
+#define PSXDMH_FLAC_MAX_FIXED_ORDER     (4)
+#define PSXDMH_FLAC_MAX_LPC_ORDER       (8)
+#define PSXDMH_FLAC_LPC_PRECISION       (12)
+#define PSXDMH_FLAC_MAX_LPC_SHIFT       (15)
+#define PSXDMH_FLAC_MAX_PARTITION_ORDER (8)
+#define PSXDMH_FLAC_MAX_RICE_PARAMETER  (14)
+
+// Size of the STREAMINFO block.
+#define PSXDMH_FLAC_STREAMINFO_SIZE     (34)
+
+// Channel assignments for stereo frames.
+#define PSXDMH_FLAC_INDEPENDENT         (1)
+#define PSXDMH_FLAC_LEFT_SIDE           (8)
+#define PSXDMH_FLAC_SIDE_RIGHT          (9)
+#define PSXDMH_FLAC_MID_SIDE            (10)
+
+
+// Writer packing bits into bytes, most significant bit first.
+class bit_writer : public uncopyable
+{
+public:
+
+    // Construction. Bytes are appended to data as they are completed.
+    bit_writer(std::vector<uint8_t> &data) : m_data(data), m_bits(0), m_count(0) {}
+
+    // Write the low bits of an unsigned value. At most 32 bits may be written.
+    void write(uint32_t value, unsigned bits)
+    {
+        assert(bits <= 32);
+        if (bits > 0)
+        {
+            m_bits = (m_bits << bits) | (value & ((uint64_t(1) << bits) - 1));
+            m_count += bits;
+            while (m_count >= 8)
+            {
+                m_count -= 8;
+                m_data.push_back(uint8_t(m_bits >> m_count));
+            }
+        }
+    }
+
+    // Write a signed value in two's complement.
+    void write_signed(int32_t value, unsigned bits) { write(uint32_t(value), bits); }
+
+    // Write a value in unary: the given number of zero bits followed by a one.
+    void write_unary(uint32_t zeros)
+    {
+        for (; zeros >= 32; zeros -= 32)
+        {
+            write(0, 32);
+        }
+        write(1, zeros + 1);
+    }
+
+    // Pad with zero bits to the next byte boundary.
+    void align() { write(0, (8 - m_count) % 8); }
+
+private:
+
+    // Data being written.
+    std::vector<uint8_t> &m_data;
+
+    // Bits not yet written to the data, and the number of them.
+    uint64_t m_bits;
+    unsigned m_count;
+};
+
+
+// Plan for the Rice coding of a residual: the partition order, the parameter
+// for each partition, and the estimated number of bits.
+struct rice_plan
+{
+    unsigned order;
+    std::vector<unsigned> parameters;
+    uint64_t bits;
+};
+
+
+// Ways of coding a subframe.
+enum class subframe_type
+{
+    constant,
+    verbatim,
+    fixed,
+    lpc
+};
+
+
+// Plan for coding a subframe: the type, the predictor coefficients (only their
+// number for fixed predictors), the residual and its coding, and the total
+// estimated number of bits.
+struct subframe_plan
+{
+    subframe_type type;
+    std::vector<int32_t> coefficients;
+    int shift;
+    std::vector<int32_t> residual;
+    rice_plan rice;
+    uint64_t bits;
+};
+
+
+// Forwards.
+static void encode_frame(const int16_t *samples, size_t count, unsigned channels, uint32_t frame_number, std::vector<uint8_t> &data);
+static subframe_plan plan_subframe(const int32_t *x, size_t n, unsigned bps);
+static void write_subframe(bit_writer &writer, const int32_t *x, size_t n, unsigned bps, const subframe_plan &plan);
+static unsigned best_fixed_order(const int32_t *x, size_t n, uint64_t &error);
+static void fixed_residual(const int32_t *x, size_t n, unsigned order, int32_t *residual);
+static bool compute_lpc(const int32_t *x, size_t n, unsigned bps, std::vector<int32_t> &coefficients, int &shift);
+static std::vector<double> tukey_window(size_t n);
+static bool lpc_residual(const int32_t *x, size_t n, const std::vector<int32_t> &coefficients, int shift, int32_t *residual);
+static rice_plan plan_rice(const int32_t *residual, size_t n, unsigned predictor_order);
+static void write_residual(bit_writer &writer, const int32_t *residual, size_t n, unsigned predictor_order, const rice_plan &plan);
+static void write_utf8(bit_writer &writer, uint32_t value);
+static uint8_t crc8(const uint8_t *data, size_t bytes);
+static uint16_t crc16(const uint8_t *data, size_t bytes);
+
+
+//
+// Construction.
+//
+
+flac_encoder::flac_encoder(safe_file &file, unsigned channels, uint32_t sample_rate, unsigned threads) :
+    m_file(file),
+    m_channels(channels),
+    m_sample_rate(sample_rate),
+    m_threads(std::max(threads, 1U)),
+    m_frames(0),
+    m_samples(0),
+    m_min_frame_size(UINT32_MAX), m_max_frame_size(0)
+{
+    // Write the signature and a STREAMINFO block with the totals unknown.
+    // These are filled in by finish if the file can seek.
+    assert(channels == 1 || channels == 2);
+    assert(sample_rate > 0 && sample_rate < (1 << 20));
+    std::vector<uint8_t> header;
+    bit_writer writer(header);
+    writer.write(0x664c6143, 32);
+    writer.write(1, 1);
+    writer.write(0, 7);
+    writer.write(PSXDMH_FLAC_STREAMINFO_SIZE, 24);
+    writer.write(PSXDMH_FLAC_BLOCK_SIZE, 16);
+    writer.write(PSXDMH_FLAC_BLOCK_SIZE, 16);
+    writer.write(0, 24);
+    writer.write(0, 24);
+    writer.write(m_sample_rate, 20);
+    writer.write(m_channels - 1, 3);
+    writer.write(15, 5);
+    writer.write(0, 4);
+    writer.write(0, 32);
+    for (int word = 0; word < 4; ++word)
+    {
+        writer.write(0, 32);
+    }
+    m_file.write(header.data(), header.size());
+    m_writer.reset(new async_writer(m_file));
+    m_filling.reset(new batch);
+}
+
+
+//
+// Destruction.
+//
+
+flac_encoder::~flac_encoder()
+{
+    for (auto &b : m_batches)
+    {
+        b->worker.join();
+    }
+}
+
+
+//
+// Add interleaved samples.
+//
+
+void
+flac_encoder::write(const int16_t *samples, size_t count)
+{
+    // Fill batches, handing each to a worker as it becomes full.
+    assert(samples != nullptr || count == 0);
+    const size_t batch_samples = size_t(PSXDMH_FLAC_BLOCK_SIZE) * PSXDMH_FLAC_BATCH_FRAMES * m_channels;
+    size_t total = count * m_channels;
+    m_samples += count;
+    while (total > 0)
+    {
+        size_t copy = std::min(total, batch_samples - m_filling->samples.size());
+        m_filling->samples.insert(m_filling->samples.end(), samples, samples + copy);
+        samples += copy;
+        total -= copy;
+        if (m_filling->samples.size() == batch_samples)
+        {
+            submit();
+        }
+    }
+}
+
+
+//
+// Encode the remaining audio and complete the file.
+//
+
+void
+flac_encoder::finish()
+{
+    // Write out all of the batches.
+    submit();
+    while (!m_batches.empty())
+    {
+        write_oldest();
+    }
+    m_writer->flush();
+
+    // Fill in the totals in the STREAMINFO block. The minimum and maximum
+    // frame sizes come first, then the total samples after the 20-bit sample
+    // rate, 3-bit channel count, and 5-bit sample size.
+    if (!m_file.is_stream())
+    {
+        std::vector<uint8_t> totals;
+        bit_writer writer(totals);
+        writer.write(m_max_frame_size > 0 ? m_min_frame_size : 0, 24);
+        writer.write(m_max_frame_size, 24);
+        writer.write(m_sample_rate, 20);
+        writer.write(m_channels - 1, 3);
+        writer.write(15, 5);
+        writer.write(uint32_t(m_samples >> 32), 4);
+        writer.write(uint32_t(m_samples), 32);
+        m_file.seek(12);
+        m_file.write(totals.data(), totals.size());
+    }
+}
+
+
+//
+// Hand the batch being filled to a worker thread.
+//
+
+void
+flac_encoder::submit()
+{
+    if (!m_filling->samples.empty())
+    {
+        // Make room for the batch, then start encoding it.
+        if (m_batches.size() >= m_threads)
+        {
+            double start = time_now();
+            write_oldest();
+            add_output_wait_time(time_now() - start);
+        }
+        size_t count = m_filling->samples.size() / m_channels;
+        m_filling->first_frame = m_frames;
+        m_frames += uint32_t((count + PSXDMH_FLAC_BLOCK_SIZE - 1) / PSXDMH_FLAC_BLOCK_SIZE);
+        m_filling->worker = start_worker(&flac_encoder::encode, this, std::ref(*m_filling));
+        m_batches.push_back(std::move(m_filling));
+        m_filling.reset(new batch);
+    }
+}
+
+
+//
+// Wait for the oldest batch to finish and write it to the file.
+//
+
+void
+flac_encoder::write_oldest()
+{
+    assert(!m_batches.empty());
+    std::unique_ptr<batch> b = std::move(m_batches.front());
+    m_batches.pop_front();
+    b->worker.join();
+    if (b->error)
+    {
+        std::rethrow_exception(b->error);
+    }
+    m_writer->write(b->data.data(), b->data.size());
+    for (auto size : b->frame_sizes)
+    {
+        m_min_frame_size = std::min(m_min_frame_size, size);
+        m_max_frame_size = std::max(m_max_frame_size, size);
+    }
+}
+
+
+//
+// Encode a batch.
+//
+
+void
+flac_encoder::encode(batch &b) const
+{
+    try
+    {
+        size_t count = b.samples.size() / m_channels;
+        uint32_t frame = b.first_frame;
+        for (size_t start = 0; start < count; start += PSXDMH_FLAC_BLOCK_SIZE, ++frame)
+        {
+            size_t before = b.data.size();
+            size_t block = std::min(count - start, size_t(PSXDMH_FLAC_BLOCK_SIZE));
+            encode_frame(&b.samples[start * m_channels], block, m_channels, frame, b.data);
+            b.frame_sizes.push_back(uint32_t(b.data.size() - before));
+        }
+    }
+    catch (...)
+    {
+        b.error = std::current_exception();
+    }
+}
+
+
+//  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+
+//
+// Encode a frame.
+//
+
+static void
+encode_frame(const int16_t *samples, size_t count, unsigned channels, uint32_t frame_number, std::vector<uint8_t> &data)
+{
+    // Separate the channels.
+    assert(count > 0 && count <= PSXDMH_FLAC_BLOCK_SIZE);
+    std::vector<int32_t> left(count), right(channels == 2 ? count : 0);
+    for (size_t index = 0; index < count; ++index)
+    {
+        left[index] = samples[index * channels];
+        if (channels == 2)
+        {
+            right[index] = samples[index * channels + 1];
+        }
+    }
+
+    // Plan the subframes. Stereo frames are planned for each way of combining
+    // the channels, and the smallest is used. The side channel needs an extra
+    // bit.
+    unsigned assignment = channels - 1;
+    std::vector<int32_t> mid, side;
+    const std::vector<int32_t> *first = &left, *second = &right;
+    unsigned first_bps = 16, second_bps = 16;
+    subframe_plan first_plan = plan_subframe(left.data(), count, 16);
+    subframe_plan second_plan;
+    if (channels == 2)
+    {
+        mid.resize(count);
+        side.resize(count);
+        for (size_t index = 0; index < count; ++index)
+        {
+            mid[index] = (left[index] + right[index]) >> 1;
+            side[index] = left[index] - right[index];
+        }
+        subframe_plan left_plan = first_plan;
+        subframe_plan right_plan = plan_subframe(right.data(), count, 16);
+        subframe_plan mid_plan = plan_subframe(mid.data(), count, 16);
+        subframe_plan side_plan = plan_subframe(side.data(), count, 17);
+        uint64_t best = left_plan.bits + right_plan.bits;
+        assignment = PSXDMH_FLAC_INDEPENDENT;
+        second_plan = right_plan;
+        if (left_plan.bits + side_plan.bits < best)
+        {
+            best = left_plan.bits + side_plan.bits;
+            assignment = PSXDMH_FLAC_LEFT_SIDE;
+            second = &side;
+            second_bps = 17;
+            second_plan = side_plan;
+        }
+        if (side_plan.bits + right_plan.bits < best)
+        {
+            best = side_plan.bits + right_plan.bits;
+            assignment = PSXDMH_FLAC_SIDE_RIGHT;
+            first = &side;
+            first_bps = 17;
+            first_plan = side_plan;
+            second = &right;
+            second_bps = 16;
+            second_plan = right_plan;
+        }
+        if (mid_plan.bits + side_plan.bits < best)
+        {
+            assignment = PSXDMH_FLAC_MID_SIDE;
+            first = &mid;
+            first_bps = 16;
+            first_plan = mid_plan;
+            second = &side;
+            second_bps = 17;
+            second_plan = side_plan;
+        }
+    }
+
+    // Write the frame header: the sync code with fixed-size blocks, the block
+    // size, the sample rate taken from STREAMINFO, the channel assignment, 16
+    // bits per sample, and the frame number. A short final block has its size
+    // given at the end of the header.
+    size_t start = data.size();
+    bit_writer writer(data);
+    unsigned size_code = count == PSXDMH_FLAC_BLOCK_SIZE ? 12 : count <= 256 ? 6 : 7;
+    writer.write(0xfff8, 16);
+    writer.write(size_code, 4);
+    writer.write(0, 4);
+    writer.write(assignment, 4);
+    writer.write(4, 3);
+    writer.write(0, 1);
+    write_utf8(writer, frame_number);
+    if (size_code != 12)
+    {
+        writer.write(uint32_t(count - 1), size_code == 6 ? 8 : 16);
+    }
+    writer.write(crc8(data.data() + start, data.size() - start), 8);
+
+    // Write the subframes and the footer.
+    write_subframe(writer, first->data(), count, first_bps, first_plan);
+    if (channels == 2)
+    {
+        write_subframe(writer, second->data(), count, second_bps, second_plan);
+    }
+    writer.align();
+    writer.write(crc16(data.data() + start, data.size() - start), 16);
+}
+
+
+//
+// Plan the coding of a subframe, choosing whichever is smallest.
+//
+
+static subframe_plan
+plan_subframe(const int32_t *x, size_t n, unsigned bps)
+{
+    // Silence, and any other unchanging signal, is stored as a constant.
+    subframe_plan plan;
+    plan.type = subframe_type::constant;
+    plan.shift = 0;
+    plan.bits = 8 + bps;
+    if (std::all_of(x, x + n, [x](int32_t v) { return v == x[0]; }))
+    {
+        return plan;
+    }
+
+    // Fall back on storing the samples as they are.
+    plan.type = subframe_type::verbatim;
+    plan.bits = 8 + uint64_t(n) * bps;
+
+    // Try the best fixed predictor.
+    uint64_t error;
+    unsigned fixed_order = best_fixed_order(x, n, error);
+    std::vector<int32_t> residual(n);
+    fixed_residual(x, n, fixed_order, residual.data());
+    rice_plan rice = plan_rice(residual.data(), n, fixed_order);
+    uint64_t bits = 8 + uint64_t(fixed_order) * bps + rice.bits;
+    if (bits < plan.bits)
+    {
+        plan.type = subframe_type::fixed;
+        plan.bits = bits;
+        plan.residual.swap(residual);
+        plan.rice = rice;
+        plan.coefficients.resize(fixed_order);
+    }
+
+    // Try an LPC predictor. This is only worthwhile if the block is long
+    // enough to pay for the coefficients.
+    std::vector<int32_t> coefficients;
+    int shift;
+    if (n > PSXDMH_FLAC_MAX_LPC_ORDER * 4 && compute_lpc(x, n, bps, coefficients, shift))
+    {
+        residual.resize(n);
+        if (lpc_residual(x, n, coefficients, shift, residual.data()))
+        {
+            unsigned order = unsigned(coefficients.size());
+            rice = plan_rice(residual.data(), n, order);
+            bits = 8 + uint64_t(order) * (bps + PSXDMH_FLAC_LPC_PRECISION) + 9 + rice.bits;
+            if (bits < plan.bits)
+            {
+                plan.type = subframe_type::lpc;
+                plan.bits = bits;
+                plan.residual.swap(residual);
+                plan.rice = rice;
+                plan.coefficients.swap(coefficients);
+                plan.shift = shift;
+            }
+        }
+    }
+    return plan;
+}
+
+
+//
+// Write a subframe.
+//
+
+static void
+write_subframe(bit_writer &writer, const int32_t *x, size_t n, unsigned bps, const subframe_plan &plan)
+{
+    // Each subframe starts with a zero bit, the subframe type, and a zero bit
+    // for no wasted bits. Predicted subframes follow this with the warm-up
+    // samples.
+    unsigned order = unsigned(plan.coefficients.size());
+    switch (plan.type)
+    {
+    case subframe_type::constant:
+        writer.write(0x00, 8);
+        writer.write_signed(x[0], bps);
+        return;
+
+    case subframe_type::verbatim:
+        writer.write(0x02, 8);
+        for (size_t index = 0; index < n; ++index)
+        {
+            writer.write_signed(x[index], bps);
+        }
+        return;
+
+    case subframe_type::fixed:
+        writer.write(0x10 | (order << 1), 8);
+        for (size_t index = 0; index < order; ++index)
+        {
+            writer.write_signed(x[index], bps);
+        }
+        break;
+
+    case subframe_type::lpc:
+        writer.write(0x40 | ((order - 1) << 1), 8);
+        for (size_t index = 0; index < order; ++index)
+        {
+            writer.write_signed(x[index], bps);
+        }
+        writer.write(PSXDMH_FLAC_LPC_PRECISION - 1, 4);
+        writer.write_signed(plan.shift, 5);
+        for (auto c : plan.coefficients)
+        {
+            writer.write_signed(c, PSXDMH_FLAC_LPC_PRECISION);
+        }
+        break;
+    }
+    write_residual(writer, plan.residual.data(), n, order, plan.rice);
+}
+
+
+//
+// Find the order of fixed predictor giving the smallest total error.
+//
+
+static unsigned
+best_fixed_order(const int32_t *x, size_t n, uint64_t &error)
+{
+    // The errors of all the orders are measured over the same samples, which
+    // means skipping the warm-up of the highest order.
+    uint64_t total[PSXDMH_FLAC_MAX_FIXED_ORDER + 1] = {};
+    for (size_t index = PSXDMH_FLAC_MAX_FIXED_ORDER; index < n; ++index)
+    {
+        int64_t e0 = x[index];
+        int64_t e1 = e0 - x[index - 1];
+        int64_t e2 = e1 - (int64_t(x[index - 1]) - x[index - 2]);
+        int64_t e3 = e2 - (int64_t(x[index - 1]) - 2 * int64_t(x[index - 2]) + x[index - 3]);
+        int64_t e4 = e3 - (int64_t(x[index - 1]) - 3 * int64_t(x[index - 2]) + 3 * int64_t(x[index - 3]) - x[index - 4]);
+        total[0] += std::abs(e0);
+        total[1] += std::abs(e1);
+        total[2] += std::abs(e2);
+        total[3] += std::abs(e3);
+        total[4] += std::abs(e4);
+    }
+    unsigned order = 0;
+    for (unsigned o = 1; o <= PSXDMH_FLAC_MAX_FIXED_ORDER && o < n; ++o)
+    {
+        if (total[o] < total[order])
+        {
+            order = o;
+        }
+    }
+    error = total[order];
+    return order;
+}
+
+
+//
+// Calculate the residual of a fixed predictor.
+//
+
+static void
+fixed_residual(const int32_t *x, size_t n, unsigned order, int32_t *residual)
+{
+    // The residual is stored without the warm-up samples.
+    for (size_t index = order; index < n; ++index)
+    {
+        int32_t r;
+        switch (order)
+        {
+        case 0:     r = x[index]; break;
+        case 1:     r = x[index] - x[index - 1]; break;
+        case 2:     r = x[index] - 2 * x[index - 1] + x[index - 2]; break;
+        case 3:     r = x[index] - 3 * x[index - 1] + 3 * x[index - 2] - x[index - 3]; break;
+        default:    r = x[index] - 4 * x[index - 1] + 6 * x[index - 2] - 4 * x[index - 3] + x[index - 4]; break;
+        }
+        residual[index - order] = r;
+    }
+}
+
+
+//
+// Calculate quantized LPC coefficients for a block.
+//
+
+static bool
+compute_lpc(const int32_t *x, size_t n, unsigned bps, std::vector<int32_t> &coefficients, int &shift)
+{
+    // Apply a Tukey window tapering the first and last quarter of the block,
+    // and find the autocorrelation. The window for a full block is only
+    // calculated once.
+    static const std::vector<double> full_window = tukey_window(PSXDMH_FLAC_BLOCK_SIZE);
+    std::vector<double> short_window;
+    if (n != PSXDMH_FLAC_BLOCK_SIZE)
+    {
+        short_window = tukey_window(n);
+    }
+    const std::vector<double> &window = n == PSXDMH_FLAC_BLOCK_SIZE ? full_window : short_window;
+    std::vector<double> windowed(n);
+    for (size_t index = 0; index < n; ++index)
+    {
+        windowed[index] = x[index] * window[index];
+    }
+    double autoc[PSXDMH_FLAC_MAX_LPC_ORDER + 1];
+    for (size_t lag = 0; lag <= PSXDMH_FLAC_MAX_LPC_ORDER; ++lag)
+    {
+        double sum = 0.0;
+        for (size_t index = lag; index < n; ++index)
+        {
+            sum += windowed[index] * windowed[index - lag];
+        }
+        autoc[lag] = sum;
+    }
+    if (autoc[0] <= 0.0)
+    {
+        return false;
+    }
+
+    // Use the Levinson-Durbin recursion to find the predictor for each order,
+    // and keep the order with the smallest estimated size: the coefficients
+    // plus the expected bits for each residual sample.
+    double a[PSXDMH_FLAC_MAX_LPC_ORDER + 1] = {};
+    double best_a[PSXDMH_FLAC_MAX_LPC_ORDER + 1] = {};
+    double error = autoc[0];
+    double best_bits = 0.0;
+    unsigned best_order = 0;
+    for (unsigned order = 1; order <= PSXDMH_FLAC_MAX_LPC_ORDER; ++order)
+    {
+        double acc = autoc[order];
+        for (unsigned k = 1; k < order; ++k)
+        {
+            acc -= a[k] * autoc[order - k];
+        }
+        double reflection = acc / error;
+        double previous[PSXDMH_FLAC_MAX_LPC_ORDER + 1];
+        memcpy(previous, a, sizeof(a));
+        a[order] = reflection;
+        for (unsigned k = 1; k < order; ++k)
+        {
+            a[k] = previous[k] - reflection * previous[order - k];
+        }
+        error *= 1.0 - reflection * reflection;
+        double per_sample = error > 0.0 ? std::max(0.5 * log2(error * 0.5 / n), 0.0) : 0.0;
+        double bits = order * double(bps + PSXDMH_FLAC_LPC_PRECISION) + per_sample * (n - order);
+        if (best_order == 0 || bits < best_bits)
+        {
+            best_bits = bits;
+            best_order = order;
+            memcpy(best_a, a, sizeof(a));
+        }
+        if (error <= 0.0)
+        {
+            break;
+        }
+    }
+
+    // Quantize the coefficients so that the largest uses the full precision,
+    // carrying the rounding error from one coefficient to the next.
+    double largest = 0.0;
+    for (unsigned k = 1; k <= best_order; ++k)
+    {
+        largest = std::max(largest, fabs(best_a[k]));
+    }
+    if (largest <= 0.0)
+    {
+        return false;
+    }
+    int exponent;
+    frexp(largest, &exponent);
+    shift = std::min(PSXDMH_FLAC_LPC_PRECISION - exponent - 1, PSXDMH_FLAC_MAX_LPC_SHIFT);
+    if (shift < 0)
+    {
+        return false;
+    }
+    const int32_t limit = (1 << (PSXDMH_FLAC_LPC_PRECISION - 1)) - 1;
+    coefficients.resize(best_order);
+    double carry = 0.0;
+    for (unsigned k = 1; k <= best_order; ++k)
+    {
+        carry += best_a[k] * (1 << shift);
+        int32_t q = std::max(std::min(int32_t(lround(carry)), limit), -limit - 1);
+        carry -= q;
+        coefficients[k - 1] = q;
+    }
+    return true;
+}
+
+
+//
+// Create a Tukey window tapering the first and last quarter of a block.
+//
+
+static std::vector<double>
+tukey_window(size_t n)
+{
+    std::vector<double> window(n, 1.0);
+    size_t taper = n / 4;
+    for (size_t index = 0; index < taper; ++index)
+    {
+        window[index] = window[n - 1 - index] = 0.5 - 0.5 * cos(M_PI * index / taper);
+    }
+    return window;
+}
+
+
+//
+// Calculate the residual of an LPC predictor.
+//
+
+static bool
+lpc_residual(const int32_t *x, size_t n, const std::vector<int32_t> &coefficients, int shift, int32_t *residual)
+{
+    // The residual is stored without the warm-up samples. A predictor that
+    // performs so badly that the residual can't be coded is rejected.
+    size_t order = coefficients.size();
+    for (size_t index = order; index < n; ++index)
+    {
+        int64_t sum = 0;
+        for (size_t k = 0; k < order; ++k)
+        {
+            sum += int64_t(coefficients[k]) * x[index - k - 1];
+        }
+        int64_t r = x[index] - (sum >> shift);
+        if (r < -(int64_t(1) << 30) || r >= (int64_t(1) << 30))
+        {
+            return false;
+        }
+        residual[index - order] = int32_t(r);
+    }
+    return true;
+}
+
+
+//
+// Plan the Rice coding of a residual.
+//
+
+static rice_plan
+plan_rice(const int32_t *residual, size_t n, unsigned predictor_order)
+{
+    // Find the finest partitioning allowed. The block must divide evenly, and
+    // the first partition must have room for the warm-up samples.
+    unsigned max_order = 0;
+    while (max_order < PSXDMH_FLAC_MAX_PARTITION_ORDER && n % (size_t(2) << max_order) == 0 && (n >> (max_order + 1)) > predictor_order)
+    {
+        max_order++;
+    }
+
+    // Sum the folded residual in each of the finest partitions.
+    std::vector<uint64_t> sums(size_t(1) << max_order, 0);
+    size_t partition_size = n >> max_order;
+    for (size_t index = predictor_order; index < n; ++index)
+    {
+        int32_t r = residual[index - predictor_order];
+        sums[index / partition_size] += (uint32_t(r) << 1) ^ uint32_t(r >> 31);
+    }
+
+    // Estimate the size at each partition order, from finest to coarsest,
+    // merging pairs of partitions at each step. The best parameter for a
+    // partition is close to the log of its mean, and the size of each
+    // candidate is estimated from the sum.
+    rice_plan best;
+    best.order = 0;
+    best.bits = UINT64_MAX;
+    for (int order = int(max_order); order >= 0; --order)
+    {
+        rice_plan plan;
+        plan.order = unsigned(order);
+        plan.bits = 6;
+        size_t partitions = size_t(1) << order;
+        for (size_t p = 0; p < partitions; ++p)
+        {
+            uint64_t count = (n >> order) - (p == 0 ? predictor_order : 0);
+            unsigned guess = 0;
+            while (guess < PSXDMH_FLAC_MAX_RICE_PARAMETER && (count << (guess + 1)) < sums[p])
+            {
+                guess++;
+            }
+            unsigned parameter = guess;
+            uint64_t bits = UINT64_MAX;
+            for (unsigned k = guess > 0 ? guess - 1 : 0; k <= std::min(guess + 1, unsigned(PSXDMH_FLAC_MAX_RICE_PARAMETER)); ++k)
+            {
+                uint64_t estimate = count * (k + 1) + (sums[p] >> k);
+                if (estimate < bits)
+                {
+                    bits = estimate;
+                    parameter = k;
+                }
+            }
+            plan.parameters.push_back(parameter);
+            plan.bits += 4 + bits;
+        }
+        if (plan.bits < best.bits)
+        {
+            best = plan;
+        }
+        for (size_t p = 0; p < partitions / 2; ++p)
+        {
+            sums[p] = sums[2 * p] + sums[2 * p + 1];
+        }
+    }
+    return best;
+}
+
+
+//
+// Write a Rice coded residual.
+//
+
+static void
+write_residual(bit_writer &writer, const int32_t *residual, size_t n, unsigned predictor_order, const rice_plan &plan)
+{
+    // Write the coding method (Rice with 4-bit parameters) and the partition
+    // order, then each partition with its parameter.
+    writer.write(0, 2);
+    writer.write(plan.order, 4);
+    size_t partition_size = n >> plan.order;
+    size_t index = predictor_order;
+    for (size_t p = 0; p < plan.parameters.size(); ++p)
+    {
+        unsigned k = plan.parameters[p];
+        writer.write(k, 4);
+        for (size_t end = (p + 1) * partition_size; index < end; ++index)
+        {
+            // Fold the sign into the lowest bit, then write the high part in
+            // unary and the low k bits as they are. Short codes are written
+            // in one go.
+            int32_t r = residual[index - predictor_order];
+            uint32_t folded = (uint32_t(r) << 1) ^ uint32_t(r >> 31);
+            uint32_t high = folded >> k;
+            if (high + 1 + k <= 32)
+            {
+                writer.write((uint32_t(1) << k) | (folded & ((uint32_t(1) << k) - 1)), high + 1 + k);
+            }
+            else
+            {
+                writer.write_unary(high);
+                writer.write(folded, k);
+            }
+        }
+    }
+}
+
+
+//
+// Write a frame number in the UTF-8 style coding used by FLAC.
+//
+
+static void
+write_utf8(bit_writer &writer, uint32_t value)
+{
+    assert(value < 0x80000000);
+    if (value < 0x80)
+    {
+        writer.write(value, 8);
+        return;
+    }
+    unsigned extra = value < 0x800 ? 1 : value < 0x10000 ? 2 : value < 0x200000 ? 3 : value < 0x4000000 ? 4 : 5;
+    uint32_t lead = (0xff00 >> (extra + 1)) & 0xff;
+    writer.write(lead | (value >> (6 * extra)), 8);
+    for (unsigned byte = extra; byte-- > 0;)
+    {
+        writer.write(0x80 | ((value >> (6 * byte)) & 0x3f), 8);
+    }
+}
+
+
+//
+// Calculate the CRC-8 of a frame header (polynomial 0x07).
+//
+
+static uint8_t
+crc8(const uint8_t *data, size_t bytes)
+{
+    uint8_t crc = 0;
+    for (size_t index = 0; index < bytes; ++index)
+    {
+        crc ^= data[index];
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            crc = uint8_t((crc & 0x80) != 0 ? (crc << 1) ^ 0x07 : crc << 1);
+        }
+    }
+    return crc;
+}
+
+
+//
+// Calculate the CRC-16 of a frame (polynomial 0x8005).
+//
+
+static uint16_t
+crc16(const uint8_t *data, size_t bytes)
+{
+    uint16_t crc = 0;
+    for (size_t index = 0; index < bytes; ++index)
+    {
+        crc ^= uint16_t(data[index] << 8);
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            crc = uint16_t((crc & 0x8000) != 0 ? (crc << 1) ^ 0x8005 : crc << 1);
+        }
+    }
+    return crc;
+}
+
+
+}; //namespace psxdmh
@@ -0,0 +1,115 @@
+// psxdmh/src/flac_encoder.h
+// FLAC encoder.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PSXDMH_SRC_FLAC_ENCODER_H
+#define PSXDMH_SRC_FLAC_ENCODER_H
+
+
+#include "async_writer.h"
+#include "safe_file.h"
+
+
+namespace psxdmh
+{
+
+
+// Encoder for 16-bit mono or stereo FLAC. Each frame is predicted with either
+// a fixed polynomial or a quantized LPC filter, whichever codes smaller, and
+// the residual is Rice coded. Stereo frames pick the best of left/right,
+// left/side, side/right, and mid/side coding.
+//
+// Frames are independent of each other, so batches of them are encoded on
+// worker threads while more audio is supplied. Finished batches are written to
+// the file in order through an async_writer. When the file can seek, the
+// STREAMINFO block is completed once all the audio has been written; on
+// standard output the length is left as unknown. The MD5 signature of the
+// audio is not calculated, which FLAC marks by leaving it as zero. All errors
+// are reported by a thrown std::string.
+class flac_encoder : public uncopyable
+{
+public:
+
+    // Construction. This writes the stream header. The caller must ensure that
+    // the file remains valid for the life of this object.
+    flac_encoder(safe_file &file, unsigned channels, uint32_t sample_rate, unsigned threads);
+
+    // Destruction. Any batches still encoding are waited for and discarded.
+    ~flac_encoder();
+
+    // Add interleaved samples. The count is in frames of one sample for each
+    // channel.
+    void write(const int16_t *samples, size_t count);
+
+    // Encode the remaining audio, write everything to the file, and complete
+    // the header.
+    void finish();
+
+private:
+
+    // Batch of audio frames encoded by a worker thread.
+    struct batch
+    {
+        uint32_t first_frame;
+        std::vector<int16_t> samples;
+        std::vector<uint8_t> data;
+        std::vector<uint32_t> frame_sizes;
+        std::exception_ptr error;
+        std::thread worker;
+    };
+
+    // Hand the batch being filled to a worker thread, first writing out the
+    // oldest batch if the maximum number are in flight.
+    void submit();
+
+    // Wait for the oldest batch to finish and write it to the file.
+    void write_oldest();
+
+    // Encode a batch. This runs on the batch's worker thread.
+    void encode(batch &b) const;
+
+    // File being written, and the writer for the encoded frames.
+    safe_file &m_file;
+    std::unique_ptr<async_writer> m_writer;
+
+    // Stream format.
+    unsigned m_channels;
+    uint32_t m_sample_rate;
+
+    // Maximum number of batches in flight.
+    unsigned m_threads;
+
+    // Batch being filled.
+    std::unique_ptr<batch> m_filling;
+
+    // Batches being encoded, in order.
+    std::deque<std::unique_ptr<batch>> m_batches;
+
+    // Number of frames handed to batches so far.
+    uint32_t m_frames;
+
+    // Totals for the STREAMINFO block.
+    uint64_t m_samples;
+    uint32_t m_min_frame_size;
+    uint32_t m_max_frame_size;
+};
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_FLAC_ENCODER_H
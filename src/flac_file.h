@@ -0,0 +1,175 @@
+// psxdmh/src/flac_file.h
+// FLAC file writer.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PSXDMH_SRC_FLAC_FILE_H
+#define PSXDMH_SRC_FLAC_FILE_H
+
+
+#include "flac_encoder.h"
+#include "module.h"
+#include "safe_file.h"
+#include "sample.h"
+
+
+namespace psxdmh
+{
+
+
+// FLAC file writer, the counterpart of wav_file. The audio is encoded on
+// several threads while it is being generated. As with wav_file, a file name
+// of "-" writes to standard output. All errors are reported by a thrown
+// std::string.
+template <typename S> class flac_file : public uncopyable
+{
+public:
+
+    // Construction.
+    flac_file() : m_samples(0) {}
+
+    // Write the FLAC file from source. The return value gives the number of
+    // samples written.
+    uint32_t write(module<S> *source, std::string file_name, uint32_t sample_rate)
+    {
+        // Open the file and start the encoder.
+        assert(source != nullptr);
+        assert(sample_rate > 0);
+        assert(m_file == nullptr);
+        m_file_name = file_name;
+        m_file.reset(new safe_file(m_file_name, file_mode::write));
+        flac_encoder encoder(*m_file, channels(), sample_rate, std::thread::hardware_concurrency());
+
+        // Extract the source samples and pass them to the encoder in batches.
+        const size_t buffer_samples = 4096;
+        std::vector<int16_t> sample_buffer;
+        S s;
+        do
+        {
+            // Collect a set of samples.
+            check_interrupt();
+            sample_buffer.clear();
+            size_t samples = 0;
+            while (samples < buffer_samples)
+            {
+                // Silence known ahead of time is added without being
+                // generated.
+                uint32_t silent = source->silence_ahead(uint32_t(buffer_samples - samples));
+                if (silent > 0)
+                {
+                    source->skip_silence(silent);
+                    sample_buffer.resize(sample_buffer.size() + silent * channels(), 0);
+                }
+                else if (source->next(s))
+                {
+                    buffer_sample(sample_buffer, s);
+                    silent = 1;
+                }
+                else
+                {
+                    break;
+                }
+                samples += silent;
+                m_samples += silent;
+                if (m_samples > m_max_samples)
+                {
+                    throw std::string("Maximum FLAC file length exceeded.");
+                }
+            }
+            encoder.write(sample_buffer.data(), samples);
+        }
+        while (!sample_buffer.empty());
+
+        // Complete and close the file.
+        encoder.finish();
+        m_file->close();
+        m_file.reset();
+        return uint32_t(m_samples);
+    }
+
+    // Check if the file is open.
+    bool is_file_open() const { return m_file != nullptr; }
+
+    // Abort the writing of the FLAC file.
+    void abort()
+    {
+        if (m_file != nullptr)
+        {
+            // Ignore any exceptions.
+            try
+            {
+                m_file.reset();
+            }
+            catch (...)
+            {
+            }
+
+            // Remove the file. Standard output is left alone.
+            if (!is_standard_output(m_file_name))
+            {
+                remove(m_file_name.c_str());
+            }
+        }
+    }
+
+private:
+
+    // Number of channels.
+    static unsigned channels()
+    {
+        assert(sizeof(S) == sizeof(mono_t) || sizeof(S) == sizeof(stereo_t));
+        return sizeof(S) == sizeof(stereo_t) ? 2 : 1;
+    }
+
+    static void buffer_sample(std::vector<int16_t> &buffer, mono_t s)
+    {
+        buffer.push_back(sample_to_int(s));
+    }
+
+    static void buffer_sample(std::vector<int16_t> &buffer, stereo_t s)
+    {
+        buffer.push_back(sample_to_int(s.left));
+        buffer.push_back(sample_to_int(s.right));
+    }
+
+    // Name of the file.
+    std::string m_file_name;
+
+    // File wrapper.
+    std::unique_ptr<safe_file> m_file;
+
+    // Number of samples written to the file.
+    uint64_t m_samples;
+
+    // Maximum number of samples allowed, as the number is reported as a
+    // 32-bit value.
+    static const uint64_t m_max_samples;
+};
+
+
+// Maximum number of samples allowed.
+template <typename S> const uint64_t flac_file<S>::m_max_samples = 0xffffffff;
+
+
+// Types for mono and stereo FLAC file writers.
+typedef flac_file<mono_t> flac_file_mono;
+typedef flac_file<stereo_t> flac_file_stereo;
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_FLAC_FILE_H
@@ -41,22 +41,28 @@
 
 // Common includes.
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <chrono>
 #include <climits>
 #include <cmath>
-#include <csetjmp>
+#include <condition_variable>
+#include <csignal>
 #include <cstdarg>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
 #include <deque>
+#include <exception>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -65,13 +71,18 @@
 #if defined(PSXDMH_TARGET_MACOS)
     #include <sys/types.h>
     #include <sys/stat.h>
+    #include <sys/mman.h>
     #include <unistd.h>
     #include <dirent.h>
+    #include <fcntl.h>
+    #include <pthread.h>
+    #include <signal.h>
 #elif defined(PSXDMH_TARGET_WINDOWS)
     #define WIN32_LEAN_AND_MEAN
     #include <windows.h>
     #include <float.h>
     #include <io.h>
+    #include <fcntl.h>
     #include <sys/types.h>
     #include <sys/stat.h>
     #ifndef isnan
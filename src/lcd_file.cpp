@@ -19,6 +19,7 @@
 #include "global.h"
 
 #include "lcd_file.h"
+#include "mapped_file.h"
 #include "safe_file.h"
 
 
@@ -30,6 +31,10 @@ namespace psxdmh
 const size_t lcd_file::m_default_capacity = 160;
 
 
+// Value used in the index for IDs without a patch.
+const size_t lcd_file::m_not_indexed = SIZE_MAX;
+
+
 // Fixes for patches.
 const lcd_file::patch_fix lcd_file::m_patch_fixes[] =
 {
@@ -80,9 +85,7 @@ lcd_file::maximum_patch_id() const
 const patch *
 lcd_file::patch_by_id(uint16_t id) const
 {
-    auto predicate = [id](const struct patch &p) { return p.id == id; };
-    auto patch = std::find_if(m_patches.cbegin(), m_patches.cend(), predicate);
-    return patch != m_patches.cend() ? &*patch : nullptr;
+    return id < m_index.size() && m_index[id] != m_not_indexed ? &m_patches[m_index[id]] : nullptr;
 }
 
 
@@ -96,15 +99,16 @@ lcd_file::set_patch_by_id(uint16_t id, const std::vector<uint8_t> &adpcm)
     // Attempt to update an existing patch.
     assert(adpcm.size() > 0);
     assert(adpcm.size() % PSXDMH_ADPCM_BLOCK_SIZE == 0);
-    auto p = std::find_if(m_patches.begin(), m_patches.end(), [id](struct patch &patch) { return patch.id == id; });
-    if (p != m_patches.end())
+    data_span owned(adpcm);
+    if (id < m_index.size() && m_index[id] != m_not_indexed)
     {
-        p->adpcm = adpcm;
+        m_patches[m_index[id]].adpcm = owned;
     }
     // Append a new patch.
     else
     {
-        m_patches.push_back(patch(id, adpcm));
+        m_patches.push_back(patch(id, owned));
+        index_patch(m_patches.size() - 1);
     }
 }
 
@@ -114,63 +118,149 @@ lcd_file::set_patch_by_id(uint16_t id, const std::vector<uint8_t> &adpcm)
 //
 
 void
-lcd_file::parse(std::string file_name)
+lcd_file::parse(std::string file_name, const std::vector<bool> *wanted, std::vector<patch_location> *locations)
 {
+    // Map the whole file. Parsing from memory avoids a call into the file
+    // system for every block of ADPCM data, and the patches can refer to the
+    // mapped data rather than copying it.
+    auto file = std::make_shared<const mapped_file>(file_name);
+    const data_span data(file, 0, file->size());
+    std::string truncated = std::string("Failed reading from '") + file_name + "'.";
+
     // Read the header: the number of patches and their IDs.
-    safe_file file(file_name, file_mode::read);
     m_patches.clear();
     m_patches.reserve(m_default_capacity);
-    m_patches.resize(file.read_16_le());
+    if (data.size() < 2)
+    {
+        throw truncated;
+    }
+    m_patches.resize(size_t(data[0]) | (size_t(data[1]) << 8));
+    if (data.size() < 2 + 2 * m_patches.size())
+    {
+        throw truncated;
+    }
     std::vector<patch>::iterator iter;
-    for (iter = m_patches.begin(); iter != m_patches.end(); ++iter)
+    size_t pos = 2;
+    for (iter = m_patches.begin(); iter != m_patches.end(); ++iter, pos += 2)
     {
-        iter->id = file.read_16_le();
+        iter->id = uint16_t(data[pos] | (data[pos + 1] << 8));
     }
 
+    // Work out how many patches need to be located. The patches have to be
+    // found in order, so when only some are wanted the search stops after the
+    // last of them.
+    auto predicate = [wanted](const patch &p) { return is_wanted(p.id, wanted); };
+    size_t locate = m_patches.rend() - std::find_if(m_patches.rbegin(), m_patches.rend(), predicate);
+
     // Locate the data for each patch in the LCD file. Patches start at offset
     // 0x800 (the size of 1 block on the CD).
-    file.seek(0x800);
-    uint8_t block[PSXDMH_ADPCM_BLOCK_SIZE];
-    for (iter = m_patches.begin(); iter != m_patches.end(); ++iter)
+    pos = 0x800;
+    for (iter = m_patches.begin(); iter != m_patches.begin() + locate; ++iter)
     {
         // Skip the header (a block of 16 zero bytes).
-        static const uint8_t sixteen_zeros[16] = { 0 };
-        file.read(block, sizeof(block));
-        if (memcmp(block, sixteen_zeros, sizeof(block)) != 0)
+        static const uint8_t sixteen_zeros[PSXDMH_ADPCM_BLOCK_SIZE] = { 0 };
+        if (pos + PSXDMH_ADPCM_BLOCK_SIZE > data.size())
+        {
+            throw truncated;
+        }
+        if (memcmp(&data[pos], sixteen_zeros, PSXDMH_ADPCM_BLOCK_SIZE) != 0)
         {
             throw std::string("Invalid patch header in '") + file_name + "'.";
         }
+        pos += PSXDMH_ADPCM_BLOCK_SIZE;
 
         // Identify the patches. The ideal way to do this would be to use the
         // patch sizes from the WMD file, but the algorithm used here works for
         // all LCD files in Doom and Final Doom, and it means we can load an LCD
         // file without needing the WMD.
-        while (!file.eof())
+        size_t start = pos;
+        while (pos < data.size())
         {
-            // Store the next block of ADPCM data.
-            file.read(block, sizeof(block));
-            iter->adpcm.insert(iter->adpcm.end(), block, block + numberof(block));
-
-            // Stop when an end point is found.
-            if (adpcm::is_final(block))
+            // Include the next block of ADPCM data, stopping when an end point
+            // is found.
+            if (pos + PSXDMH_ADPCM_BLOCK_SIZE > data.size())
+            {
+                throw truncated;
+            }
+            pos += PSXDMH_ADPCM_BLOCK_SIZE;
+            if (adpcm::is_final(&data[pos - PSXDMH_ADPCM_BLOCK_SIZE]))
             {
                 break;
             }
         }
+        iter->adpcm = data_span(file, start, pos - start);
+        if (locations != nullptr && is_wanted(iter->id, wanted))
+        {
+            locations->push_back(patch_location{iter->id, uint32_t(start), uint32_t(pos - start)});
+        }
 
         // Skip any padding before the next patch, which can be identified by
         // the header of 16 zeros.
-        while (!file.eof())
+        while (pos < data.size())
         {
-            size_t pos = file.tell();
-            file.read(block, sizeof(block));
-            if (memcmp(block, sixteen_zeros, sizeof(block)) == 0)
+            if (pos + PSXDMH_ADPCM_BLOCK_SIZE > data.size())
+            {
+                throw truncated;
+            }
+            if (memcmp(&data[pos], sixteen_zeros, PSXDMH_ADPCM_BLOCK_SIZE) == 0)
             {
-                file.seek(pos);
                 break;
             }
+            pos += PSXDMH_ADPCM_BLOCK_SIZE;
         }
     }
+
+    // Drop the patches that aren't wanted.
+    m_patches.erase(std::remove_if(m_patches.begin(), m_patches.end(), [&predicate](const patch &p) { return !predicate(p); }), m_patches.end());
+    rebuild_index();
+}
+
+
+//
+// Load from a file using known patch locations.
+//
+
+void
+lcd_file::parse_located(std::string file_name, const std::vector<patch_location> &locations, const std::vector<bool> *wanted)
+{
+    // The file is only mapped if it holds a wanted patch.
+    auto predicate = [wanted](const patch_location &location) { return is_wanted(location.id, wanted); };
+    if (std::any_of(locations.cbegin(), locations.cend(), predicate))
+    {
+        auto file = std::make_shared<const mapped_file>(file_name);
+        parse_located(data_span(file, 0, file->size()), file_name, locations, wanted);
+    }
+    else
+    {
+        m_patches.clear();
+        rebuild_index();
+    }
+}
+
+
+//
+// Load from data in memory using known patch locations.
+//
+
+void
+lcd_file::parse_located(const data_span &data, std::string name, const std::vector<patch_location> &locations, const std::vector<bool> *wanted)
+{
+    // Refer to each wanted patch in the data.
+    m_patches.clear();
+    m_patches.reserve(m_default_capacity);
+    for (auto &location : locations)
+    {
+        if (is_wanted(location.id, wanted))
+        {
+            if (location.size == 0 || location.size % PSXDMH_ADPCM_BLOCK_SIZE != 0
+                || location.offset > data.size() || location.size > data.size() - location.offset)
+            {
+                throw std::string("Failed reading from '") + name + "'.";
+            }
+            m_patches.push_back(patch(location.id, data.subspan(location.offset, location.size)));
+        }
+    }
+    rebuild_index();
 }
 
 
@@ -207,11 +297,13 @@ void
 lcd_file::merge(const lcd_file &lcd)
 {
     assert(this != &lcd);
+    m_patches.reserve(m_patches.size() + lcd.m_patches.size());
     for (auto iter = lcd.m_patches.cbegin(); iter != lcd.m_patches.cend(); ++iter)
     {
         if (patch_by_id(iter->id) == nullptr)
         {
             m_patches.push_back(patch(iter->id, iter->adpcm));
+            index_patch(m_patches.size() - 1);
         }
     }
 }
@@ -226,6 +318,7 @@ lcd_file::sort()
 {
     auto compare = [](const patch &p0, const patch &p1) { return p0.id < p1.id; };
     std::sort(m_patches.begin(), m_patches.end(), compare);
+    rebuild_index();
 }
 
 
@@ -250,8 +343,9 @@ lcd_file::repair_patches()
                 throw std::string("Patch ") + int_to_string(patch->id) + " can't be fixed: the details of the patch don't match the expected values.";
             }
 
-            // Edit the ADPCM data and update the LCD.
-            auto edit = patch->adpcm;
+            // Edit a copy of the ADPCM data and update the LCD. This is the
+            // only point where a mapped patch needs its own data.
+            auto edit = patch->adpcm.to_vector();
             adpcm::edit_adpcm(edit, m_patch_fixes[fix].silence_start_blocks, m_patch_fixes[fix].remove_end_blocks);
             set_patch_by_id(patch->id, edit);
         }
@@ -259,6 +353,41 @@ lcd_file::repair_patches()
 }
 
 
+//
+// Rebuild the index of patch IDs.
+//
+
+void
+lcd_file::rebuild_index()
+{
+    m_index.clear();
+    for (size_t position = 0; position < m_patches.size(); ++position)
+    {
+        index_patch(position);
+    }
+}
+
+
+//
+// Add a patch to the index.
+//
+
+void
+lcd_file::index_patch(size_t position)
+{
+    assert(position < m_patches.size());
+    uint16_t id = m_patches[position].id;
+    if (id >= m_index.size())
+    {
+        m_index.resize(size_t(id) + 1, m_not_indexed);
+    }
+    if (m_index[id] == m_not_indexed)
+    {
+        m_index[id] = position;
+    }
+}
+
+
 //
 // Dump details about the LCD file.
 //
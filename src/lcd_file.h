@@ -37,13 +37,26 @@ struct patch
 {
     // Construction.
     patch() {}
-    patch(uint16_t new_id, const std::vector<uint8_t> &new_adpcm) : id(new_id), adpcm(new_adpcm) {}
+    patch(uint16_t new_id, const data_span &new_adpcm) : id(new_id), adpcm(new_adpcm) {}
 
     // Patch ID.
     uint16_t id;
 
-    // ADPCM encoded audio data.
-    std::vector<uint8_t> adpcm;
+    // ADPCM encoded audio data. When loaded from a file this refers directly to
+    // the mapped file, and patches copied from it share the same data.
+    data_span adpcm;
+};
+
+
+// Location of a patch's ADPCM data within an LCD file.
+struct patch_location
+{
+    // Patch ID.
+    uint16_t id;
+
+    // Offset and size of the data in bytes.
+    uint32_t offset;
+    uint32_t size;
 };
 
 
@@ -71,11 +84,27 @@ public:
 
     // Set a patch by ID. If a patch with the same ID already exists it will be
     // overwritten, otherwise the patch will be appended to the end of the
-    // collection.
+    // collection. The patch takes its own copy of the data.
     void set_patch_by_id(uint16_t id, const std::vector<uint8_t> &adpcm);
 
     // Load from a file. The current contents of this object are overwritten.
-    void parse(std::string file_name);
+    // The file is memory mapped, and the patches refer to it rather than
+    // holding a copy of their data. If a set of wanted patch IDs is given, only
+    // those patches are loaded: the file is only read as far as the last of
+    // them, and a file without any of them only has its header read. The
+    // locations of the patches loaded can optionally be returned.
+    void parse(std::string file_name, const std::vector<bool> *wanted = nullptr, std::vector<patch_location> *locations = nullptr);
+
+    // Load from a file using the patch locations returned by an earlier parse,
+    // which avoids having to search the file for the patches. The wanted patch
+    // IDs are handled as for parse, except that a file without any of them is
+    // not opened at all.
+    void parse_located(std::string file_name, const std::vector<patch_location> &locations, const std::vector<bool> *wanted = nullptr);
+
+    // Load from data in memory using known patch locations, with offsets
+    // relative to the start of the data. The patches refer to the data. The
+    // name is used in error messages.
+    void parse_located(const data_span &data, std::string name, const std::vector<patch_location> &locations, const std::vector<bool> *wanted = nullptr);
 
     // Store the contents of this object in a file.
     void write(std::string file_name) const;
@@ -121,11 +150,29 @@ private:
     // the vector should never need to resize itself.
     static const size_t m_default_capacity;
 
+    // Test if a patch ID is in a set of wanted IDs. All IDs are wanted if there
+    // is no set.
+    static bool is_wanted(uint16_t id, const std::vector<bool> *wanted) { return wanted == nullptr || (id < wanted->size() && (*wanted)[id]); }
+
+    // Rebuild the index of patch IDs.
+    void rebuild_index();
+
+    // Add the patch at a position in m_patches to the index. The first patch
+    // with a given ID is the one found by lookups.
+    void index_patch(size_t position);
+
     // Fixes for patches.
     static const patch_fix m_patch_fixes[];
 
+    // Value used in the index for IDs without a patch.
+    static const size_t m_not_indexed;
+
     // Collection of patches in the LCD file.
     std::vector<patch> m_patches;
+
+    // Index from patch ID to the position of the patch in m_patches. This is
+    // only as large as needed to hold the highest ID seen.
+    std::vector<size_t> m_index;
 };
 
 
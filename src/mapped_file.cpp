@@ -0,0 +1,366 @@
+// psxdmh/src/mapped_file.cpp
+// Read-only memory mapping of files, and spans of the mapped data.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "global.h"
+
+#include "mapped_file.h"
+
+
+namespace psxdmh
+{
+
+
+#if defined(PSXDMH_TARGET_MACOS)
+
+//
+// Construction.
+//
+
+mapped_file::mapped_file(std::string file_name, bool writable) :
+    m_file_name(file_name),
+    m_writable(writable),
+    m_data(nullptr), m_size(0)
+{
+    // Open the file and find its size.
+    int fd = open(m_file_name.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::string("Unable to open '") + m_file_name + (writable ? "' for writing." : "' for reading.");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw std::string("Failed reading from '") + m_file_name + "'.";
+    }
+
+    // Map the whole file. The mapping remains valid once the file is closed.
+    // Empty files can't be mapped, so they are left without data.
+    m_size = size_t(st.st_size);
+    if (m_size > 0)
+    {
+        int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        void *address = mmap(nullptr, m_size, protection, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED)
+        {
+            close(fd);
+            throw std::string("Failed reading from '") + m_file_name + "'.";
+        }
+        m_data = static_cast<const uint8_t *>(address);
+    }
+    close(fd);
+}
+
+
+//
+// Unmap the file and cut it down to size.
+//
+
+void
+mapped_file::truncate(size_t size)
+{
+    assert(m_writable);
+    assert(size <= m_size);
+    unmap();
+    if (::truncate(m_file_name.c_str(), off_t(size)) != 0)
+    {
+        throw std::string("Failed writing to '") + m_file_name + "'.";
+    }
+}
+
+
+//
+// Unmap the file.
+//
+
+void
+mapped_file::unmap()
+{
+    if (m_data != nullptr)
+    {
+        munmap(const_cast<uint8_t *>(m_data), m_size);
+        m_data = nullptr;
+        m_size = 0;
+    }
+}
+
+#elif defined(PSXDMH_TARGET_WINDOWS)
+
+//
+// Construction.
+//
+
+mapped_file::mapped_file(std::string file_name, bool writable) :
+    m_file_name(file_name),
+    m_writable(writable),
+    m_data(nullptr), m_size(0),
+    m_mapping(NULL)
+{
+    // Open the file and find its size.
+    DWORD access = writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+    HANDLE file = CreateFile(m_file_name.c_str(), access, writable ? 0 : FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        throw std::string("Unable to open '") + m_file_name + (writable ? "' for writing." : "' for reading.");
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+        CloseHandle(file);
+        throw std::string("Failed reading from '") + m_file_name + "'.";
+    }
+
+    // Map the whole file. The mapping remains valid once the file is closed.
+    // Empty files can't be mapped, so they are left without data.
+    m_size = size_t(size.QuadPart);
+    if (m_size > 0)
+    {
+        m_mapping = CreateFileMapping(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+        void *address = m_mapping != NULL ? MapViewOfFile(m_mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (address == nullptr)
+        {
+            if (m_mapping != NULL)
+            {
+                CloseHandle(m_mapping);
+            }
+            CloseHandle(file);
+            throw std::string("Failed reading from '") + m_file_name + "'.";
+        }
+        m_data = static_cast<const uint8_t *>(address);
+    }
+    CloseHandle(file);
+}
+
+
+//
+// Unmap the file and cut it down to size.
+//
+
+void
+mapped_file::truncate(size_t size)
+{
+    // The file can only be resized once the mapping is closed.
+    assert(m_writable);
+    assert(size <= m_size);
+    unmap();
+    HANDLE file = CreateFile(m_file_name.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        throw std::string("Unable to open '") + m_file_name + "' for writing.";
+    }
+    LARGE_INTEGER end;
+    end.QuadPart = LONGLONG(size);
+    bool ok = SetFilePointerEx(file, end, NULL, FILE_BEGIN) && SetEndOfFile(file);
+    CloseHandle(file);
+    if (!ok)
+    {
+        throw std::string("Failed writing to '") + m_file_name + "'.";
+    }
+}
+
+
+//
+// Unmap the file.
+//
+
+void
+mapped_file::unmap()
+{
+    if (m_data != nullptr)
+    {
+        UnmapViewOfFile(m_data);
+        m_data = nullptr;
+        m_size = 0;
+    }
+    if (m_mapping != NULL)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = NULL;
+    }
+}
+
+#else // Target.
+
+    #error Unsupported target platform.
+
+#endif // Target.
+
+
+//
+// Destruction.
+//
+
+mapped_file::~mapped_file()
+{
+    unmap();
+}
+
+
+//  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+
+//
+// Construction.
+//
+
+data_span::data_span(std::vector<uint8_t> data)
+{
+    auto owned = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+    m_data = owned->data();
+    m_size = owned->size();
+    m_owner = owned;
+}
+
+
+//
+// Construction.
+//
+
+data_span::data_span(std::shared_ptr<const mapped_file> file, size_t offset, size_t size) :
+    m_data(nullptr), m_size(size)
+{
+    assert(file != nullptr);
+    assert(offset <= file->size() && size <= file->size() - offset);
+    if (size > 0)
+    {
+        m_data = file->data() + offset;
+    }
+    m_owner = file;
+}
+
+
+//
+// Get part of the span.
+//
+
+data_span
+data_span::subspan(size_t offset, size_t size) const
+{
+    assert(offset <= m_size && size <= m_size - offset);
+    data_span part(*this);
+    part.m_data = m_data + offset;
+    part.m_size = size;
+    return part;
+}
+
+
+//  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+
+//
+// Seek to a position relative to the start of the data.
+//
+
+void
+data_reader::seek(size_t pos)
+{
+    if (pos > m_data.size())
+    {
+        throw std::string("Failed reading from '") + m_name + "'.";
+    }
+    m_position = pos;
+}
+
+
+//
+// Read bytes.
+//
+
+void
+data_reader::read(void *buffer, size_t bytes)
+{
+    assert(buffer != nullptr || bytes == 0);
+    check(bytes);
+    if (bytes > 0)
+    {
+        memcpy(buffer, m_data.data() + m_position, bytes);
+        m_position += bytes;
+    }
+}
+
+
+//
+// Read a byte.
+//
+
+uint8_t
+data_reader::read_8()
+{
+    check(1);
+    return m_data[m_position++];
+}
+
+
+//
+// Read a 16-bit little-endian value.
+//
+
+uint16_t
+data_reader::read_16_le()
+{
+    check(2);
+    uint16_t value = uint16_t(m_data[m_position]) | (uint16_t(m_data[m_position + 1]) << 8);
+    m_position += 2;
+    return value;
+}
+
+
+//
+// Read a 32-bit little-endian value.
+//
+
+uint32_t
+data_reader::read_32_le()
+{
+    check(4);
+    uint32_t value = uint32_t(m_data[m_position]) | (uint32_t(m_data[m_position + 1]) << 8)
+        | (uint32_t(m_data[m_position + 2]) << 16) | (uint32_t(m_data[m_position + 3]) << 24);
+    m_position += 4;
+    return value;
+}
+
+
+//
+// Read a span of bytes.
+//
+
+data_span
+data_reader::read_span(size_t bytes)
+{
+    check(bytes);
+    data_span span = m_data.subspan(m_position, bytes);
+    m_position += bytes;
+    return span;
+}
+
+
+//
+// Ensure that there are enough bytes left to read.
+//
+
+void
+data_reader::check(size_t bytes) const
+{
+    if (bytes > m_data.size() - m_position)
+    {
+        throw std::string("Failed reading from '") + m_name + "'.";
+    }
+}
+
+
+}; //namespace psxdmh
@@ -0,0 +1,180 @@
+// psxdmh/src/mapped_file.h
+// Read-only memory mapping of files, and spans of the mapped data.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PSXDMH_SRC_MAPPED_FILE_H
+#define PSXDMH_SRC_MAPPED_FILE_H
+
+
+#include "utility.h"
+
+
+namespace psxdmh
+{
+
+
+// Memory mapping of a whole file. The contents are paged in by the operating
+// system as they are used, rather than being copied up front. Mappings are
+// read-only unless asked to be writable, in which case changes to the data are
+// written back to the file. All errors are reported by a thrown std::string.
+class mapped_file : public uncopyable
+{
+public:
+
+    // Construction. Note that the constructor will throw an exception if it
+    // encounters an error.
+    mapped_file(std::string file_name, bool writable = false);
+
+    // Destruction.
+    ~mapped_file();
+
+    // File name.
+    std::string file_name() const { return m_file_name; }
+
+    // Contents of the file. Empty files have no data.
+    const uint8_t *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+    // Contents of a writable mapping.
+    uint8_t *writable_data() { assert(m_writable); return const_cast<uint8_t *>(m_data); }
+
+    // Unmap a writable mapping and cut the file down to size bytes. The data
+    // is no longer available afterwards.
+    void truncate(size_t size);
+
+private:
+
+    // Unmap the file.
+    void unmap();
+
+    // Name of the file.
+    std::string m_file_name;
+
+    // Whether the mapping is writable.
+    bool m_writable;
+
+    // Mapped contents of the file.
+    const uint8_t *m_data;
+    size_t m_size;
+
+#if defined(PSXDMH_TARGET_WINDOWS)
+
+    // Handle to the file mapping.
+    HANDLE m_mapping;
+
+#endif // Target.
+};
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+
+// Read-only span of bytes, either within a mapped file or held in memory. The
+// span shares ownership of its storage, so copies are cheap and the data stays
+// valid for as long as any span refers to it. Spans are never modified in
+// place: data to be edited is copied out with to_vector, and the edited vector
+// is wrapped in a new span.
+class data_span
+{
+public:
+
+    // Construction. An empty span, a span taking over a vector of data, or a
+    // span of part of a mapped file.
+    data_span() : m_data(nullptr), m_size(0) {}
+    explicit data_span(std::vector<uint8_t> data);
+    data_span(std::shared_ptr<const mapped_file> file, size_t offset, size_t size);
+
+    // Access to the data.
+    const uint8_t *data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const uint8_t &operator[](size_t index) const { assert(index < m_size); return m_data[index]; }
+    const uint8_t *begin() const { return m_data; }
+    const uint8_t *end() const { return m_data + m_size; }
+
+    // Copy the data into a vector.
+    std::vector<uint8_t> to_vector() const { return std::vector<uint8_t>(begin(), end()); }
+
+    // Get part of the span. The part shares the storage of this span.
+    data_span subspan(size_t offset, size_t size) const;
+
+private:
+
+    // Storage holding the data: either a mapped file or a vector.
+    std::shared_ptr<const void> m_owner;
+
+    // Data within the storage.
+    const uint8_t *m_data;
+    size_t m_size;
+};
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+
+// Sequential reading of little-endian values from a data span, in the manner of
+// safe_file. All errors are reported by a thrown std::string.
+class data_reader
+{
+public:
+
+    // Construction. The name is used in error messages.
+    data_reader(const data_span &data, std::string name) : m_data(data), m_name(name), m_position(0) {}
+
+    // Size of the data in bytes.
+    size_t size() const { return m_data.size(); }
+
+    // Test whether the position is at the end.
+    bool eof() const { return m_position == m_data.size(); }
+
+    // Seek to a position relative to the start of the data.
+    void seek(size_t pos);
+
+    // Current position within the data.
+    size_t tell() const { return m_position; }
+
+    // Read bytes.
+    void read(void *buffer, size_t bytes);
+
+    // Read values.
+    uint8_t read_8();
+    uint16_t read_16_le();
+    uint32_t read_32_le();
+
+    // Read a span of bytes. The span shares the storage of the data.
+    data_span read_span(size_t bytes);
+
+private:
+
+    // Ensure that there are enough bytes left to read.
+    void check(size_t bytes) const;
+
+    // Data being read.
+    data_span m_data;
+
+    // Name used in error messages.
+    std::string m_name;
+
+    // Current position.
+    size_t m_position;
+};
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_MAPPED_FILE_H
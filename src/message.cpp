@@ -28,6 +28,9 @@ namespace psxdmh
 // Output verbosity.
 verbosity message::m_verbosity = verbosity::normal;
 
+// Output stream.
+FILE *message::m_output = stdout;
+
 
 //
 // Message output in the style of printf.
@@ -40,8 +43,8 @@ message::writef(enum verbosity v, std::string format, ...)
     {
         va_list vl;
         va_start(vl, format);
-        vprintf(format.c_str(), vl);
-        fflush(stdout);
+        vfprintf(m_output, format.c_str(), vl);
+        fflush(m_output);
         va_end(vl);
     }
 }
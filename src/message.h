@@ -52,6 +52,11 @@ public:
     static void verbosity(enum verbosity v) { m_verbosity = v; }
     static enum verbosity verbosity() { return m_verbosity; }
 
+    // Stream that messages are written to. This is stdout unless the audio is
+    // being written there, when messages are moved to stderr.
+    static void output(FILE *file) { assert(file != nullptr); m_output = file; }
+    static FILE *output() { return m_output; }
+
 private:
 
     // Constructor.
@@ -59,6 +64,9 @@ private:
 
     // Output verbosity.
     static enum verbosity m_verbosity;
+
+    // Output stream.
+    static FILE *m_output;
 };
 
 
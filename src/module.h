@@ -20,6 +20,7 @@
 #define PSXDMH_SRC_MODULE_H
 
 
+#include "arena.h"
 #include "sample.h"
 
 
@@ -36,11 +37,20 @@ public:
     // Construction. This object takes control of the source object if one is
     // provided. All derived classes must obey this convention of taking
     // ownership of source modules.
-    module(module *source = nullptr) : m_source(source) {}
+    module(module *source = nullptr) : m_source(source), m_source_finished(source == nullptr) {}
 
     // Virtualize the destructor.
     virtual ~module() {}
 
+    // Allocation. Modules may be allocated from the heap as usual, or from an
+    // arena with "new (pool) ...". Either way they are released with delete,
+    // so the ownership of sources works the same regardless of where a module
+    // was allocated.
+    static void *operator new(size_t size) { return arena::allocate_object(nullptr, size); }
+    static void *operator new(size_t size, arena *pool) { return arena::allocate_object(pool, size); }
+    static void operator delete(void *object) { arena::release_object(object); }
+    static void operator delete(void *object, arena *) { arena::release_object(object); }
+
     // Get the source module. Returns nullptr if this module does not use a
     // source.
     virtual module *source() const { return m_source.get(); }
@@ -53,10 +63,63 @@ public:
     // return false.
     virtual bool next(S &s) = 0;
 
+    // Get the number of upcoming samples, up to limit, that the module knows
+    // will be exact silence. The module is guaranteed to still be running for
+    // all of those samples. This allows stretches of silence to be passed
+    // down the graph in bulk rather than one sample at a time. A result of 0
+    // means nothing is known, which is the default for modules that can't
+    // tell ahead of time.
+    virtual uint32_t silence_ahead(uint32_t) const { return 0; }
+
+    // Skip over count samples of silence, as if next had been called that
+    // many times. The count must not exceed the result of silence_ahead.
+    virtual void skip_silence(uint32_t count)
+    {
+        S s;
+        while (count-- > 0)
+        {
+            next(s);
+        }
+    }
+
+protected:
+
+    // Get the next sample from the source. Once the source stops running this
+    // is remembered and the source is not called again, so the state of the
+    // source can then be tested without walking back up the graph.
+    bool next_from_source(S &s)
+    {
+        if (!m_source_finished)
+        {
+            if (m_source->next(s))
+            {
+                return true;
+            }
+            m_source_finished = true;
+        }
+        s = 0.0;
+        return false;
+    }
+
+    // Test whether the source is still running. As with next_from_source, the
+    // source is only consulted until it is found to have stopped.
+    bool source_running() const
+    {
+        if (!m_source_finished && !m_source->is_running())
+        {
+            m_source_finished = true;
+        }
+        return !m_source_finished;
+    }
+
 private:
 
     // Source module. May be nullptr.
     std::unique_ptr<module> m_source;
+
+    // Set once the source is known to have stopped running. Modules stop
+    // permanently, so this is cached rather than asking the source again.
+    mutable bool m_source_finished;
 };
 
 
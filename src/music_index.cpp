@@ -0,0 +1,310 @@
+// psxdmh/src/music_index.cpp
+// Cached index of the data files in a music directory.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "global.h"
+
+#include "music_index.h"
+
+
+namespace psxdmh
+{
+
+
+// Signature ("PXIX") and version of the cache file.
+#define PSXDMH_INDEX_SIGNATURE      (0x58495850)
+#define PSXDMH_INDEX_VERSION        (1)
+
+// Limits used to reject corrupt cache files before allocating memory.
+#define PSXDMH_INDEX_MAX_STRING     (0x10000)
+#define PSXDMH_INDEX_MAX_COUNT      (0x10000)
+
+
+//
+// Read the index from a cache file.
+//
+
+bool
+music_index::read(std::string cache_file, std::string music_dir)
+{
+    // Any problem reading the cache just means it isn't used.
+    m_music_dir.clear();
+    m_directories.clear();
+    m_wmd_files.clear();
+    m_lcd_files.clear();
+    m_patches.clear();
+    if (type_of_file(cache_file) != file_type::file)
+    {
+        return false;
+    }
+    try
+    {
+        // Check the header and the directory the index is for.
+        safe_file file(cache_file, file_mode::read);
+        if (file.read_32_le() != PSXDMH_INDEX_SIGNATURE || file.read_32_le() != PSXDMH_INDEX_VERSION)
+        {
+            return false;
+        }
+        m_music_dir = read_string(file);
+        if (m_music_dir != music_dir)
+        {
+            m_music_dir.clear();
+            return false;
+        }
+
+        // Read the files and the patch locations.
+        m_directories = read_files(file);
+        m_wmd_files = read_files(file);
+        m_lcd_files = read_files(file);
+        m_patches.resize(m_lcd_files.size());
+        for (auto &patches : m_patches)
+        {
+            uint32_t count = file.read_32_le();
+            if (count > PSXDMH_INDEX_MAX_COUNT)
+            {
+                throw std::string("Corrupt index.");
+            }
+            patches.resize(count);
+            for (auto &location : patches)
+            {
+                location.id = file.read_16_le();
+                location.offset = file.read_32_le();
+                location.size = file.read_32_le();
+            }
+        }
+        if (!file.eof())
+        {
+            throw std::string("Corrupt index.");
+        }
+    }
+    catch (const std::string &)
+    {
+        *this = music_index();
+        return false;
+    }
+
+    // The index is only valid if nothing has changed.
+    if (!is_unchanged(m_directories) || !is_unchanged(m_wmd_files) || !is_unchanged(m_lcd_files))
+    {
+        *this = music_index();
+        return false;
+    }
+    return true;
+}
+
+
+//
+// Write the index to a cache file.
+//
+
+void
+music_index::write(std::string cache_file) const
+{
+    assert(m_patches.size() == m_lcd_files.size());
+
+    // Write to a temporary file beside the cache and rename it over the cache
+    // once complete, so that another run never sees a partly written cache.
+    std::string temp_file = create_temp_file(cache_file + ".");
+    try
+    {
+        safe_file file(temp_file, file_mode::write);
+        file.write_32_le(PSXDMH_INDEX_SIGNATURE);
+        file.write_32_le(PSXDMH_INDEX_VERSION);
+        write_string(file, m_music_dir);
+        write_files(file, m_directories);
+        write_files(file, m_wmd_files);
+        write_files(file, m_lcd_files);
+        for (auto &patches : m_patches)
+        {
+            file.write_32_le(uint32_t(patches.size()));
+            for (auto &location : patches)
+            {
+                file.write_16_le(location.id);
+                file.write_32_le(location.offset);
+                file.write_32_le(location.size);
+            }
+        }
+        file.close();
+        replace_file(temp_file, cache_file);
+    }
+    catch (...)
+    {
+        remove(temp_file.c_str());
+        throw;
+    }
+}
+
+
+//
+// Start a new index of a music directory.
+//
+
+void
+music_index::build(std::string music_dir, const std::vector<std::string> &directories, const std::vector<std::string> &wmd_files, const std::vector<std::string> &lcd_files)
+{
+    m_music_dir = music_dir;
+    m_directories = stamp(directories);
+    m_wmd_files = stamp(wmd_files);
+    m_lcd_files = stamp(lcd_files);
+    m_patches.clear();
+    m_patches.resize(m_lcd_files.size());
+}
+
+
+//
+// Record the current size and modification time of files.
+//
+
+std::vector<music_index::stamped_file>
+music_index::stamp(const std::vector<std::string> &names)
+{
+    // A file that can't be found is recorded with a zero size and time, so the
+    // index won't match it later. Times are only to the second, so a file
+    // modified within the last second could change again without its time
+    // changing. These are recorded with an invalid time, so the index is
+    // rebuilt the next time it is used.
+    std::vector<stamped_file> files(names.size());
+    int64_t now = int64_t(time(nullptr));
+    for (size_t index = 0; index < names.size(); ++index)
+    {
+        files[index].name = names[index];
+        file_stamp(names[index], files[index].size, files[index].modified);
+        if (files[index].modified >= now - 1)
+        {
+            files[index].modified = -1;
+        }
+    }
+    return files;
+}
+
+
+//
+// Test if files are unchanged.
+//
+
+bool
+music_index::is_unchanged(const std::vector<stamped_file> &files)
+{
+    for (auto &file : files)
+    {
+        uint64_t size;
+        int64_t modified;
+        if (!file_stamp(file.name, size, modified) || size != file.size || modified != file.modified)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//
+// Get the names of files.
+//
+
+std::vector<std::string>
+music_index::names(const std::vector<stamped_file> &files)
+{
+    std::vector<std::string> result;
+    result.reserve(files.size());
+    for (auto &file : files)
+    {
+        result.push_back(file.name);
+    }
+    return result;
+}
+
+
+//
+// Read a string from the cache file.
+//
+
+std::string
+music_index::read_string(safe_file &file)
+{
+    uint32_t length = file.read_32_le();
+    if (length > PSXDMH_INDEX_MAX_STRING)
+    {
+        throw std::string("Corrupt index.");
+    }
+    std::string value(length, '\0');
+    if (length > 0)
+    {
+        file.read(&value[0], length);
+    }
+    return value;
+}
+
+
+//
+// Write a string to the cache file.
+//
+
+void
+music_index::write_string(safe_file &file, const std::string &value)
+{
+    file.write_32_le(uint32_t(value.length()));
+    file.write(value.data(), value.length());
+}
+
+
+//
+// Read a list of files from the cache file.
+//
+
+std::vector<music_index::stamped_file>
+music_index::read_files(safe_file &file)
+{
+    uint32_t count = file.read_32_le();
+    if (count > PSXDMH_INDEX_MAX_COUNT)
+    {
+        throw std::string("Corrupt index.");
+    }
+    std::vector<stamped_file> files(count);
+    for (auto &f : files)
+    {
+        f.name = read_string(file);
+        f.size = file.read_32_le();
+        f.size |= uint64_t(file.read_32_le()) << 32;
+        uint64_t modified = file.read_32_le();
+        modified |= uint64_t(file.read_32_le()) << 32;
+        f.modified = int64_t(modified);
+    }
+    return files;
+}
+
+
+//
+// Write a list of files to the cache file.
+//
+
+void
+music_index::write_files(safe_file &file, const std::vector<stamped_file> &files)
+{
+    file.write_32_le(uint32_t(files.size()));
+    for (auto &f : files)
+    {
+        write_string(file, f.name);
+        file.write_32_le(uint32_t(f.size));
+        file.write_32_le(uint32_t(f.size >> 32));
+        file.write_32_le(uint32_t(uint64_t(f.modified)));
+        file.write_32_le(uint32_t(uint64_t(f.modified) >> 32));
+    }
+}
+
+
+}; //namespace psxdmh
@@ -0,0 +1,109 @@
+// psxdmh/src/music_index.h
+// Cached index of the data files in a music directory.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PSXDMH_SRC_MUSIC_INDEX_H
+#define PSXDMH_SRC_MUSIC_INDEX_H
+
+
+#include "lcd_file.h"
+#include "safe_file.h"
+#include "utility.h"
+
+
+namespace psxdmh
+{
+
+
+// Index of the data files in a music directory, which can be saved to a cache
+// file so that later runs don't have to search the directory or the LCD files.
+// The index records the WMD and LCD files found, the location of every patch
+// in the LCD files, and the size and modification time of each file and of
+// every directory searched. A cached index is only used if all of these are
+// unchanged, so adding, removing, or replacing a data file causes the index to
+// be rebuilt. All errors are reported by a thrown std::string.
+class music_index
+{
+public:
+
+    // Construction. The index is empty.
+    music_index() {}
+
+    // Read the index from a cache file. Returns false, leaving the index
+    // empty, if the cache doesn't exist, is for another directory, is not
+    // valid, or if any of the files have changed since it was written.
+    bool read(std::string cache_file, std::string music_dir);
+
+    // Write the index to a cache file. The cache is replaced in a single step,
+    // so a concurrent reader sees either the old or the new index.
+    void write(std::string cache_file) const;
+
+    // Start a new index of a music directory, recording the current state of
+    // the directories searched and the data files found. The patch locations
+    // must then be filled in for each LCD file.
+    void build(std::string music_dir, const std::vector<std::string> &directories, const std::vector<std::string> &wmd_files, const std::vector<std::string> &lcd_files);
+
+    // Data files in the order they were found.
+    std::vector<std::string> wmd_files() const { return names(m_wmd_files); }
+    std::vector<std::string> lcd_files() const { return names(m_lcd_files); }
+
+    // Locations of the patches in an LCD file.
+    const std::vector<patch_location> &patches(size_t lcd_index) const { assert(lcd_index < m_patches.size()); return m_patches[lcd_index]; }
+    std::vector<patch_location> &patches(size_t lcd_index) { assert(lcd_index < m_patches.size()); return m_patches[lcd_index]; }
+
+private:
+
+    // Name of a file or directory, along with its size and modification time.
+    struct stamped_file
+    {
+        std::string name;
+        uint64_t size;
+        int64_t modified;
+    };
+
+    // Record the current size and modification time of files.
+    static std::vector<stamped_file> stamp(const std::vector<std::string> &names);
+
+    // Test if files are unchanged.
+    static bool is_unchanged(const std::vector<stamped_file> &files);
+
+    // Get the names of files.
+    static std::vector<std::string> names(const std::vector<stamped_file> &files);
+
+    // Read and write the parts of the cache file.
+    static std::string read_string(safe_file &file);
+    static void write_string(safe_file &file, const std::string &value);
+    static std::vector<stamped_file> read_files(safe_file &file);
+    static void write_files(safe_file &file, const std::vector<stamped_file> &files);
+
+    // Music directory.
+    std::string m_music_dir;
+
+    // Directories searched, and the data files found.
+    std::vector<stamped_file> m_directories;
+    std::vector<stamped_file> m_wmd_files;
+    std::vector<stamped_file> m_lcd_files;
+
+    // Locations of the patches in each LCD file.
+    std::vector<std::vector<patch_location>> m_patches;
+};
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_MUSIC_INDEX_H
@@ -59,6 +59,46 @@ music_stream::tick()
 }
 
 
+//
+// Advance the music extraction by a number of caller ticks.
+//
+
+void
+music_stream::skip_ticks(uint32_t count)
+{
+    uint64_t fraction = m_tick_fraction + uint64_t(m_track_ticks_per_minute) * count;
+    m_tick_position += uint32_t(fraction / m_caller_ticks_per_minute);
+    m_tick_fraction = uint32_t(fraction % m_caller_ticks_per_minute);
+}
+
+
+//
+// Get the number of caller ticks until the next event is available.
+//
+
+uint32_t
+music_stream::ticks_until_event(uint32_t limit) const
+{
+    // No further events will become available at the end of the stream, nor if
+    // the track's tempo is zero.
+    if (have_event())
+    {
+        return 0;
+    }
+    if (m_position >= m_track.data.size() || m_track_ticks_per_minute == 0)
+    {
+        return limit;
+    }
+
+    // Find the number of ticks needed for the fractional position to reach the
+    // start of the event's track tick.
+    assert(m_next_event_time > m_tick_position);
+    uint64_t needed = uint64_t(m_next_event_time - m_tick_position) * m_caller_ticks_per_minute - m_tick_fraction;
+    uint64_t ticks = (needed + m_track_ticks_per_minute - 1) / m_track_ticks_per_minute;
+    return uint32_t(std::min(ticks, uint64_t(limit)));
+}
+
+
 //
 // Attempt to extract an event from the stream for the current time.
 //
@@ -109,6 +109,14 @@ public:
     // Advance the music extraction by one caller tick.
     void tick();
 
+    // Advance the music extraction by a number of caller ticks. This has the
+    // same effect as calling tick() count times.
+    void skip_ticks(uint32_t count);
+
+    // Get the number of caller ticks, up to limit, until the next event is
+    // available for extraction. Returns 0 if an event is available now.
+    uint32_t ticks_until_event(uint32_t limit) const;
+
     // Test if one or more events are available for extraction.
     bool have_event() const { return m_position < m_track.data.size() && m_next_event_time <= m_tick_position; }
 
@@ -20,6 +20,7 @@
 #define PSXDMH_SRC_NORMALIZER_H
 
 
+#include "async_writer.h"
 #include "module.h"
 #include "safe_file.h"
 
@@ -30,20 +31,42 @@ namespace psxdmh
 
 // Level normalization. This module adjusts the level of the audio that passes
 // through it so that the highest amplitude is remapped to unity. This is done
-// by first buffering the entire output of its source module in a temporary
-// file. Note that the amount of temporary space required is twice that of the
-// final file.
+// in one of two ways:
+//
+//  - Buffered: the entire output of the source module is first buffered in a
+//    temporary file, and is then read back at the adjusted level. The amount
+//    of temporary space required is twice that of the final file.
+//  - Deferred: the audio passes through unchanged while the highest amplitude
+//    is tracked, and the adjustment is only known once the source finishes.
+//    It is up to the consumer to apply the adjustment to what it has written,
+//    as wav_file::rescale does.
 template <typename S> class normalizer : public module<S>
 {
 public:
 
-    // Construction.
-    normalizer(module<S> *source, std::string temp_name, double normalization_limit = 30.0) :
+    // Construction of a buffered normalizer. The temporary file is given a
+    // unique name starting with the prefix, and is removed on destruction.
+    normalizer(module<S> *source, std::string temp_prefix, double normalization_limit = 30.0) :
+        module<S>(source),
+        m_deferred(false),
+        m_temp_file_prefix(temp_prefix),
+        m_temp_file_created(false),
+        m_temp_file(nullptr),
+        m_normalization(mono_t(decibels_to_amplitude(normalization_limit))),
+        m_max_level(mono_t(1.0 / m_normalization)),
+        m_samples(0), m_current_sample(0)
+    {
+        assert(source != 0);
+    }
+
+    // Construction of a deferred normalizer.
+    normalizer(module<S> *source, double normalization_limit = 30.0) :
         module<S>(source),
-        m_temp_file_name(temp_name),
+        m_deferred(true),
         m_temp_file_created(false),
         m_temp_file(nullptr),
         m_normalization(mono_t(decibels_to_amplitude(normalization_limit))),
+        m_max_level(mono_t(1.0 / m_normalization)),
         m_samples(0), m_current_sample(0)
     {
         assert(source != 0);
@@ -66,33 +89,54 @@ public:
     // Test whether the module is still generating output.
     virtual bool is_running() const
     {
-        return m_current_sample < m_samples || this->source()->is_running();
+        return m_current_sample < m_samples || this->source_running();
     }
 
     // Get the next sample.
     virtual bool next(S &s)
     {
+        // Deferred normalization passes the samples through, and settles on
+        // the adjustment when the source finishes.
+        if (m_deferred)
+        {
+            bool live = this->next_from_source(s);
+            m_max_level = std::max(m_max_level, magnitude(s));
+            if (!live)
+            {
+                m_normalization = 1 / m_max_level;
+            }
+            return live;
+        }
+
         // The first call buffers the source in the temporary file.
         if (m_temp_file == nullptr)
         {
-            // Write the temporary file and track the maximum level.
-            assert(m_normalization > 0.0);
-            mono_t max_level = mono_t(1.0 / m_normalization);
-            m_temp_file.reset(new safe_file(m_temp_file_name, file_mode::write));
+            // Write the temporary file and track the maximum level. The file is
+            // written in the background while the source is generating.
+            m_temp_file_name = create_temp_file(m_temp_file_prefix);
             m_temp_file_created = true;
-            S sample;
-            while (this->source()->next(sample))
+            m_temp_file.reset(new safe_file(m_temp_file_name, file_mode::write));
             {
-                m_temp_file->write_sample(sample);
-                m_samples++;
-                max_level = std::max(max_level, magnitude(sample));
+                async_writer writer(*m_temp_file);
+                S sample;
+                while (this->next_from_source(sample))
+                {
+                    if ((m_samples & 0xfff) == 0)
+                    {
+                        check_interrupt();
+                    }
+                    writer.write_sample(sample);
+                    m_samples++;
+                    m_max_level = std::max(m_max_level, magnitude(sample));
+                }
+                writer.flush();
             }
             m_temp_file->close();
             m_temp_file.reset();
 
             // Calculate the normalization level.
-            assert(max_level > 0.0);
-            m_normalization = 1 / max_level;
+            assert(m_max_level > 0.0);
+            m_normalization = 1 / m_max_level;
 
             // Open the temporary file for reading.
             m_temp_file.reset(new safe_file(m_temp_file_name, file_mode::read));
@@ -113,7 +157,26 @@ public:
         return true;
     }
 
-    // Applied adjustment in dB.
+    // Silence passes through a deferred normalizer unchanged.
+    virtual uint32_t silence_ahead(uint32_t limit) const { return m_deferred ? this->source()->silence_ahead(limit) : 0; }
+    virtual void skip_silence(uint32_t count)
+    {
+        if (m_deferred)
+        {
+            this->source()->skip_silence(count);
+        }
+        else
+        {
+            module<S>::skip_silence(count);
+        }
+    }
+
+    // Whether the normalization is deferred.
+    bool is_deferred() const { return m_deferred; }
+
+    // Applied adjustment. For a deferred normalizer this is only valid once
+    // the source has finished.
+    mono_t adjustment() const { return m_normalization; }
     double adjustment_db() const
     {
         return amplitude_to_decibels(m_normalization);
@@ -121,7 +184,11 @@ public:
 
 private:
 
-    // Name to use for the temporary file.
+    // Whether the normalization is deferred.
+    bool m_deferred;
+
+    // Prefix and name of the temporary file.
+    std::string m_temp_file_prefix;
     std::string m_temp_file_name;
 
     // Whether the temporary file was created.
@@ -133,6 +200,9 @@ private:
     // Normalization factor.
     mono_t m_normalization;
 
+    // Highest amplitude seen, which is no lower than the limit allows.
+    mono_t m_max_level;
+
     // Total number of samples buffered.
     uint32_t m_samples;
 
@@ -35,14 +35,25 @@ options::options() :
     normalize(false),
     reverb_preset(rp_auto), reverb_volume(0.5),
     play_count(1L),
+    max_voices(0L),
+    realtime(false),
     lead_in(-1.0), lead_out(-1.0),
     maximum_gap(-1.0),
     stereo_width(0.0),
     repair_patches(false),
     unlimited_frequency(false),
     sample_rate(0),
+    render_rate(44100L),
     high_pass(30L), low_pass(15000L),
     sinc_window(7L),
+    quality(quality_profile::normal), linear_interpolation(false),
+    raw_stream(false),
+    flac(false),
+    strict(false),
+    dynamic_graph(false),
+    async(false),
+    shard_length(0), shard_warm_up(5),
+    verify_shards(false),
     version(false),
     help(false)
 {
@@ -52,7 +63,9 @@ options::options() :
         "This can be combined with the -n option in which case this volume adjustment occurs after the normalization.");
     define_bool_option("normalize", 'n', normalize,
         "Normalize the level of the audio to use the full range.  "
-        "This option writes the audio to a temporary file, and requires approximately twice the space of the completed WAV file.");
+        "A WAV file is written with 32-bit float samples, needing twice its final space, and is then converted in place.  "
+        "When writing FLAC or to standard output the audio is first buffered in a temporary file instead.  "
+        "This is made beside the FLAC file, or in the system's temporary directory (TMPDIR) for standard output.");
 
     // Playback options.
     define_callback_option("reverb-preset", 'r', new custom_string_callback<options>(*this, &options::handle_reverb_preset), "preset",
@@ -65,6 +78,16 @@ options::options() :
         "This option has no effect if the reverb preset is set to off or auto.");
     define_uint_option("play-count", 'p', play_count, 1U, UINT32_MAX, "count",
         "Set the number of times a repeating song, track, or patch is played (default 1).");
+    define_uint_option("max-voices", 0, max_voices, 0U, UINT32_MAX, "count",
+        "Limit the number of voices playing at once (default 0).  "
+        "A value of 0 means there is no limit, while a real PlayStation has 24 voices.  "
+        "When the limit is reached a new note takes over the voice with the lowest priority, preferring released notes, then quieter notes, then older notes.  "
+        "This puts an upper bound on the processing time per sample, but may cut notes short.");
+    define_bool_option("realtime", 0, realtime,
+        "Keep extraction running faster than real time, such as when streaming on a busy machine.  "
+        "When extraction gets close to real time the quality of new notes is lowered by reducing the sinc window, falling back to linear interpolation if needed.  "
+        "Quality is restored when extraction speeds up again.  "
+        "Notes already playing are never changed, which avoids clicks.");
 
     // Silence adjustment options.
     define_double_option("intro", 'i', lead_in, 0.0, 60.0, "time",
@@ -93,6 +116,11 @@ options::options() :
     // Output options.
     define_uint_option("sample-rate", 's', sample_rate, 8000U, 192000U, "rate",
         "Set the output sample rate (default 44100 for songs and tracks, 11025 for patches).");
+    define_uint_option("render-rate", 0, render_rate, 8000U, 192000U, "rate",
+        "Set the internal rate at which songs and tracks are rendered (default 44100).  "
+        "When the output sample rate is higher than this, notes, mixing, and reverb are all processed at this rate and the result is converted to the output rate in a single final step.  "
+        "This makes high output rates much faster to extract.  "
+        "Set this to the output sample rate to render everything at the output rate.");
     define_uint_option("high-pass", 'h', high_pass, 0U, 192000U, "frequency",
         "Attenuate frequencies lower than the given frequency in the output (default 30).  "
         "A value of 0 disables the filter.");
@@ -105,10 +133,49 @@ options::options() :
         "A value of 7 gives high-quality results.  "
         "Higher values give slightly better results at the expense of more processing time.  "
         "A value of 3 gives satisfactory results for most songs and is faster, though some songs will contain audible artifacts.");
+    define_callback_option("quality", 0, new custom_string_callback<options>(*this, &options::handle_quality), "profile",
+        "Set the quality profile for songs and tracks (default normal).  "
+        "Valid values are draft, normal, and reference.  "
+        "The draft profile is intended for quick previews: notes use linear interpolation, everything is rendered at 22050 Hz (the native rate of the reverb), and normalization is skipped.  "
+        "The reference profile renders everything at the output sample rate and disables optimizations that can alter the output, as with --strict.  "
+        "Both override the --render-rate option.");
+    define_bool_option("raw-stream", 0, raw_stream,
+        "When the output file is given as - and the audio is written to standard output, write raw 16-bit little-endian samples without a WAV header.  "
+        "Without this option a WAV header is written with the lengths set to 0xffffffff, the usual convention for a stream of unknown length.");
+    define_bool_option("flac", 0, flac,
+        "Write FLAC files rather than WAV files.  "
+        "Generated file names end in .flac, and any output file name that doesn't end in .wav is written as FLAC.  "
+        "An output file name ending in .flac is always written as FLAC.  "
+        "The audio is compressed on several threads while it is being extracted.");
 
     // Miscellaneous options.
     define_verbosity_option("quiet", 'Q', verbosity::quiet, "Display errors only.");
     define_verbosity_option("verbose", 'V', verbosity::verbose, "Display extended information.");
+    define_bool_option("strict", 0, strict,
+        "Disable optimizations that can alter the output, such as stopping voices once they have become too quiet to be heard.  "
+        "This is intended for making reference renders.");
+    define_bool_option("dynamic-graph", 0, dynamic_graph,
+        "Always build the audio processing graph from individual modules rather than using the faster combined pipeline for the final stages.  "
+        "The output is identical either way; this option is intended for benchmarking and testing.");
+    define_bool_option("async", 0, async,
+        "Run note generation, reverb, and the final processing stages of songs and tracks on separate threads.  "
+        "The output is identical, but extraction is faster on machines with more than one core.");
+    define_uint_option("shard-length", 0, shard_length, 0U, 3600U, "time",
+        "Split songs and tracks into shards of the given number of seconds and render the shards in parallel (default 0).  "
+        "A value of 0 renders serially.  "
+        "Each shard skips ahead through the music without playing any notes, rebuilds the notes still held at that point, then renders a warm-up period which is discarded.  "
+        "The result can differ slightly from a serial render where reverb, or the release of notes that ended before the warm-up, would still be heard.  "
+        "A note held for longer than the warm-up is rebuilt from that far back only, so a looping instrument may be at a different point in its loop.  "
+        "This can't be combined with --maximum-gap or --realtime.");
+    define_uint_option("shard-warm-up", 0, shard_warm_up, 1U, 60U, "time",
+        "Set the number of seconds rendered and discarded before each shard (default 5).  "
+        "Longer warm-ups bring the shards closer to a serial render at the cost of more processing time.");
+    define_bool_option("verify-shards", 0, verify_shards,
+        "Also render serially when rendering in shards, and report the maximum deviation from the serial render after each seam.");
+    define_string_option("index-cache", 0, index_cache, "file",
+        "Cache the index of the data files in a music directory in the given file, so that later runs against the same directory start faster.  "
+        "The index records where every patch is found, and is rebuilt automatically if any of the data files or directories change.  "
+        "A cache that can't be written only gives a warning.");
     define_bool_option("version", 0, version, "Display version and license information.");
     define_bool_option("help", 0, help, "Display help text.");
 }
@@ -170,6 +237,34 @@ options::handle_reverb_volume(std::string value)
 }
 
 
+//
+// Apply the settings for the quality profile.
+//
+
+void
+options::apply_quality()
+{
+    assert(sample_rate > 0);
+    switch (quality)
+    {
+    case quality_profile::draft:
+        render_rate = PSXDMH_REVERB_RATE;
+        linear_interpolation = true;
+        normalize = false;
+        break;
+
+    case quality_profile::normal:
+        break;
+
+    case quality_profile::reference:
+        render_rate = sample_rate;
+        strict = true;
+        break;
+    }
+    render_rate = std::min(render_rate, sample_rate);
+}
+
+
 //
 // Custom callback to handle stereo expansion.
 //
@@ -181,4 +276,30 @@ options::handle_stereo_expansion(std::string value)
 }
 
 
+//
+// Custom callback to handle the quality profile.
+//
+
+void
+options::handle_quality(std::string value)
+{
+    if (value == "draft")
+    {
+        quality = quality_profile::draft;
+    }
+    else if (value == "normal")
+    {
+        quality = quality_profile::normal;
+    }
+    else if (value == "reference")
+    {
+        quality = quality_profile::reference;
+    }
+    else
+    {
+        throw std::string("Unknown quality profile '") + value + "'.";
+    }
+}
+
+
 }; //namespace psxdmh
@@ -28,6 +28,16 @@ namespace psxdmh
 {
 
 
+// Quality profiles. Each profile bundles settings trading speed against
+// quality.
+enum class quality_profile
+{
+    draft,
+    normal,
+    reference
+};
+
+
 // Options controlling the behaviour of psxdmh.
 class options : public command_line
 {
@@ -43,9 +53,14 @@ private:
     void handle_reverb_preset(std::string value);
     void handle_reverb_volume(std::string value);
     void handle_stereo_expansion(std::string value);
+    void handle_quality(std::string value);
 
 public:
 
+    // Apply the settings for the quality profile. This must be called once the
+    // output sample rate is known.
+    void apply_quality();
+
     // - - - - - - - - - - - - Volume adustment options - - - - - - - - - - - -
 
     // Volume scaling (amplitude).
@@ -64,6 +79,12 @@ public:
     // means repeat indefinitely. Other values play exactly that many times.
     uint32_t play_count;
 
+    // Maximum number of voices playing at once. A value of 0 means unlimited.
+    uint32_t max_voices;
+
+    // Lower the quality of new notes as required to keep up with real time.
+    bool realtime;
+
     // - - - - - - - - - - - Silence adjustment options - - - - - - - - - - -
 
     // Amount of leading and trailing silence to enforce on songs and tracks.
@@ -91,6 +112,11 @@ public:
     // Output sample rate.
     uint32_t sample_rate;
 
+    // Rate at which songs and tracks are rendered internally before being
+    // converted to the output sample rate. This is never more than the output
+    // sample rate once the options have been validated.
+    uint32_t render_rate;
+
     // High-pass and low-pass frequencies for filtering the generated audio. A
     // value of 0 means that filter is not required.
     uint32_t high_pass;
@@ -99,8 +125,42 @@ public:
     // Resampling configuration.
     uint32_t sinc_window;
 
+    // Quality profile, and whether notes are resampled with linear rather than
+    // sinc interpolation as set by the profile.
+    quality_profile quality;
+    bool linear_interpolation;
+
+    // Write raw samples without a WAV header when writing to standard output.
+    bool raw_stream;
+
+    // Write FLAC rather than WAV files.
+    bool flac;
+
     // - - - - - - - - - - - - - Miscellaneous options - - - - - - - - - - - - -
 
+    // Disable optimizations that can alter the output, such as culling
+    // inaudible voices.
+    bool strict;
+
+    // Always build the audio processing graph from individual modules.
+    bool dynamic_graph;
+
+    // Run the main parts of the audio processing graph on separate threads.
+    bool async;
+
+    // Length in seconds of the time shards in which songs and tracks are
+    // rendered in parallel, and the warm-up rendered and discarded before each
+    // shard. A length of 0 renders serially.
+    uint32_t shard_length;
+    uint32_t shard_warm_up;
+
+    // Compare a sharded render against a serial render.
+    bool verify_shards;
+
+    // File used to cache the index of a music directory between runs. An
+    // empty name means no cache.
+    std::string index_cache;
+
     // Display version and license information.
     bool version;
 
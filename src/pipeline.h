@@ -0,0 +1,231 @@
+// psxdmh/src/pipeline.h
+// Statically composed chain of audio processing stages.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PSXDMH_SRC_PIPELINE_H
+#define PSXDMH_SRC_PIPELINE_H
+
+
+#include "filter.h"
+#include "module.h"
+#include "statistics.h"
+
+
+namespace psxdmh
+{
+
+
+// A pipeline is a single module that applies a chain of simple processing
+// stages to the output of its source. Unlike a graph of modules, the stages are
+// composed at compile time with each stage holding the next as a member, so the
+// whole chain is reached through one virtual call per sample and the compiler
+// is free to inline the stages together.
+//
+// Every stage provides the following:
+//
+//  bool process(S &s, bool live)
+//      Process the sample s in place. The live flag indicates whether the audio
+//      upstream of the stage is still running, and the result indicates whether
+//      it is still running after the stage. This mirrors the result of the next
+//      method of a module.
+//
+//  bool is_running() const
+//      Test whether the stage, or any stage following it, is still generating
+//      output from previous input.
+//
+//  bool is_settled() const
+//      Test whether silent input would pass through the stage, and all stages
+//      following it, as silence without changing any state.
+//
+//  void skip_silence(uint32_t count)
+//      Account for count samples of silence without processing them. This is
+//      only called when the chain is settled.
+
+
+// Final stage of a pipeline.
+template <typename S> class pipeline_end
+{
+public:
+
+    // Process a sample.
+    bool process(S &, bool live) { return live; }
+
+    // Test whether the stage is still generating output.
+    bool is_running() const { return false; }
+
+    // Silence handling.
+    bool is_settled() const { return true; }
+    void skip_silence(uint32_t) {}
+};
+
+
+// Pipeline stage applying a Butterworth filter.
+template <typename S, typename Next> class pipeline_filter
+{
+public:
+
+    // Construction. See filter_core for details of the parameters.
+    pipeline_filter(filter_type type, double cut_off, Next next) :
+        m_core(type, cut_off),
+        m_next(std::move(next))
+    {
+    }
+
+    // Process a sample.
+    bool process(S &s, bool live)
+    {
+        s = m_core.process(s);
+        return m_next.process(s, live || m_core.is_running());
+    }
+
+    // Test whether the stage is still generating output.
+    bool is_running() const { return m_core.is_running() || m_next.is_running(); }
+
+    // Silence handling.
+    bool is_settled() const { return m_core.is_settled() && m_next.is_settled(); }
+    void skip_silence(uint32_t count) { m_next.skip_silence(count); }
+
+private:
+
+    // Filter calculations.
+    filter_core<S> m_core;
+
+    // Next stage.
+    Next m_next;
+};
+
+
+// Pipeline stage applying a fixed volume adjustment.
+template <typename S, typename Next> class pipeline_volume
+{
+public:
+
+    // Construction.
+    pipeline_volume(mono_t level, Next next) :
+        m_level(level),
+        m_next(std::move(next))
+    {
+    }
+
+    // Process a sample.
+    bool process(S &s, bool live)
+    {
+        s *= m_level;
+        return m_next.process(s, live);
+    }
+
+    // Test whether the stage is still generating output.
+    bool is_running() const { return m_next.is_running(); }
+
+    // Silence handling.
+    bool is_settled() const { return m_next.is_settled(); }
+    void skip_silence(uint32_t count) { m_next.skip_silence(count); }
+
+private:
+
+    // Volume scaling.
+    mono_t m_level;
+
+    // Next stage.
+    Next m_next;
+};
+
+
+// Pipeline stage collecting statistics. The stage takes ownership of the
+// statistics object, which must have been constructed without a source.
+template <typename S, typename Next> class pipeline_statistics
+{
+public:
+
+    // Construction.
+    pipeline_statistics(statistics<S> *stats, Next next) :
+        m_statistics(stats),
+        m_next(std::move(next))
+    {
+        assert(stats != nullptr);
+        assert(stats->source() == nullptr);
+    }
+
+    // Process a sample.
+    bool process(S &s, bool live)
+    {
+        m_statistics->measure(s);
+        return m_next.process(s, live);
+    }
+
+    // Test whether the stage is still generating output.
+    bool is_running() const { return m_next.is_running(); }
+
+    // Silence handling.
+    bool is_settled() const { return m_next.is_settled(); }
+    void skip_silence(uint32_t count) { m_statistics->measure_silence(count); m_next.skip_silence(count); }
+
+private:
+
+    // Statistics being collected.
+    std::unique_ptr<statistics<S>> m_statistics;
+
+    // Next stage.
+    Next m_next;
+};
+
+
+// Module running a chain of pipeline stages on the output of its source.
+template <typename S, typename Chain> class pipeline : public module<S>
+{
+public:
+
+    // Construction.
+    pipeline(module<S> *source, Chain chain) :
+        module<S>(source),
+        m_chain(std::move(chain))
+    {
+        assert(source != nullptr);
+    }
+
+    // Test whether the module is still generating output.
+    virtual bool is_running() const { return m_chain.is_running() || this->source_running(); }
+
+    // Get the next sample.
+    virtual bool next(S &s)
+    {
+        bool live = this->source()->next(s);
+        return m_chain.process(s, live);
+    }
+
+    // Silence from the source passes through once the chain has settled.
+    virtual uint32_t silence_ahead(uint32_t limit) const { return m_chain.is_settled() ? this->source()->silence_ahead(limit) : 0; }
+
+    // Skip over samples of silence.
+    virtual void skip_silence(uint32_t count)
+    {
+        assert(m_chain.is_settled());
+        this->source()->skip_silence(count);
+        m_chain.skip_silence(count);
+    }
+
+private:
+
+    // Chain of stages.
+    Chain m_chain;
+};
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_PIPELINE_H
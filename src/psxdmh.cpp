@@ -19,11 +19,14 @@
 #include "global.h"
 
 #include "command_line.h"
+#include "data_bundle.h"
 #include "enum_dir.h"
 #include "extract_audio.h"
 #include "lcd_file.h"
 #include "message.h"
+#include "music_index.h"
 #include "options.h"
+#include "song_analysis.h"
 #include "utility.h"
 #include "version.h"
 #include "wmd_file.h"
@@ -40,28 +43,38 @@ namespace psxdmh
 // Forwards.
 static void handle_extract_songs(const std::vector<std::string> &args, options &opts);
 static void handle_extract_track(const std::vector<std::string> &args, options &opts);
+static void handle_extract_stems(const std::vector<std::string> &args, options &opts);
 static void handle_extract_patch(const std::vector<std::string> &args, options &opts);
 static void handle_dump_lcd(const std::vector<std::string> &args, options &opts);
 static void handle_dump_wmd(const std::vector<std::string> &args, options &opts);
 static void handle_dump_song(const std::vector<std::string> &args, options &opts);
+static void handle_analyze(const std::vector<std::string> &args, options &opts);
 static void handle_pack_data(const std::vector<std::string> &args, options &opts);
+static void handle_pack_bundle(const std::vector<std::string> &args, options &opts);
 static void show_version();
 static void show_help();
 static void load_lcd(std::string file_name, lcd_file &lcd, const options &opts);
 static void load_wmd(std::string file_name, wmd_file &wmd, const options &opts);
-static void load_music_dir(std::string music_dir, wmd_file &wmd, lcd_file &lcd, const options &opts, bool root = true);
+static void load_music_dir(std::string music_dir, wmd_file &wmd, lcd_file &lcd, const options &opts, std::string songs = "");
+static bool select_patches(std::string songs, const wmd_file &wmd, std::vector<bool> &wanted);
+static void find_music_files(std::string music_dir, std::vector<std::string> &directories, std::vector<std::string> &wmd_files, std::vector<std::string> &lcd_files);
 static void validate_filters(const options &opts);
+static void validate_shards(const options &opts);
 static void check_arg_count(const std::vector<std::string> &args, size_t min_args, size_t max_args, std::string what);
+static void redirect_messages(std::string output_name);
 
 
 // Actions.
 static const std::string g_action_song = "song";
 static const std::string g_action_track = "track";
+static const std::string g_action_stems = "stems";
 static const std::string g_action_patch = "patch";
 static const std::string g_action_dump_lcd = "dump-lcd";
 static const std::string g_action_dump_wmd = "dump-wmd";
 static const std::string g_action_dump_song = "dump-song";
+static const std::string g_action_analyze = "analyze";
 static const std::string g_action_pack_data = "pack-data";
+static const std::string g_action_pack_bundle = "pack-bundle";
 
 
 // Default sample rates.
@@ -114,6 +127,10 @@ main(int argc, char *argv[])
         {
             handle_extract_track(args, opts);
         }
+        else if (action == g_action_stems)
+        {
+            handle_extract_stems(args, opts);
+        }
         else if (action == g_action_patch)
         {
             handle_extract_patch(args, opts);
@@ -130,10 +147,18 @@ main(int argc, char *argv[])
         {
             handle_dump_song(args, opts);
         }
+        else if (action == g_action_analyze)
+        {
+            handle_analyze(args, opts);
+        }
         else if (action == g_action_pack_data)
         {
             handle_pack_data(args, opts);
         }
+        else if (action == g_action_pack_bundle)
+        {
+            handle_pack_bundle(args, opts);
+        }
         else if (!action.empty())
         {
             throw std::string("Unknown action '" + action + "' specified.");
@@ -171,13 +196,15 @@ handle_extract_songs(const std::vector<std::string> &args, options &opts)
     {
         opts.sample_rate = g_sample_rate_song;
     }
+    opts.apply_quality();
     validate_filters(opts);
+    validate_shards(opts);
     check_arg_count(args, 3, 4, args[0]);
 
     // Load the data files.
     wmd_file wmd;
     lcd_file lcd;
-    load_music_dir(args[2], wmd, lcd, opts);
+    load_music_dir(args[2], wmd, lcd, opts, args[1]);
     if (opts.repair_patches)
     {
         lcd.repair_patches();
@@ -191,6 +218,7 @@ handle_extract_songs(const std::vector<std::string> &args, options &opts)
     {
         throw std::string("An output file name is only valid when a single song is being extracted.");
     }
+    redirect_messages(name);
     extract_songs(ids, wmd, lcd, name, opts);
 }
 
@@ -207,7 +235,9 @@ handle_extract_track(const std::vector<std::string> &args, options &opts)
     {
         opts.sample_rate = g_sample_rate_song;
     }
+    opts.apply_quality();
     validate_filters(opts);
+    validate_shards(opts);
     check_arg_count(args, 5, 5, args[0]);
     uint16_t song_index = (uint16_t) string_to_long(args[1], 0, SHRT_MAX, "song number");
     uint16_t track_index = (uint16_t) string_to_long(args[2], 0, SHRT_MAX, "track number");
@@ -215,17 +245,63 @@ handle_extract_track(const std::vector<std::string> &args, options &opts)
     // Load the data files.
     wmd_file wmd;
     lcd_file lcd;
-    load_music_dir(args[3], wmd, lcd, opts);
+    load_music_dir(args[3], wmd, lcd, opts, args[1]);
     if (opts.repair_patches)
     {
         lcd.repair_patches();
     }
 
     // Extract one track of a song.
+    redirect_messages(args[4]);
     extract_track(song_index, track_index, wmd, lcd, args[4], opts);
 }
 
 
+//
+// Extract every track of a song along with the mix.
+//
+
+static void
+handle_extract_stems(const std::vector<std::string> &args, options &opts)
+{
+    // Default and validate the args. The stems have to stay aligned with each
+    // other, so gaps can't be removed, and they can't be rendered in shards.
+    if (opts.sample_rate == 0)
+    {
+        opts.sample_rate = g_sample_rate_song;
+    }
+    opts.apply_quality();
+    validate_filters(opts);
+    validate_shards(opts);
+    if (opts.shard_length > 0)
+    {
+        throw std::string("The shard-length option can't be used when extracting stems.");
+    }
+    if (opts.maximum_gap >= 0.0)
+    {
+        throw std::string("The maximum-gap option can't be used when extracting stems.");
+    }
+    check_arg_count(args, 3, 4, args[0]);
+    uint16_t song_index = (uint16_t) string_to_long(args[1], 0, SHRT_MAX, "song number");
+    if (args.size() >= 4 && is_standard_output(args[3]))
+    {
+        throw std::string("Stems can't be written to standard output.");
+    }
+
+    // Load the data files.
+    wmd_file wmd;
+    lcd_file lcd;
+    load_music_dir(args[2], wmd, lcd, opts, args[1]);
+    if (opts.repair_patches)
+    {
+        lcd.repair_patches();
+    }
+
+    // Extract the tracks and the mix.
+    extract_stems(song_index, wmd, lcd, args.size() >= 4 ? args[3] : "", opts);
+}
+
+
 //
 // Extract a range of patches from an LCD file.
 //
@@ -252,6 +328,7 @@ handle_extract_patch(const std::vector<std::string> &args, options &opts)
     {
         throw std::string("An output file name is only valid when a single patch is being extracted.");
     }
+    redirect_messages(name);
     extract_patch(ids, lcd, name, opts);
 }
 
@@ -318,6 +395,41 @@ handle_dump_song(const std::vector<std::string> &args, options &opts)
 }
 
 
+//
+// Analyse songs without rendering them, writing the results as JSON.
+//
+
+static void
+handle_analyze(const std::vector<std::string> &args, options &opts)
+{
+    // Validate the args.
+    assert(!args.empty());
+    assert(args[0] == g_action_analyze);
+    check_arg_count(args, 3, 3, args[0]);
+
+    // The analysis is written to standard output, so messages go to stderr to
+    // keep it valid JSON.
+    message::output(stderr);
+
+    // Load the data files.
+    wmd_file wmd;
+    lcd_file lcd;
+    load_music_dir(args[2], wmd, lcd, opts, args[1]);
+
+    // Analyse the songs.
+    std::vector<uint16_t> ids;
+    parse_range(args[1], (uint16_t) wmd.songs(), "song", ids);
+    song_analyzer analyzer(wmd, lcd, opts.play_count);
+    printf("[\n");
+    for (auto iter = ids.cbegin(); iter != ids.cend(); ++iter)
+    {
+        std::string json = analyzer.analyze(*iter).to_json("  ");
+        printf("%s%s\n", json.c_str(), iter + 1 != ids.cend() ? "," : "");
+    }
+    printf("]\n");
+}
+
+
 //
 // Merge the contents of LCD files.
 //
@@ -342,6 +454,35 @@ handle_pack_data(const std::vector<std::string> &args, options &opts)
 }
 
 
+//
+// Write the data files into a bundle.
+//
+
+static void
+handle_pack_bundle(const std::vector<std::string> &args, options &opts)
+{
+    // Validate the args.
+    assert(!args.empty());
+    assert(args[0] == g_action_pack_bundle);
+    check_arg_count(args, 3, 3, args[0]);
+
+    // Load the data files.
+    wmd_file wmd;
+    lcd_file lcd;
+    load_music_dir(args[1], wmd, lcd, opts);
+
+    // Write the bundle.
+    message::writef(verbosity::normal, "Creating bundle: %s\n", args[2].c_str());
+    data_bundle::write_details details = data_bundle::write(args[2], wmd, lcd);
+
+    // Report the space saved by sharing patch data. Loading reads the bundle
+    // through the mapping, so the amount read falls by the same proportion.
+    double unshared = double(details.size + details.bytes_saved);
+    message::writef(verbosity::normal, "Stored %zu patches as %zu bodies of data, saving %zu bytes (%.1f%% less to load).\n",
+        details.patches, details.bodies, details.bytes_saved, 100.0 * details.bytes_saved / unshared);
+}
+
+
 //
 // Display version and license information.
 //
@@ -383,18 +524,28 @@ show_help()
         "The songs can be specified as a series of one or more individual numbers or hyphen-separated ranges delimited by commas.  "
         "The WMD and LCD data files must be in <music_dir>.  "
         "Files are collected recursively.  "
-        "If a single song is being extracted then an output file name can optionally be specified, otherwise file names will be generated automatically.";
+        "If a single song is being extracted then an output file name can optionally be specified, otherwise file names will be generated automatically.  "
+        "An output file name of - writes the audio to standard output.";
     printf(PSXDMH_NAME " [options] song <song_indexes> <music_dir> [<wav_file>]\n%s\n\n", word_wrap(usage_song, 4, 80).c_str());
 
     std::string usage_track = "Extract a single track from a song into a WAV file.  "
         "The WMD and LCD data files must be in <music_dir>.  "
-        "Files are collected recursively.";
+        "Files are collected recursively.  "
+        "An output file name of - writes the audio to standard output.";
     printf(PSXDMH_NAME " [options] track <song_index> <track_index> <music_dir> <wav_file>\n%s\n\n", word_wrap(usage_track, 4, 80).c_str());
 
+    std::string usage_stems = "Extract every track of a song into its own WAV file, along with the full mix, in a single pass.  "
+        "The WMD and LCD data files must be in <music_dir>.  "
+        "Files are collected recursively.  "
+        "The mix is written to <wav_file>, or to an automatically generated name, and each track is written to the same name with \" - Track <n>\" appended.  "
+        "Each file goes through the same processing as the song and track actions.";
+    printf(PSXDMH_NAME " [options] stems <song_index> <music_dir> [<wav_file>]\n%s\n\n", word_wrap(usage_stems, 4, 80).c_str());
+
     std::string usage_patch = "Extract one or more patches into WAV files.  "
         "The patches can be specified as a series of one or more individual numbers or hyphen-separated ranges delimited by commas.  "
         "An LCD file can be specified with <lcd_file>, or it can refer to a directory containing data files.  "
         "If a single patch is being extracted then an output file name can optionally be specified, otherwise file names will be generated automatically.  "
+        "An output file name of - writes the audio to standard output.  "
         "Note that the only audio-related option that affects this action is --play-count.";
     printf(PSXDMH_NAME " [options] patch <patch_ids> <lcd_file> [<wav_file>]\n%s\n\n", word_wrap(usage_patch, 4, 80).c_str());
 
@@ -410,9 +561,20 @@ show_help()
         "A WMD file can be specified with <wmd_file>, or it can refer to a directory containing data files.";
     printf(PSXDMH_NAME " [options] dump-song <song_index> <wmd_file>\n%s\n\n", word_wrap(usage_dump_song, 4, 80).c_str());
 
+    std::string usage_analyze = "Analyse one or more songs without extracting them, and write the results to standard output as JSON.  "
+        "The songs are specified as for the song action.  "
+        "For each song this gives the estimated length, the loop points, the peak number of notes playing at once, and the number of each type of music event on every track.  "
+        "Note lifetimes are estimated from the envelopes and patches, and the only option that affects this action is --play-count.";
+    printf(PSXDMH_NAME " [options] analyze <song_indexes> <music_dir>\n%s\n\n", word_wrap(usage_analyze, 4, 80).c_str());
+
     std::string usage_pack_data = "Merge the contents of multiple LCD files from <music_dir>, and write the result into <new_lcd_file>.";
     printf(PSXDMH_NAME " [options] pack-data <music_dir> <new_lcd_file>\n%s\n\n", word_wrap(usage_pack_data, 4, 80).c_str());
 
+    std::string usage_pack_bundle = "Write the WMD file and all of the patches from <music_dir> into a single bundle file, <new_bundle_file>.  "
+        "A bundle is used in place without being searched or parsed, so it is the fastest way to load the data.  "
+        "Every action that accepts <music_dir>, <lcd_file>, or <wmd_file> also accepts a bundle.";
+    printf(PSXDMH_NAME " [options] pack-bundle <music_dir> <new_bundle_file>\n%s\n\n", word_wrap(usage_pack_bundle, 4, 80).c_str());
+
     printf("Options:\n\n%s\n", options().describe().c_str());
 
     printf("Report bugs to: " PSXDMH_EMAIL "\n" PSXDMH_NAME " home page: <" PSXDMH_URL ">\n\n");
@@ -426,7 +588,7 @@ show_help()
 static void
 load_lcd(std::string file_name, lcd_file &lcd, const options &opts)
 {
-    if (type_of_file(file_name) == file_type::file)
+    if (type_of_file(file_name) == file_type::file && !data_bundle::is_bundle(file_name))
     {
         lcd.parse(file_name);
     }
@@ -445,7 +607,7 @@ load_lcd(std::string file_name, lcd_file &lcd, const options &opts)
 static void
 load_wmd(std::string file_name, wmd_file &wmd, const options &opts)
 {
-    if (type_of_file(file_name) == file_type::file)
+    if (type_of_file(file_name) == file_type::file && !data_bundle::is_bundle(file_name))
     {
         wmd.parse(file_name);
     }
@@ -462,9 +624,209 @@ load_wmd(std::string file_name, wmd_file &wmd, const options &opts)
 //
 
 static void
-load_music_dir(std::string music_dir, wmd_file &wmd, lcd_file &lcd, const options &opts, bool root)
+load_music_dir(std::string music_dir, wmd_file &wmd, lcd_file &lcd, const options &opts, std::string songs)
+{
+    // A bundle holds all of the data in a single file, so there is nothing to
+    // search for.
+    if (type_of_file(music_dir) == file_type::file && data_bundle::is_bundle(music_dir))
+    {
+        message::writef(verbosity::verbose, "Loading '%s'.\n", music_dir.c_str());
+        data_bundle bundle(music_dir);
+        bundle.load_wmd(wmd);
+        std::vector<bool> wanted;
+        bool filter = !songs.empty() && select_patches(songs, wmd, wanted);
+        bundle.load_lcd(lcd, filter ? &wanted : nullptr);
+        return;
+    }
+
+    // Find the data files, using the cached index if it is still current.
+    // Otherwise the directory is searched, and the index is rebuilt if a cache
+    // is in use. There can be only one WMD file.
+    std::vector<std::string> wmd_files, lcd_files;
+    music_index cache;
+    bool cached = !opts.index_cache.empty() && cache.read(opts.index_cache, music_dir);
+    bool rebuild = !opts.index_cache.empty() && !cached;
+    if (cached)
+    {
+        message::writef(verbosity::verbose, "Using index cache '%s'.\n", opts.index_cache.c_str());
+        wmd_files = cache.wmd_files();
+        lcd_files = cache.lcd_files();
+    }
+    else
+    {
+        std::vector<std::string> directories;
+        find_music_files(music_dir, directories, wmd_files, lcd_files);
+        if (rebuild)
+        {
+            cache.build(music_dir, directories, wmd_files, lcd_files);
+        }
+    }
+    if (wmd_files.size() > 1)
+    {
+        throw std::string("Found more than one WMD file. Only one is allowed.");
+    }
+    if (wmd_files.empty())
+    {
+        throw std::string("No WMD file found.");
+    }
+
+    // When the songs to be played are given, parse the WMD file first so that
+    // only the patches used by those songs are loaded from the LCD files. If
+    // the songs can't be identified then every patch is loaded, leaving the
+    // caller to report the error.
+    std::exception_ptr wmd_error;
+    auto parse_wmd = [&]()
+    {
+        try
+        {
+            wmd.parse(wmd_files.front());
+        }
+        catch (...)
+        {
+            wmd_error = std::current_exception();
+        }
+    };
+    std::vector<bool> wanted;
+    bool filter = false;
+    if (!songs.empty())
+    {
+        parse_wmd();
+        filter = !wmd_error && select_patches(songs, wmd, wanted);
+    }
+
+    // Parse the LCD files on worker threads, each into its own object, while
+    // the WMD file is parsed on this thread if it hasn't been already. Errors
+    // are held until all of the workers have finished. A cached index gives
+    // the location of every patch, while rebuilding the index needs every
+    // patch to be located.
+    std::vector<lcd_file> lcds(lcd_files.size());
+    std::vector<std::exception_ptr> errors(lcd_files.size());
+    std::atomic<size_t> next_file(0);
+    auto parse_lcds = [&]()
+    {
+        for (size_t index = next_file++; index < lcd_files.size(); index = next_file++)
+        {
+            try
+            {
+                if (cached)
+                {
+                    lcds[index].parse_located(lcd_files[index], cache.patches(index), filter ? &wanted : nullptr);
+                }
+                else
+                {
+                    lcds[index].parse(lcd_files[index], filter && !rebuild ? &wanted : nullptr, rebuild ? &cache.patches(index) : nullptr);
+                }
+            }
+            catch (...)
+            {
+                errors[index] = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    size_t thread_count = std::min(size_t(std::max(std::thread::hardware_concurrency(), 1U)), lcd_files.size());
+    for (size_t index = 0; index < thread_count; ++index)
+    {
+        workers.push_back(start_worker(parse_lcds));
+    }
+    if (songs.empty())
+    {
+        parse_wmd();
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    if (!wmd_error && wmd.is_empty())
+    {
+        throw std::string("No WMD file found.");
+    }
+
+    // Report the first error in the order the files were found, so that the
+    // result doesn't depend on the timing of the threads.
+    if (wmd_error)
+    {
+        std::rethrow_exception(wmd_error);
+    }
+    for (auto &error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Save the rebuilt index. The music has loaded, so failing to save the
+    // cache only costs a rebuild next time.
+    if (rebuild)
+    {
+        message::writef(verbosity::verbose, "Writing index cache '%s'.\n", opts.index_cache.c_str());
+        try
+        {
+            cache.write(opts.index_cache);
+        }
+        catch (const std::string &error)
+        {
+            message::writef(verbosity::normal, "Warning: %s The index cache was not saved.\n", error.c_str());
+        }
+    }
+
+    // Combine the LCD files in the order they were found. Where files share a
+    // patch ID the first one found wins, as it always has. Files without any of
+    // the wanted patches are empty, but still count as having been found.
+    for (auto &temp : lcds)
+    {
+        if (lcd.is_empty())
+        {
+            lcd = std::move(temp);
+        }
+        else
+        {
+            lcd.merge(temp);
+        }
+    }
+    if (filter ? lcd_files.empty() : lcd.is_empty())
+    {
+        throw std::string("No LCD files found.");
+    }
+}
+
+
+//
+// Find the patches used by a range of songs.
+//
+
+static bool
+select_patches(std::string songs, const wmd_file &wmd, std::vector<bool> &wanted)
+{
+    // Returns false if the songs can't be identified, in which case every
+    // patch should be loaded and the error left for the caller to report.
+    try
+    {
+        std::vector<uint16_t> ids;
+        parse_range(songs, (uint16_t) wmd.songs(), "song", ids);
+        for (auto id : ids)
+        {
+            wmd.song_patches(id, wanted);
+        }
+        return true;
+    }
+    catch (const std::string &)
+    {
+        return false;
+    }
+}
+
+
+//
+// Find the WMD and LCD files in a music directory recursively.
+//
+
+static void
+find_music_files(std::string music_dir, std::vector<std::string> &directories, std::vector<std::string> &wmd_files, std::vector<std::string> &lcd_files)
 {
     // Enumerate the contents of the directory.
+    directories.push_back(music_dir);
     enum_dir iter(music_dir);
     std::string name;
     file_type type;
@@ -474,50 +836,24 @@ load_music_dir(std::string music_dir, wmd_file &wmd, lcd_file &lcd, const option
         std::string full_name = combine_paths(music_dir, name);
         if (type == file_type::directory)
         {
-            load_music_dir(full_name, wmd, lcd, opts, false);
+            find_music_files(full_name, directories, wmd_files, lcd_files);
         }
         // Look for WMD and LCD files.
         else if (type == file_type::file)
         {
-            // Handle WMD files. There can be only one.
             std::string suffix = name.length() > 4 ? name.substr(name.length() - 4) : "";
             if (strcasecmp(suffix.c_str(), ".wmd") == 0)
             {
-                if (!wmd.is_empty())
-                {
-                    throw std::string("Found more than one WMD file. Only one is allowed.");
-                }
                 message::writef(verbosity::verbose, "Loading '%s'.\n", name.c_str());
-                wmd.parse(full_name);
+                wmd_files.push_back(full_name);
             }
-            // Accumulate LCD files.
             else if (strcasecmp(suffix.c_str(), ".lcd") == 0)
             {
-                // If the destination LCD file is empty then parse into it.
                 message::writef(verbosity::verbose, "Loading '%s'.\n", name.c_str());
-                if (lcd.is_empty())
-                {
-                    lcd.parse(full_name);
-                }
-                // Otherwise parse into a temporary then merge it in.
-                else
-                {
-                    lcd_file temp(full_name);
-                    lcd.merge(temp);
-                }
+                lcd_files.push_back(full_name);
             }
         }
     }
-
-    // Report errors.
-    if (root && wmd.is_empty())
-    {
-        throw std::string("No WMD file found.");
-    }
-    if (root && lcd.is_empty())
-    {
-        throw std::string("No LCD files found.");
-    }
 }
 
 
@@ -544,6 +880,30 @@ validate_filters(const options &opts)
 }
 
 
+//
+// Validate the sharded rendering options.
+//
+
+static void
+validate_shards(const options &opts)
+{
+    // Shards must be independent of each other, which rules out options whose
+    // effect depends on everything that came before.
+    if (opts.shard_length > 0 && opts.maximum_gap >= 0.0)
+    {
+        throw std::string("The shard-length option can't be combined with maximum-gap.");
+    }
+    if (opts.shard_length > 0 && opts.realtime)
+    {
+        throw std::string("The shard-length option can't be combined with realtime.");
+    }
+    if (opts.verify_shards && opts.shard_length == 0)
+    {
+        throw std::string("The verify-shards option requires shard-length.");
+    }
+}
+
+
 //
 // Check if the number of arguments falls into a range. If not, a descriptive
 // std::string will be thrown.
@@ -560,4 +920,18 @@ check_arg_count(const std::vector<std::string> &args, size_t min_args, size_t ma
 }
 
 
+//
+// Move messages to stderr if the audio is being written to standard output.
+//
+
+static void
+redirect_messages(std::string output_name)
+{
+    if (is_standard_output(output_name))
+    {
+        message::output(stderr);
+    }
+}
+
+
 }; //namespace psxdmh
@@ -36,7 +36,10 @@ sinc_table *sinc_table::m_cache = nullptr;
 const sinc_table &
 sinc_table::obtain(uint32_t window, uint32_t rate_out)
 {
-    // Look for a cached table.
+    // Look for a cached table. The cache is shared by every thread that
+    // resamples audio.
+    static std::mutex lock;
+    std::lock_guard<std::mutex> guard(lock);
     sinc_table *table;
     for (table = m_cache; table != nullptr; table = table->m_next)
     {
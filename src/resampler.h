@@ -72,8 +72,8 @@ typedef resampler<stereo_t> resampler_stereo;
 
 
 // Linear resampling. This should not be used on actual audio data as it will
-// produce poor quality sound. It is, however, fine for resampling the envelope
-// since it is quite linear in nature.
+// produce poor quality sound, other than for draft quality previews. It is,
+// however, fine for resampling the envelope since it is quite linear in nature.
 template <typename S> class resampler_linear : public resampler<S>
 {
 public:
@@ -125,7 +125,7 @@ public:
         while (m_fractional_position >= step && m_last_live_sample >= 0)
         {
             // Shuffle the contents of the buffer down, and add the new sample.
-            assert(!this->source()->is_running() || m_last_live_sample == 1);
+            assert(!this->source_running() || m_last_live_sample == 1);
             m_fractional_position -= step;
             m_sample_buffer[0] = m_sample_buffer[1];
             if (!this->source()->next(m_sample_buffer[1]))
@@ -222,13 +222,15 @@ public:
     // Construction. The window size must be at least 1. A value of 7 gives
     // high-quality results, while a value of 3 gives generally satisfactory
     // results though some artifacts will be audible. The speed of this
-    // resampler is proportional to the window size.
-    resampler_sinc(module<S> *source, uint32_t window, uint32_t rate_in, uint32_t rate_out) :
+    // resampler is proportional to the window size. The buffer is allocated
+    // from the arena if one is given.
+    resampler_sinc(module<S> *source, uint32_t window, uint32_t rate_in, uint32_t rate_out, arena *pool = nullptr) :
         resampler<S>(source, rate_in, rate_out),
         m_window((int32_t) window),
-        m_circular_buffer(window * 2, 0), m_buffer_head(0),
+        m_circular_buffer(window * 2, 0, arena_allocator<S>(pool)), m_buffer_head(0),
         m_offset(0),
         m_live_samples(window * 2),
+        m_silent_samples(0),
         m_table(sinc_table::obtain(window, rate_out))
     {
         // Prepare the resampler. The buffer repeats the first sample up to
@@ -269,23 +271,28 @@ public:
         // Calculate the interpolated value at this position.
         assert(m_offset >= 0);
         assert(m_offset < (int32_t) this->rate_out());
-        const std::vector<float> &table = m_table.table();
-        size_t buffer_index = m_buffer_head;
-        size_t table_index = m_table.index_for_offset(m_offset);
-        size_t table_end = table_index + m_window * 2;
-        for (; table_index < table_end; ++table_index)
+        // The calculation is skipped when the buffer holds nothing but
+        // silence.
+        if (m_silent_samples < m_circular_buffer.size())
         {
-            assert(table_index >= 0);
-            assert(table_index < table.size());
-            assert(buffer_index < m_circular_buffer.size());
-            s += m_circular_buffer[buffer_index] * table[table_index];
-            if (++buffer_index >= m_circular_buffer.size())
+            const std::vector<float> &table = m_table.table();
+            size_t buffer_index = m_buffer_head;
+            size_t table_index = m_table.index_for_offset(m_offset);
+            size_t table_end = table_index + m_window * 2;
+            for (; table_index < table_end; ++table_index)
             {
-                assert(buffer_index == m_circular_buffer.size());
-                buffer_index = 0;
+                assert(table_index >= 0);
+                assert(table_index < table.size());
+                assert(buffer_index < m_circular_buffer.size());
+                s += m_circular_buffer[buffer_index] * table[table_index];
+                if (++buffer_index >= m_circular_buffer.size())
+                {
+                    assert(buffer_index == m_circular_buffer.size());
+                    buffer_index = 0;
+                }
             }
+            s = flush_denorm(s);
         }
-        s = flush_denorm(s);
 
         // Advance the filter.
         m_offset += this->rate_in();
@@ -302,6 +309,14 @@ public:
                 m_circular_buffer[m_buffer_head] = m_circular_buffer[previous];
                 m_live_samples--;
             }
+            if (m_circular_buffer[m_buffer_head] != mono_t(0.0))
+            {
+                m_silent_samples = 0;
+            }
+            else if (m_silent_samples < m_circular_buffer.size())
+            {
+                ++m_silent_samples;
+            }
 
             if (++m_buffer_head >= m_circular_buffer.size())
             {
@@ -322,7 +337,7 @@ private:
     // than the window size to the left of the interpolation position and is
     // located at the offset m_buffer_head. As this is a circular buffer, the
     // samples wrap.
-    std::vector<S> m_circular_buffer;
+    std::vector<S, arena_allocator<S>> m_circular_buffer;
     size_t m_buffer_head;
 
     // Offset of the first buffered sample relative to the interpolation
@@ -337,6 +352,10 @@ private:
     // no more real samples left in the buffer.
     int m_live_samples;
 
+    // Number of consecutive silent samples most recently added to the buffer.
+    // The buffer is entirely silent once this reaches the buffer size.
+    size_t m_silent_samples;
+
     // Table with pre-computed sinc values.
     const sinc_table &m_table;
 };
@@ -26,10 +26,6 @@ namespace psxdmh
 {
 
 
-// Sample rate in the reverb effect core.
-#define PSXDMH_REVERB_RATE      (22050)
-
-
 //
 // Get the name of a reverb preset.
 //
@@ -225,6 +221,7 @@ reverb_core::reverb_core(module_stereo *source, reverb_preset preset, stereo_t v
     m_preset(preset),
     m_volume(volume),
     m_buffer(m_buffer_size[preset], 0.0f), m_current(0),
+    m_silent_samples(0), m_sound_written(false),
     m_buffer_is_silent(false), m_last_unsilent_sample(0)
 {
     assert(source != nullptr);
@@ -289,7 +286,7 @@ bool
 reverb_core::is_running() const
 {
     // Reverb is definitely running if the source is still running.
-    if (source()->is_running())
+    if (source_running())
     {
         return true;
     }
@@ -329,56 +326,78 @@ bool
 reverb_core::next(stereo_t &s)
 {
     // Get the next sample from the source.
-    bool live = source()->next(s) || is_running();
+    bool live = next_from_source(s) || is_running();
     if (live)
     {
-        // Apply volume to the input.
-        mono_t lin = m_vlin * s.left;
-        mono_t rin = m_vrin * s.right;
-
-        // Same side reflection.
-        const mono_t prev_mlsame = read_buffer(m_mlsame_1);
-        const mono_t prev_mrsame = read_buffer(m_mrsame_1);
-        write_buffer(m_mlsame, (lin + read_buffer(m_dlsame) * m_vwall - prev_mlsame) * m_viir + prev_mlsame);
-        write_buffer(m_mrsame, (rin + read_buffer(m_drsame) * m_vwall - prev_mrsame) * m_viir + prev_mrsame);
-
-        // Different side reflection.
-        const mono_t prev_mldiff = read_buffer(m_mldiff_1);
-        const mono_t prev_mrdiff = read_buffer(m_mrdiff_1);
-        write_buffer(m_mldiff, (lin + read_buffer(m_drdiff) * m_vwall - prev_mldiff) * m_viir + prev_mldiff);
-        write_buffer(m_mrdiff, (rin + read_buffer(m_dldiff) * m_vwall - prev_mrdiff) * m_viir + prev_mrdiff);
-
-        // Early echo.
-        mono_t lout = m_vcomb1 * read_buffer(m_mlcomb1) + m_vcomb2 * read_buffer(m_mlcomb2) + m_vcomb3 * read_buffer(m_mlcomb3) + m_vcomb4 * read_buffer(m_mlcomb4);
-        mono_t rout = m_vcomb1 * read_buffer(m_mrcomb1) + m_vcomb2 * read_buffer(m_mrcomb2) + m_vcomb3 * read_buffer(m_mrcomb3) + m_vcomb4 * read_buffer(m_mrcomb4);
-
-        // Late reverb all pass filter 1.
-        lout -= m_vapf1 * read_buffer(m_mlapf1_dapf1);
-        write_buffer(m_mlapf1, lout);
-        lout = lout * m_vapf1 + read_buffer(m_mlapf1_dapf1);
-        rout -= m_vapf1 * read_buffer(m_mrapf1_dapf1);
-        write_buffer(m_mrapf1, rout);
-        rout = rout * m_vapf1 + read_buffer(m_mrapf1_dapf1);
-
-        // Late reverb all pass filter 2.
-        lout -= m_vapf2 * read_buffer(m_mlapf2_dapf2);
-        write_buffer(m_mlapf2, lout);
-        lout = lout * m_vapf2 + read_buffer(m_mlapf2_dapf2);
-        rout -= m_vapf2 * read_buffer(m_mrapf2_dapf2);
-        write_buffer(m_mrapf2, rout);
-        rout = rout * m_vapf2 + read_buffer(m_mrapf2_dapf2);
-
-        // Apply volume to the output.
-        s = flush_denorm(m_volume * stereo_t(lout, rout));
-
-        // Advance the buffer position.
-        if (++m_current >= m_buffer.size())
-        {
-            m_current = 0;
-        }
+        process(s);
     }
     return live;
 }
 
 
+//
+// Run the reverb network for one sample.
+//
+
+void
+reverb_core::process(stereo_t &s)
+{
+    // When the buffer holds nothing but silence and the input is silent the
+    // output is silent and the buffer remains unchanged. As the network only
+    // depends on positions relative to the current one there is no need to
+    // advance through the buffer either.
+    if (m_silent_samples >= m_buffer.size() && s == 0.0f)
+    {
+        return;
+    }
+
+    // Apply volume to the input.
+    mono_t lin = m_vlin * s.left;
+    mono_t rin = m_vrin * s.right;
+
+    // Same side reflection.
+    const mono_t prev_mlsame = read_buffer(m_mlsame_1);
+    const mono_t prev_mrsame = read_buffer(m_mrsame_1);
+    write_buffer(m_mlsame, (lin + read_buffer(m_dlsame) * m_vwall - prev_mlsame) * m_viir + prev_mlsame);
+    write_buffer(m_mrsame, (rin + read_buffer(m_drsame) * m_vwall - prev_mrsame) * m_viir + prev_mrsame);
+
+    // Different side reflection.
+    const mono_t prev_mldiff = read_buffer(m_mldiff_1);
+    const mono_t prev_mrdiff = read_buffer(m_mrdiff_1);
+    write_buffer(m_mldiff, (lin + read_buffer(m_drdiff) * m_vwall - prev_mldiff) * m_viir + prev_mldiff);
+    write_buffer(m_mrdiff, (rin + read_buffer(m_dldiff) * m_vwall - prev_mrdiff) * m_viir + prev_mrdiff);
+
+    // Early echo.
+    mono_t lout = m_vcomb1 * read_buffer(m_mlcomb1) + m_vcomb2 * read_buffer(m_mlcomb2) + m_vcomb3 * read_buffer(m_mlcomb3) + m_vcomb4 * read_buffer(m_mlcomb4);
+    mono_t rout = m_vcomb1 * read_buffer(m_mrcomb1) + m_vcomb2 * read_buffer(m_mrcomb2) + m_vcomb3 * read_buffer(m_mrcomb3) + m_vcomb4 * read_buffer(m_mrcomb4);
+
+    // Late reverb all pass filter 1.
+    lout -= m_vapf1 * read_buffer(m_mlapf1_dapf1);
+    write_buffer(m_mlapf1, lout);
+    lout = lout * m_vapf1 + read_buffer(m_mlapf1_dapf1);
+    rout -= m_vapf1 * read_buffer(m_mrapf1_dapf1);
+    write_buffer(m_mrapf1, rout);
+    rout = rout * m_vapf1 + read_buffer(m_mrapf1_dapf1);
+
+    // Late reverb all pass filter 2.
+    lout -= m_vapf2 * read_buffer(m_mlapf2_dapf2);
+    write_buffer(m_mlapf2, lout);
+    lout = lout * m_vapf2 + read_buffer(m_mlapf2_dapf2);
+    rout -= m_vapf2 * read_buffer(m_mrapf2_dapf2);
+    write_buffer(m_mrapf2, rout);
+    rout = rout * m_vapf2 + read_buffer(m_mrapf2_dapf2);
+
+    // Apply volume to the output.
+    s = flush_denorm(m_volume * stereo_t(lout, rout));
+
+    // Advance the buffer position.
+    if (++m_current >= m_buffer.size())
+    {
+        m_current = 0;
+    }
+    m_silent_samples = m_sound_written ? 0 : m_silent_samples + 1;
+    m_sound_written = false;
+}
+
+
 }; //namespace psxdmh
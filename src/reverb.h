@@ -30,6 +30,10 @@ namespace psxdmh
 {
 
 
+// Sample rate in the reverb effect core.
+#define PSXDMH_REVERB_RATE      (22050)
+
+
 // Reverb presets.
 enum reverb_preset
 {
@@ -99,12 +103,16 @@ public:
 
 private:
 
+    // Run the reverb network for one sample, replacing the input with the
+    // output.
+    void process(stereo_t &s);
+
     // Read a value from the work area. The offset is wrapped into the range
     // used by the buffer.
     mono_t read_buffer(size_t offset) const { return m_buffer[wrap_offset(m_current + offset)]; }
 
     // Write a value into the work area.
-    void write_buffer(size_t offset, mono_t v) { m_buffer[wrap_offset(m_current + offset)] = flush_denorm(v); }
+    void write_buffer(size_t offset, mono_t v) { v = flush_denorm(v); m_buffer[wrap_offset(m_current + offset)] = v; m_sound_written |= v != 0.0f; }
 
     // Wrap an offset into the range used by the buffer. Since a simple (and
     // fast) calculation is used, the assert checks that the offset is
@@ -129,6 +137,13 @@ private:
     // Current position within the buffer.
     size_t m_current;
 
+    // Number of consecutive samples for which only silence has been written to
+    // the buffer, and whether anything other than silence has been written for
+    // the current sample. Once a full pass of the buffer has been written with
+    // silence the buffer holds nothing else.
+    size_t m_silent_samples;
+    bool m_sound_written;
+
     // SPU reverb registers. Volume-related registers are stored as mono_t,
     // while address/offset registers (specified as bytes/8) are converted to
     // array offsets.
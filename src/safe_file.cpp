@@ -32,8 +32,19 @@ namespace psxdmh
 
 safe_file::safe_file(std::string file_name, file_mode mode) :
     m_file_name(file_name), m_mode(mode),
+    m_stream(mode == file_mode::write && is_standard_output(file_name)),
     m_size(0)
 {
+    // Use standard output in binary mode if requested.
+    if (m_stream)
+    {
+#if defined(PSXDMH_TARGET_WINDOWS)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif // Target.
+        m_file = stdout;
+        return;
+    }
+
     // Attempt to open the file.
     m_file = fopen(file_name.c_str(), mode == file_mode::write ? "wb" : "rb");
     if (m_file == nullptr)
@@ -76,7 +87,8 @@ safe_file::close()
 {
     if (m_file != nullptr)
     {
-        bool bad = fclose(m_file) != 0;
+        // Standard output is flushed rather than closed.
+        bool bad = (m_stream ? fflush(m_file) : fclose(m_file)) != 0;
         m_file = nullptr;
         if (bad)
         {
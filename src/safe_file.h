@@ -41,8 +41,9 @@ class safe_file : public uncopyable
 {
 public:
 
-    // Construction. Note that the constructor will throw an exception if it
-    // encounters an error.
+    // Construction. A file name of "-" in write mode writes to standard
+    // output, which can't seek. Note that the constructor will throw an
+    // exception if it encounters an error.
     safe_file(std::string file_name, file_mode mode);
 
     // Destruction.
@@ -51,6 +52,9 @@ public:
     // File name.
     std::string file_name() const { return m_file_name; }
 
+    // Test if the file is standard output.
+    bool is_stream() const { return m_stream; }
+
     // Close the file. Although the destructor will close an open file, it is
     // better to call the close method explicitly so that any errors can be
     // reported.
@@ -118,6 +122,9 @@ private:
     std::string m_file_name;
     file_mode m_mode;
 
+    // Whether the file is standard output.
+    bool m_stream;
+
     // Size of the file. This is only set in read mode.
     size_t m_size;
 };
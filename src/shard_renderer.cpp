@@ -0,0 +1,261 @@
+// psxdmh/src/shard_renderer.cpp
+// Parallel rendering of audio in time shards.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "global.h"
+
+#include "shard_renderer.h"
+
+
+namespace psxdmh
+{
+
+
+//
+// Construction.
+//
+
+shard_renderer::shard_renderer(factory make_shard, uint32_t sample_rate, uint32_t shard_length, uint32_t warm_up, unsigned threads, module_stereo *reference) :
+    m_make_shard(make_shard),
+    m_sample_rate(sample_rate),
+    m_shard_length(shard_length), m_warm_up(warm_up),
+    m_shard_samples(size_t(shard_length) * sample_rate),
+    m_threads(std::max(threads, 1U)),
+    m_reference(reference),
+    m_next_shard(0),
+    m_position(0), m_front_ready(false), m_finished(false),
+    m_stop(false)
+{
+    assert(make_shard);
+    assert(sample_rate > 0);
+    assert(shard_length > 0);
+}
+
+
+//
+// Destruction.
+//
+
+shard_renderer::~shard_renderer()
+{
+    m_stop.store(true);
+    for (auto &s : m_shards)
+    {
+        if (s->worker.joinable())
+        {
+            s->worker.join();
+        }
+    }
+}
+
+
+//
+// Test whether the module is still generating output.
+//
+
+bool
+shard_renderer::is_running() const
+{
+    return ready();
+}
+
+
+//
+// Get the next sample.
+//
+
+bool
+shard_renderer::next(stereo_t &s)
+{
+    if (!ready())
+    {
+        s = 0.0;
+        return false;
+    }
+    s = m_shards.front()->samples[m_position++];
+    if (m_reference != nullptr)
+    {
+        verify(s);
+    }
+    return true;
+}
+
+
+//
+// Start rendering further shards.
+//
+
+void
+shard_renderer::start_shards() const
+{
+    // The front shard no longer counts against the limit once it has finished
+    // rendering, so that the workers stay busy while it is being consumed.
+    while (m_shards.size() - (m_front_ready ? 1 : 0) < m_threads)
+    {
+        std::unique_ptr<shard> s(new shard);
+        s->index = m_next_shard++;
+        s->samples.resize(m_shard_samples);
+        s->count = 0;
+        s->ended = false;
+        s->worker = start_worker(&shard_renderer::render, this, std::ref(*s));
+        m_shards.push_back(std::move(s));
+    }
+}
+
+
+//
+// Render a shard.
+//
+
+void
+shard_renderer::render(shard &s) const
+{
+    try
+    {
+        // Create the graph for the shard, starting it early to allow for the
+        // warm-up. The first shard starts at the beginning and so is exact.
+        uint32_t start = s.index * m_shard_length;
+        uint32_t warm_up = std::min(m_warm_up, start);
+        std::unique_ptr<module_stereo> graph(m_make_shard(start - warm_up));
+
+        // Discard the warm-up, skipping silence in bulk.
+        uint64_t discard = uint64_t(warm_up) * m_sample_rate;
+        stereo_t temp;
+        while (discard > 0 && !m_stop.load(std::memory_order_relaxed))
+        {
+            uint32_t silent = graph->silence_ahead(uint32_t(std::min(discard, uint64_t(UINT32_MAX))));
+            if (silent > 0)
+            {
+                graph->skip_silence(silent);
+                discard -= silent;
+            }
+            else if (graph->next(temp))
+            {
+                discard--;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        // Render the shard itself. A shard that stops short is the last one.
+        size_t count = 0;
+        while (count < s.samples.size() && !m_stop.load(std::memory_order_relaxed))
+        {
+            uint32_t silent = graph->silence_ahead(uint32_t(std::min(s.samples.size() - count, size_t(UINT32_MAX))));
+            if (silent > 0)
+            {
+                graph->skip_silence(silent);
+                std::fill(s.samples.begin() + count, s.samples.begin() + count + silent, stereo_t(0.0f));
+                count += silent;
+            }
+            else if (graph->next(s.samples[count]))
+            {
+                count++;
+            }
+            else
+            {
+                break;
+            }
+        }
+        s.count = count;
+        s.ended = count < s.samples.size();
+    }
+    catch (...)
+    {
+        s.error = std::current_exception();
+    }
+}
+
+
+//
+// Make sure the current shard has a sample available.
+//
+
+bool
+shard_renderer::ready() const
+{
+    while (!m_finished)
+    {
+        // Wait for the front shard to finish rendering. Errors are passed on
+        // when the audio reaches the shard that failed.
+        if (m_shards.empty())
+        {
+            start_shards();
+        }
+        shard &front = *m_shards.front();
+        if (!m_front_ready)
+        {
+            front.worker.join();
+            m_front_ready = true;
+            if (front.error)
+            {
+                m_finished = true;
+                std::rethrow_exception(front.error);
+            }
+            if (m_reference != nullptr)
+            {
+                m_deviation.push_back(0.0f);
+            }
+            start_shards();
+        }
+
+        // Use the front shard until it runs out, then move on to the next.
+        if (m_position < front.count)
+        {
+            return true;
+        }
+        if (front.ended)
+        {
+            m_finished = true;
+            break;
+        }
+        m_shards.pop_front();
+        m_position = 0;
+        m_front_ready = false;
+    }
+
+    // Any audio left in the reference counts against the last shard.
+    if (m_reference != nullptr && !m_deviation.empty())
+    {
+        stereo_t r;
+        while (m_reference->next(r))
+        {
+            m_deviation.back() = std::max(m_deviation.back(), magnitude(r));
+        }
+    }
+    return false;
+}
+
+
+//
+// Compare a sample against the reference render.
+//
+
+void
+shard_renderer::verify(const stereo_t &s)
+{
+    assert(m_reference != nullptr);
+    assert(!m_deviation.empty());
+    stereo_t r;
+    m_reference->next(r);
+    m_deviation.back() = std::max(m_deviation.back(), magnitude(s - r));
+}
+
+
+}; //namespace psxdmh
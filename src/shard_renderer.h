@@ -0,0 +1,144 @@
+// psxdmh/src/shard_renderer.h
+// Parallel rendering of audio in time shards.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PSXDMH_SRC_SHARD_RENDERER_H
+#define PSXDMH_SRC_SHARD_RENDERER_H
+
+
+#include "module.h"
+
+
+namespace psxdmh
+{
+
+
+// Audio module that renders a stream in fixed-length time shards on several
+// threads at once, and stitches the shards back together in order.
+//
+// Each shard is rendered by its own graph, created by a factory which is given
+// the time in seconds at which the graph's output must start. The graph is
+// started a warm-up period before the shard so that voices and reverb have a
+// chance to build up, and the warm-up is then discarded. Notes that started
+// before the warm-up are missing from a shard, so the result is not exact but
+// converges on the serial render given a long enough warm-up.
+//
+// An optional reference graph renders the same stream serially, allowing the
+// maximum deviation from the serial render to be measured for each seam.
+class shard_renderer : public module_stereo
+{
+public:
+
+    // Factory creating the graph for a shard. The output of the graph must
+    // start at the given time in seconds.
+    typedef std::function<module_stereo *(uint32_t start)> factory;
+
+    // Construction. The shard length and warm-up are in seconds. At most
+    // threads shards are rendered at once. The reference may be nullptr, and
+    // if given this object takes ownership of it.
+    shard_renderer(factory make_shard, uint32_t sample_rate, uint32_t shard_length, uint32_t warm_up, unsigned threads, module_stereo *reference);
+
+    // Destruction. Any shards still rendering are stopped.
+    virtual ~shard_renderer();
+
+    // Test whether the module is still generating output. This waits for the
+    // current shard if it hasn't yet finished rendering.
+    virtual bool is_running() const;
+
+    // Get the next sample.
+    virtual bool next(stereo_t &s);
+
+    // Number of seams verified against the reference render. Seam n is the
+    // start of shard n + 1.
+    size_t seams() const { return m_deviation.size() > 0 ? m_deviation.size() - 1 : 0; }
+
+    // Sample position of a seam.
+    uint64_t seam_position(size_t seam) const { assert(seam < seams()); return uint64_t(seam + 1) * m_shard_samples; }
+
+    // Maximum magnitude of the difference from the reference render over the
+    // shard following a seam.
+    mono_t seam_deviation(size_t seam) const { assert(seam < seams()); return m_deviation[seam + 1]; }
+
+private:
+
+    // Shard of audio being rendered on a worker thread.
+    struct shard
+    {
+        uint32_t index;
+        std::vector<stereo_t> samples;
+        size_t count;
+        bool ended;
+        std::exception_ptr error;
+        std::thread worker;
+    };
+
+    // Start rendering further shards until the maximum number are in flight.
+    void start_shards() const;
+
+    // Render a shard. This runs on the shard's worker thread.
+    void render(shard &s) const;
+
+    // Make sure the current shard has a sample available, moving on to the
+    // next shard as required. Returns false once the end has been reached.
+    bool ready() const;
+
+    // Compare a sample against the reference render.
+    void verify(const stereo_t &s);
+
+    // Factory for shard graphs.
+    factory m_make_shard;
+
+    // Sample rate of the output.
+    uint32_t m_sample_rate;
+
+    // Shard length and warm-up, in seconds.
+    uint32_t m_shard_length;
+    uint32_t m_warm_up;
+
+    // Number of samples in each shard.
+    size_t m_shard_samples;
+
+    // Maximum number of shards in flight at once.
+    unsigned m_threads;
+
+    // Reference render for verification, or nullptr.
+    std::unique_ptr<module_stereo> m_reference;
+
+    // Maximum deviation from the reference for each shard consumed so far.
+    mutable std::vector<mono_t> m_deviation;
+
+    // Shards in flight, in order. The front shard is being consumed.
+    mutable std::deque<std::unique_ptr<shard>> m_shards;
+
+    // Index of the next shard to start.
+    mutable uint32_t m_next_shard;
+
+    // Read position in the front shard, whether the front shard has finished
+    // rendering, and whether the end of the stream has been reached.
+    mutable size_t m_position;
+    mutable bool m_front_ready;
+    mutable bool m_finished;
+
+    // Set to ask the workers to stop early.
+    std::atomic<bool> m_stop;
+};
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_SHARD_RENDERER_H
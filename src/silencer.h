@@ -95,6 +95,24 @@ public:
         return false;
     }
 
+    // Get the number of upcoming samples known to be silent. This is the
+    // amount of silence currently buffered.
+    virtual uint32_t silence_ahead(uint32_t limit) const
+    {
+        if (m_buffered_silence == 0 && !m_have_unsilent_sample && m_state != state::finished)
+        {
+            process_audio();
+        }
+        return std::min(limit, m_buffered_silence);
+    }
+
+    // Skip over samples of silence.
+    virtual void skip_silence(uint32_t count)
+    {
+        assert(count <= m_buffered_silence);
+        m_buffered_silence -= count;
+    }
+
 private:
 
     // Audio processing states.
@@ -114,9 +132,19 @@ private:
         assert(m_buffered_silence == 0 && !m_have_unsilent_sample);
         while (!m_have_unsilent_sample)
         {
+            // Silence that the source knows about ahead of time is counted
+            // without generating the samples.
+            uint32_t silent = this->source()->silence_ahead(UINT32_MAX - m_buffered_silence);
+            if (silent > 0)
+            {
+                this->source()->skip_silence(silent);
+                m_buffered_silence += silent;
+                continue;
+            }
+
             if (!this->source()->next(m_unsilent_sample))
             {
-                assert(!this->source()->is_running());
+                assert(!this->source_running());
                 break;
             }
 
@@ -152,7 +180,7 @@ private:
         // Handle lead out. Buffer the requested amount of silence and finish.
         if (m_state == state::lead_out)
         {
-            assert(!this->source()->is_running());
+            assert(!this->source_running());
             if (m_lead_out >= 0)
             {
                 m_buffered_silence = m_lead_out;
@@ -164,7 +192,7 @@ private:
         // unsilent sample has yet been seen.
         if (m_state == state::lead_in)
         {
-            assert(m_have_unsilent_sample || !this->source()->is_running());
+            assert(m_have_unsilent_sample || !this->source_running());
             if (m_lead_in >= 0)
             {
                 m_buffered_silence = m_lead_in;
@@ -0,0 +1,385 @@
+// psxdmh/src/song_analysis.cpp
+// Analysis of songs from their music events.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "global.h"
+
+#include "adpcm.h"
+#include "lcd_file.h"
+#include "song_analysis.h"
+#include "wmd_file.h"
+
+
+namespace psxdmh
+{
+
+
+// Envelope level below which a released note is treated as silent: -60 dB.
+// Exponential releases take a very long time to reach true silence, and notes
+// are culled well before then anyway.
+const mono_t song_analyzer::m_audible_level = 0.001f;
+
+
+// Names of the music events, indexed by music_event_code.
+static const char *g_event_names[PSXDMH_MUSIC_EVENT_CODES] =
+{
+    "note_on",
+    "note_off",
+    "set_instrument",
+    "pitch_bend",
+    "volume",
+    "pan_offset",
+    "set_marker",
+    "jump_to_marker",
+    "unknown_0b",
+    "unknown_0e",
+    "eos"
+};
+
+
+// Convert a time in samples at the analysis rate to a JSON number of seconds.
+static std::string
+json_seconds(uint64_t samples)
+{
+    char temp[32];
+    sprintf(temp, "%.3lf", double(samples) / song_analyzer::sample_rate());
+    return temp;
+}
+
+
+//
+// Convert the analysis to JSON.
+//
+
+std::string
+song_analysis::to_json(std::string indent) const
+{
+    std::string json = indent + "{\n";
+    json += indent + "  \"song\": " + int_to_string(int(song_index)) + ",\n";
+    json += indent + "  \"play_count\": " + int_to_string(int(play_count)) + ",\n";
+    json += indent + "  \"length\": " + json_seconds(length) + ",\n";
+    json += indent + "  \"samples\": " + std::to_string(length) + ",\n";
+    json += indent + "  \"sample_rate\": " + int_to_string(int(song_analyzer::sample_rate())) + ",\n";
+    json += indent + "  \"peak_polyphony\": " + int_to_string(int(peak_polyphony)) + ",\n";
+    json += indent + "  \"tracks\": [\n";
+    for (auto iter = tracks.cbegin(); iter != tracks.cend(); ++iter)
+    {
+        const track_analysis &track = *iter;
+        json += indent + "    {\n";
+        json += indent + "      \"track\": " + int_to_string(int(track.track_index)) + ",\n";
+        json += indent + "      \"instrument\": " + int_to_string(track.instrument) + ",\n";
+        json += indent + "      \"repeat\": " + (track.repeat ? "true" : "false") + ",\n";
+        json += indent + "      \"loop_start\": " + (track.loop_start >= 0 ? json_seconds(uint64_t(track.loop_start)) : "null") + ",\n";
+        json += indent + "      \"loop_end\": " + (track.loop_end >= 0 ? json_seconds(uint64_t(track.loop_end)) : "null") + ",\n";
+        json += indent + "      \"music_end\": " + json_seconds(track.music_end) + ",\n";
+        json += indent + "      \"length\": " + json_seconds(track.length) + ",\n";
+        json += indent + "      \"peak_polyphony\": " + int_to_string(int(track.peak_polyphony)) + ",\n";
+        json += indent + "      \"longest_release\": " + json_seconds(track.longest_release) + ",\n";
+        json += indent + "      \"events\": {";
+        for (size_t code = 0; code < PSXDMH_MUSIC_EVENT_CODES; ++code)
+        {
+            json += std::string(code > 0 ? ", " : " ") + "\"" + g_event_names[code] + "\": " + int_to_string(int(track.events[code]));
+        }
+        json += " }\n";
+        json += indent + "    }" + (iter + 1 != tracks.cend() ? "," : "") + "\n";
+    }
+    json += indent + "  ]\n";
+    json += indent + "}";
+    return json;
+}
+
+
+//  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+
+//
+// Construction.
+//
+
+song_analyzer::song_analyzer(const wmd_file &wmd, const lcd_file &lcd, uint32_t play_count) :
+    m_wmd(wmd), m_lcd(lcd),
+    m_play_count(play_count)
+{
+}
+
+
+//
+// Analyse a song.
+//
+
+song_analysis
+song_analyzer::analyze(size_t song_index)
+{
+    // Analyse each track, collecting the spans of every note in the song.
+    assert(song_index < m_wmd.songs());
+    song_analysis result;
+    result.song_index = song_index;
+    result.play_count = m_play_count;
+    result.length = 0;
+    std::vector<note_span> song_spans;
+    const wmd_song &song = m_wmd.song(song_index);
+    for (size_t track_index = 0; track_index < song.tracks.size(); ++track_index)
+    {
+        track_analysis track;
+        std::vector<note_span> spans;
+        analyze_track(song_index, track_index, track, spans);
+        result.length = std::max(result.length, track.length);
+        result.tracks.push_back(track);
+        song_spans.insert(song_spans.end(), spans.begin(), spans.end());
+    }
+    result.peak_polyphony = peak_polyphony(song_spans);
+    return result;
+}
+
+
+//
+// Analyse a track.
+//
+
+void
+song_analyzer::analyze_track(size_t song_index, size_t track_index, track_analysis &result, std::vector<note_span> &spans)
+{
+    // Prepare the track.
+    const wmd_song_track &track = m_wmd.track(song_index, track_index);
+    if (track.instrument >= m_wmd.instruments())
+    {
+        throw std::string("Invalid instrument number in track header.");
+    }
+    const wmd_instrument &instrument = m_wmd.instrument(track.instrument);
+    result.track_index = track_index;
+    result.instrument = track.instrument;
+    result.repeat = track.repeat;
+    result.loop_start = -1;
+    result.loop_end = -1;
+    result.longest_release = 0;
+    std::fill(result.events, result.events + PSXDMH_MUSIC_EVENT_CODES, 0);
+
+    // Notes that have started but not yet been released: the note number, the
+    // sub-instrument playing it (which may be nullptr), and its span.
+    struct held_note
+    {
+        uint8_t note;
+        const wmd_sub_instrument *sub;
+        size_t span;
+    };
+    std::vector<held_note> held;
+
+    // Run through the music events in the same way as track_player, skipping
+    // directly from one event to the next. An indefinitely repeating track is
+    // analysed for a single play.
+    music_stream stream(track, sample_rate() * 60);
+    uint32_t plays = m_play_count == 0 ? 1 : m_play_count;
+    uint64_t time = 0;
+    music_event ev;
+    for (;;)
+    {
+        while (stream.get_event(ev))
+        {
+            assert(size_t(ev.code) < PSXDMH_MUSIC_EVENT_CODES);
+            result.events[size_t(ev.code)]++;
+            switch (ev.code)
+            {
+            case music_event_code::note_on:
+            {
+                // The note sounds until released, or until the end of the
+                // patch if it doesn't repeat.
+                if (ev.data_0 < 0 || ev.data_0 > 0x7f)
+                {
+                    throw std::string("Invalid note number in note on event.");
+                }
+                uint8_t note = uint8_t(ev.data_0);
+                const wmd_sub_instrument *sub = nullptr;
+                for (auto &candidate : instrument.sub_instruments)
+                {
+                    if (note >= candidate.first_note && note <= candidate.last_note)
+                    {
+                        sub = &candidate;
+                        break;
+                    }
+                }
+                uint64_t duration = sub != nullptr ? patch_time(*sub, note) : UINT64_MAX;
+                spans.push_back(note_span{time, duration != UINT64_MAX ? time + duration : UINT64_MAX});
+                held.push_back(held_note{note, sub, spans.size() - 1});
+                break;
+            }
+
+            case music_event_code::note_off:
+                // Released notes fade out according to their envelope.
+                for (size_t index = 0; index < held.size();)
+                {
+                    if (held[index].note == ev.data_0)
+                    {
+                        uint64_t release = held[index].sub != nullptr ? release_time(*held[index].sub) : 0;
+                        result.longest_release = std::max(result.longest_release, release);
+                        note_span &span = spans[held[index].span];
+                        span.end = std::min(span.end, time + release);
+                        held.erase(held.begin() + index);
+                    }
+                    else
+                    {
+                        index++;
+                    }
+                }
+                break;
+
+            case music_event_code::set_marker:
+                if (result.loop_start < 0)
+                {
+                    result.loop_start = int64_t(time);
+                }
+                break;
+
+            case music_event_code::jump_to_marker:
+                if (result.loop_end < 0)
+                {
+                    result.loop_end = int64_t(time);
+                }
+                if (plays > 1)
+                {
+                    plays--;
+                    if (track.repeat)
+                    {
+                        stream.seek(track.repeat_start);
+                    }
+                }
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        // Move on to the next event. A track with no tempo never reaches it.
+        if (!stream.is_running())
+        {
+            break;
+        }
+        stream.tick();
+        time++;
+        uint32_t ticks = stream.ticks_until_event(UINT32_MAX);
+        if (ticks == UINT32_MAX)
+        {
+            break;
+        }
+        stream.skip_ticks(ticks);
+        time += ticks;
+    }
+
+    // Notes still held at the end of the music are treated as released then.
+    result.music_end = time;
+    for (auto &note : held)
+    {
+        uint64_t release = note.sub != nullptr ? release_time(*note.sub) : 0;
+        note_span &span = spans[note.span];
+        span.end = std::min(span.end, time + release);
+    }
+    result.length = time;
+    for (auto &span : spans)
+    {
+        result.length = std::max(result.length, span.end);
+    }
+    result.peak_polyphony = peak_polyphony(spans);
+}
+
+
+//
+// Estimate the time for a note to fall silent after release.
+//
+
+uint64_t
+song_analyzer::release_time(const wmd_sub_instrument &sub)
+{
+    // Run the envelope up to its peak, then release it and time how long it
+    // takes to become inaudible. Releasing from the peak gives the longest
+    // time possible. The result only depends on the envelope registers, so it
+    // is cached.
+    auto key = std::make_pair(sub.spu_ads, sub.spu_sr);
+    auto found = m_release_times.find(key);
+    if (found != m_release_times.end())
+    {
+        return found->second;
+    }
+    envelope env(sub.spu_ads, sub.spu_sr);
+    mono_t level;
+    uint64_t limit = uint64_t(10) * sample_rate();
+    while (env.is_running() && env.level() < 1.0f && limit-- > 0)
+    {
+        env.next(level);
+    }
+    env.release();
+    uint64_t samples = 0;
+    limit = uint64_t(60) * sample_rate();
+    while (env.is_running() && env.level() >= m_audible_level && samples < limit)
+    {
+        env.next(level);
+        samples++;
+    }
+    m_release_times[key] = samples;
+    return samples;
+}
+
+
+//
+// Time a note takes to play its patch through to the end.
+//
+
+uint64_t
+song_analyzer::patch_time(const wmd_sub_instrument &sub, uint8_t note) const
+{
+    const patch *patch = m_lcd.patch_by_id(sub.patch);
+    if (patch == nullptr || adpcm::repeat_offset(patch->adpcm) >= 0)
+    {
+        return UINT64_MAX;
+    }
+    uint64_t samples = uint64_t(patch->adpcm.size() / PSXDMH_ADPCM_BLOCK_SIZE) * PSXDMH_ADPCM_SAMPLES_PER_BLOCK;
+    uint32_t frequency = wmd_file::pitch_to_frequency(wmd_file::note_to_pitch(sub, note));
+    return frequency > 0 ? samples * sample_rate() / frequency : UINT64_MAX;
+}
+
+
+//
+// Find the maximum number of note spans overlapping at once.
+//
+
+uint32_t
+song_analyzer::peak_polyphony(const std::vector<note_span> &spans)
+{
+    // Sweep through the start and end points in time order. Ends sort before
+    // starts at the same time, as a note ending makes way for the next.
+    std::vector<std::pair<uint64_t, int>> points;
+    points.reserve(spans.size() * 2);
+    for (auto &span : spans)
+    {
+        if (span.end > span.start)
+        {
+            points.push_back(std::make_pair(span.start, 1));
+            points.push_back(std::make_pair(span.end, -1));
+        }
+    }
+    std::sort(points.begin(), points.end());
+    int current = 0;
+    int peak = 0;
+    for (auto &point : points)
+    {
+        current += point.second;
+        peak = std::max(peak, current);
+    }
+    return uint32_t(peak);
+}
+
+
+}; //namespace psxdmh
@@ -0,0 +1,151 @@
+// psxdmh/src/song_analysis.h
+// Analysis of songs from their music events.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PSXDMH_SRC_SONG_ANALYSIS_H
+#define PSXDMH_SRC_SONG_ANALYSIS_H
+
+
+#include "envelope.h"
+#include "music_stream.h"
+#include "utility.h"
+
+
+namespace psxdmh
+{
+
+
+// Forwards.
+class lcd_file;
+class wmd_file;
+
+
+// Number of music event codes, including the end of stream.
+#define PSXDMH_MUSIC_EVENT_CODES    (size_t(music_event_code::eos) + 1)
+
+
+// Results of analysing a track. All times are in samples at the analysis rate.
+struct track_analysis
+{
+    // Index of the track within the song, and the instrument it uses.
+    size_t track_index;
+    uint16_t instrument;
+
+    // Whether the track repeats, and the times when the repeating part first
+    // starts and ends. The times are negative if not found.
+    bool repeat;
+    int64_t loop_start;
+    int64_t loop_end;
+
+    // Time when the music data ends, and when the last note is estimated to
+    // fall silent.
+    uint64_t music_end;
+    uint64_t length;
+
+    // Number of each type of event, indexed by music_event_code.
+    uint32_t events[PSXDMH_MUSIC_EVENT_CODES];
+
+    // Estimated maximum number of notes sounding at once.
+    uint32_t peak_polyphony;
+
+    // Longest time a note is estimated to sound after being released.
+    uint64_t longest_release;
+};
+
+
+// Results of analysing a song.
+struct song_analysis
+{
+    // Convert the analysis to JSON. The indent is applied to every line.
+    std::string to_json(std::string indent) const;
+
+    // Index of the song.
+    size_t song_index;
+
+    // Number of times the song is played. A value of 0 means the song repeats
+    // indefinitely, in which case a single play is analysed.
+    uint32_t play_count;
+
+    // Estimated length of the song before any reverb tail, and the estimated
+    // maximum number of notes sounding at once across all tracks.
+    uint64_t length;
+    uint32_t peak_polyphony;
+
+    // Analysis of each track.
+    std::vector<track_analysis> tracks;
+};
+
+
+// Song analysis without rendering any audio. Only the music events are
+// processed, and the lifetime of each note is estimated from its envelope and
+// patch. This is quick enough to run over every song in a fraction of a second,
+// giving the details needed to schedule and size extraction jobs.
+class song_analyzer : public uncopyable
+{
+public:
+
+    // Construction. The caller must ensure that the WMD file and LCD set remain
+    // valid for the life of this object.
+    song_analyzer(const wmd_file &wmd, const lcd_file &lcd, uint32_t play_count);
+
+    // Analyse a song.
+    song_analysis analyze(size_t song_index);
+
+    // Rate of the analysis in samples per second.
+    static uint32_t sample_rate() { return envelope::sample_rate(); }
+
+private:
+
+    // Time during which a note is sounding.
+    struct note_span
+    {
+        uint64_t start;
+        uint64_t end;
+    };
+
+    // Analyse a track, adding the spans of its notes.
+    void analyze_track(size_t song_index, size_t track_index, track_analysis &result, std::vector<note_span> &spans);
+
+    // Estimated time for a sub-instrument's note to fall silent after release.
+    uint64_t release_time(const wmd_sub_instrument &sub);
+
+    // Time a note takes to play its patch through to the end, or UINT64_MAX if
+    // the patch repeats or is missing.
+    uint64_t patch_time(const wmd_sub_instrument &sub, uint8_t note) const;
+
+    // Maximum number of note spans overlapping at once.
+    static uint32_t peak_polyphony(const std::vector<note_span> &spans);
+
+    // Data files.
+    const wmd_file &m_wmd;
+    const lcd_file &m_lcd;
+
+    // Number of times to play songs.
+    uint32_t m_play_count;
+
+    // Cached release times, indexed by the SPU ADSR registers.
+    std::map<std::pair<uint16_t, uint16_t>, uint64_t> m_release_times;
+
+    // Envelope level below which a released note is treated as silent.
+    static const mono_t m_audible_level;
+};
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_SONG_ANALYSIS_H
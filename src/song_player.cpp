@@ -36,11 +36,20 @@ song_player::song_player(size_t song_index, const wmd_file &wmd, const lcd_file
 {
     // Create the track players.
     assert(song_index < wmd.songs());
-    assert(opts.sample_rate > 0);
+    assert(opts.render_rate > 0);
+    if (opts.max_voices > 0)
+    {
+        m_limiter.reset(new channel_limiter(opts.max_voices));
+    }
+    if (opts.realtime)
+    {
+        m_governor.reset(new realtime_governor(opts.render_rate, opts.linear_interpolation ? 0 : opts.sinc_window));
+    }
     const wmd_song &song = wmd.song(song_index);
     for (size_t track_index = 0; track_index < song.tracks.size(); ++track_index)
     {
-        m_tracks.push_back(std::unique_ptr<track_player>(new track_player(song_index, track_index, wmd, lcd, opts)));
+        m_tracks.push_back(std::unique_ptr<track_player>(new track_player(song_index, track_index, wmd, lcd, opts, m_limiter.get(), m_governor.get())));
+        m_running_tracks.push_back(m_tracks.back().get());
     }
 }
 
@@ -52,8 +61,7 @@ song_player::song_player(size_t song_index, const wmd_file &wmd, const lcd_file
 bool
 song_player::is_running() const
 {
-    auto predicate = [](const std::unique_ptr<track_player> &track) { return track->is_running(); };
-    return std::any_of(m_tracks.cbegin(), m_tracks.cend(), predicate);
+    return !m_running_tracks.empty();
 }
 
 
@@ -64,17 +72,82 @@ song_player::is_running() const
 bool
 song_player::next(stereo_t &stereo)
 {
-    // Accumulate samples from all tracks.
+    // Accumulate samples from all running tracks. Tracks that have finished are
+    // dropped from the running list so that they aren't visited again.
     stereo = 0.0;
     stereo_t temp;
-    bool live = false;
-    for (auto iter = m_tracks.cbegin(); iter != m_tracks.cend(); ++iter)
+    for (size_t index = 0; index < m_running_tracks.size();)
+    {
+        if (m_running_tracks[index]->next(temp))
+        {
+            stereo += temp;
+            index++;
+        }
+        else
+        {
+            m_running_tracks.erase(m_running_tracks.begin() + index);
+        }
+    }
+    if (m_governor != nullptr)
+    {
+        m_governor->measure(1);
+    }
+    return !m_running_tracks.empty();
+}
+
+
+//
+// Get the number of upcoming samples known to be silent.
+//
+
+uint32_t
+song_player::silence_ahead(uint32_t limit) const
+{
+    if (m_running_tracks.empty())
+    {
+        return 0;
+    }
+    for (size_t index = 0; index < m_running_tracks.size() && limit > 0; ++index)
+    {
+        limit = m_running_tracks[index]->silence_ahead(limit);
+    }
+    return limit;
+}
+
+
+//
+// Skip over samples of silence.
+//
+
+void
+song_player::skip_silence(uint32_t count)
+{
+    for (auto track : m_running_tracks)
+    {
+        track->skip_silence(count);
+    }
+    if (m_governor != nullptr)
+    {
+        m_governor->measure(count);
+    }
+}
+
+
+//
+// Advance the music without generating any audio.
+//
+
+void
+song_player::fast_forward(uint64_t count, uint64_t replay_limit)
+{
+    // Tracks are independent of each other, so each is fast forwarded in one
+    // go. Those that finish are dropped as they would be by next.
+    for (auto track : m_running_tracks)
     {
-        live = (*iter)->next(temp) || live;
-        stereo += temp;
+        track->fast_forward(count, replay_limit);
     }
-    assert(live || !is_running());
-    return live;
+    auto predicate = [](const track_player *track) { return !track->is_running(); };
+    m_running_tracks.erase(std::remove_if(m_running_tracks.begin(), m_running_tracks.end(), predicate), m_running_tracks.end());
 }
 
 
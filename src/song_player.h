@@ -50,13 +50,38 @@ public:
     // together all currently playing notes from all tracks.
     virtual bool next(stereo_t &stereo);
 
+    // Get the number of upcoming samples known to be silent. This is the
+    // shortest stretch of silence across all running tracks.
+    virtual uint32_t silence_ahead(uint32_t limit) const;
+
+    // Skip over samples of silence.
+    virtual void skip_silence(uint32_t count);
+
+    // Advance the music of every track by a number of samples without
+    // generating any audio. See track_player::fast_forward.
+    void fast_forward(uint64_t count, uint64_t replay_limit);
+
     // Check if the song failed to repeat when a repeat was requested.
     bool failed_to_repeat() const;
 
+    // Governor for real time extraction, or nullptr if not in use.
+    const realtime_governor *governor() const { return m_governor.get(); }
+
 private:
 
+    // Limiter for the number of voices playing at once across all tracks, or
+    // nullptr if there is no limit. This must be declared before the tracks so
+    // that it outlives them.
+    std::unique_ptr<channel_limiter> m_limiter;
+
+    // Governor for real time extraction, or nullptr if not in use.
+    std::unique_ptr<realtime_governor> m_governor;
+
     // Players for each track.
     std::vector<std::unique_ptr<track_player>> m_tracks;
+
+    // Tracks that are still running, in their original order.
+    std::vector<track_player *> m_running_tracks;
 };
 
 
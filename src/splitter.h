@@ -81,7 +81,7 @@ private:
     public:
 
         // Construction.
-        splitter_parent(module<S> *source) : m_source(source)
+        splitter_parent(module<S> *source) : m_source(source), m_source_finished(false)
         {
             assert(source != nullptr);
         }
@@ -90,17 +90,28 @@ private:
         virtual ~splitter_parent() { assert(m_child_streams.empty()); }
 
         // Test whether the module is still generating output.
-        bool is_running() const { return m_source->is_running(); }
+        bool is_running() const
+        {
+            if (!m_source_finished && !m_source->is_running())
+            {
+                m_source_finished = true;
+            }
+            return !m_source_finished;
+        }
 
         // Load more data into the child stream buffers. This is called by a
         // child when it has exhausted its buffered data and requires more.
         void feed_children()
         {
             S s;
-            if (m_source->next(s))
+            if (!m_source_finished && m_source->next(s))
             {
                 std::for_each(m_child_streams.begin(), m_child_streams.end(), [&s](splitter *child) { child->buffer_data(s); });
             }
+            else
+            {
+                m_source_finished = true;
+            }
         }
 
         // Attach a child stream to the parent.
@@ -123,6 +134,9 @@ private:
         // Source module to be split.
         std::unique_ptr<module<S>> m_source;
 
+        // Set once the source is known to have stopped running.
+        mutable bool m_source_finished;
+
         // Currently running child streams.
         std::vector<splitter *> m_child_streams;
     };
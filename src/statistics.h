@@ -48,7 +48,8 @@ public:
     // the caller to the constructor of the statistics module.
     typedef void (*callback)(uint32_t seconds, double rate, std::string operation);
 
-    // Construction.
+    // Construction. The source may be nullptr when the statistics are to be
+    // fed directly through measure() rather than used as a module in a graph.
     statistics(module<S> *source, statistics_mode mode, uint32_t rate, callback progress_callback, std::string callback_operation) :
         module<S>(source),
         m_mode(mode),
@@ -65,10 +66,22 @@ public:
     }
 
     // Test whether the module is still generating output.
-    virtual bool is_running() const { return this->source()->is_running(); }
+    virtual bool is_running() const { return this->source_running(); }
 
     // Get the next sample.
     virtual bool next(S &s)
+    {
+        bool live = this->source()->next(s);
+        measure(s);
+        return live;
+    }
+
+    // Silence passes through unchanged, and is measured in bulk.
+    virtual uint32_t silence_ahead(uint32_t limit) const { return this->source()->silence_ahead(limit); }
+    virtual void skip_silence(uint32_t count) { this->source()->skip_silence(count); measure_silence(count); }
+
+    // Include a sample in the statistics.
+    void measure(const S &s)
     {
         // Track the number of samples extracted. Start the timer on the first
         // extraction.
@@ -76,7 +89,6 @@ public:
         {
             m_start_time = time_now();
         }
-        bool live = this->source()->next(s);
 
         if (m_mode == statistics_mode::detailed)
         {
@@ -92,23 +104,26 @@ public:
         // Update the progress callback once per second of extracted audio.
         if (--m_samples_until_next_second == 0)
         {
-            // Update the extraction rate every half wall second.
-            m_samples_until_next_second = m_rate;
-            uint32_t song_seconds = uint32_t(m_samples / m_rate);
-            double elapsed = time_now() - m_start_time;
-            uint32_t elapsed_half_seconds = uint32_t(floor(2 * elapsed));
-            if (elapsed_half_seconds != m_last_rate_time)
-            {
-                m_extraction_rate = clamp(double(song_seconds) / elapsed, 0.0, 1000000.0);
-                m_last_rate_time = elapsed_half_seconds;
-            }
-
-            if (m_callback != nullptr)
-            {
-                m_callback(song_seconds, m_extraction_rate, m_callback_operation);
-            }
+            second_complete();
         }
-        return live;
+    }
+
+    // Include a run of silent samples in the statistics. This has the same
+    // effect as measuring each of the samples individually.
+    void measure_silence(uint32_t count)
+    {
+        if (m_samples == 0 && count > 0)
+        {
+            m_start_time = time_now();
+        }
+        while (count >= m_samples_until_next_second)
+        {
+            count -= m_samples_until_next_second;
+            m_samples += m_samples_until_next_second;
+            second_complete();
+        }
+        m_samples += count;
+        m_samples_until_next_second -= count;
     }
 
     // Last calculated extraction rate. This will be 0 until sufficient data has
@@ -126,6 +141,26 @@ public:
 
 private:
 
+    // Handle the completion of a second of extracted audio.
+    void second_complete()
+    {
+        // Update the extraction rate every half wall second.
+        m_samples_until_next_second = m_rate;
+        uint32_t song_seconds = uint32_t(m_samples / m_rate);
+        double elapsed = time_now() - m_start_time;
+        uint32_t elapsed_half_seconds = uint32_t(floor(2 * elapsed));
+        if (elapsed_half_seconds != m_last_rate_time)
+        {
+            m_extraction_rate = clamp(double(song_seconds) / elapsed, 0.0, 1000000.0);
+            m_last_rate_time = elapsed_half_seconds;
+        }
+
+        if (m_callback != nullptr)
+        {
+            m_callback(song_seconds, m_extraction_rate, m_callback_operation);
+        }
+    }
+
     // Mode of operation.
     statistics_mode m_mode;
 
@@ -165,6 +200,113 @@ typedef statistics<mono_t> statistics_mono;
 typedef statistics<stereo_t> statistics_stereo;
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+
+// Governor to keep extraction running faster than real time. The extraction
+// rate is measured over each quarter second of audio, counting only the time
+// the rendering thread was working: time spent waiting for a consumer of the
+// audio, such as an output paced at real time, is left out. When the rate gets
+// too close to real time the quality level is lowered, which reduces the sinc
+// window used to resample new notes and finally switches them to linear
+// interpolation. The level is raised again once the rate recovers. Only new
+// notes are affected so that changes never cause clicks in notes that are
+// already playing.
+class realtime_governor : public uncopyable
+{
+public:
+
+    // Number of quality levels. Level 0 is full quality.
+    static const size_t levels = 4;
+
+    // Construction. The rate is the sample rate of the audio being measured,
+    // and the sinc window is the window used at full quality.
+    realtime_governor(uint32_t rate, uint32_t sinc_window) :
+        m_rate(rate),
+        m_level(0),
+        m_period_start(0.0), m_period_wait(0.0), m_period_samples(0)
+    {
+        assert(rate > 0);
+        m_windows[0] = sinc_window;
+        m_windows[1] = std::min(sinc_window, 5U);
+        m_windows[2] = std::min(sinc_window, 3U);
+        m_windows[3] = 0;
+        std::fill(m_samples_at_level, m_samples_at_level + levels, 0);
+    }
+
+    // Account for a number of samples having been generated.
+    void measure(uint32_t samples)
+    {
+        if (m_period_start == 0.0)
+        {
+            m_period_start = time_now();
+            m_period_wait = output_wait_time();
+        }
+        m_samples_at_level[m_level] += samples;
+        m_period_samples += samples;
+        if (m_period_samples >= m_rate / 4)
+        {
+            evaluate();
+        }
+    }
+
+    // Sinc window to use for new notes at the current quality level. A window
+    // of 0 means linear interpolation.
+    uint32_t sinc_window() const { return m_windows[m_level]; }
+
+    // Sinc window for a quality level.
+    uint32_t level_sinc_window(size_t level) const { assert(level < levels); return m_windows[level]; }
+
+    // Number of samples generated at a quality level.
+    uint64_t samples_at_level(size_t level) const { assert(level < levels); return m_samples_at_level[level]; }
+
+private:
+
+    // Adjust the quality level based on the extraction rate over the period
+    // just completed.
+    void evaluate()
+    {
+        // Lower the quality when the rate falls within 50% of real time, and
+        // only raise it when there is plenty of time to spare. The gap between
+        // the two prevents the level from bouncing back and forth.
+        double now = time_now();
+        double wait = output_wait_time();
+        double elapsed = (now - m_period_start) - (wait - m_period_wait);
+        double rate = elapsed > 0.0 ? double(m_period_samples) / m_rate / elapsed : 1000000.0;
+        if (rate < 1.5 && m_level + 1 < levels)
+        {
+            m_level++;
+        }
+        else if (rate > 3.0 && m_level > 0)
+        {
+            m_level--;
+        }
+        m_period_start = now;
+        m_period_wait = wait;
+        m_period_samples = 0;
+    }
+
+    // Rate of the audio in samples per second.
+    uint32_t m_rate;
+
+    // Current quality level.
+    size_t m_level;
+
+    // Sinc window used at each quality level.
+    uint32_t m_windows[levels];
+
+    // Time when the current measurement period started, the time the thread
+    // had spent waiting for its output at that point, and the number of
+    // samples generated within the period.
+    double m_period_start;
+    double m_period_wait;
+    uint32_t m_period_samples;
+
+    // Number of samples generated at each quality level.
+    uint64_t m_samples_at_level[levels];
+};
+
+
 }; //namespace psxdmh
 
 
@@ -0,0 +1,446 @@
+// psxdmh/src/stem_player.cpp
+// Playback of every track in a song to separate outputs in a single pass.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "global.h"
+
+#include "lcd_file.h"
+#include "options.h"
+#include "stem_player.h"
+#include "wmd_file.h"
+
+
+namespace psxdmh
+{
+
+
+//
+// Construction.
+//
+
+stem_player::stem_player(size_t song_index, const wmd_file &wmd, const lcd_file &lcd, const options &opts, size_t block_size, size_t blocks) :
+    m_blocks(blocks),
+    m_produced(0), m_producer_done(false),
+    m_started(false), m_stop(false)
+{
+    // Create the track players in the same way as song_player.
+    assert(song_index < wmd.songs());
+    assert(block_size > 0 && blocks > 1);
+    if (opts.max_voices > 0)
+    {
+        m_limiter.reset(new channel_limiter(opts.max_voices));
+    }
+    if (opts.realtime)
+    {
+        m_governor.reset(new realtime_governor(opts.render_rate, opts.linear_interpolation ? 0 : opts.sinc_window));
+    }
+    const wmd_song &song = wmd.song(song_index);
+    for (size_t track_index = 0; track_index < song.tracks.size(); ++track_index)
+    {
+        m_tracks.push_back(std::unique_ptr<track_player>(new track_player(song_index, track_index, wmd, lcd, opts, m_limiter.get(), m_governor.get())));
+    }
+    m_running.resize(m_tracks.size(), true);
+
+    // Prepare the blocks, with a channel for each track and one for the mix.
+    size_t channels = m_tracks.size() + 1;
+    for (auto &b : m_blocks)
+    {
+        b.samples.resize(channels, std::vector<stereo_t>(block_size));
+        b.count.resize(channels, 0);
+    }
+    m_consumed.resize(channels, 0);
+    m_attached.resize(channels, false);
+}
+
+
+//
+// Destruction.
+//
+
+stem_player::~stem_player()
+{
+    stop();
+    if (m_worker.joinable())
+    {
+        m_worker.join();
+    }
+}
+
+
+//
+// Create the output for a track.
+//
+
+module_stereo *
+stem_player::track_output(size_t track_index)
+{
+    assert(track_index < m_tracks.size());
+    assert(!m_started);
+    assert(!m_attached[track_index]);
+    m_attached[track_index] = true;
+    return new output(*this, track_index);
+}
+
+
+//
+// Create the output for the mix.
+//
+
+module_stereo *
+stem_player::mix_output()
+{
+    assert(!m_started);
+    assert(!m_attached[m_tracks.size()]);
+    m_attached[m_tracks.size()] = true;
+    return new output(*this, m_tracks.size());
+}
+
+
+//
+// Start playing the tracks.
+//
+
+void
+stem_player::start()
+{
+    assert(!m_started);
+    m_started = true;
+    m_worker = start_worker(&stem_player::produce, this);
+}
+
+
+//
+// Stop playing early.
+//
+
+void
+stem_player::stop()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_stop = true;
+    m_changed.notify_all();
+}
+
+
+//
+// Check if the song failed to repeat when a repeat was requested.
+//
+
+bool
+stem_player::failed_to_repeat() const
+{
+    auto predicate = [](const std::unique_ptr<track_player> &track) { return track->failed_to_repeat(); };
+    return std::any_of(m_tracks.cbegin(), m_tracks.cend(), predicate);
+}
+
+
+//
+// Worker thread playing the tracks.
+//
+
+void
+stem_player::produce()
+{
+    try
+    {
+        bool live = true;
+        for (size_t index = 0; live; ++index)
+        {
+            // Wait for every output still in use to finish with the block.
+            // There is nothing more to do once no output is left.
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                double start = time_now();
+                m_changed.wait(lock, [this, index]() { return m_stop || has_room(index); });
+                add_output_wait_time(time_now() - start);
+                if (m_stop || std::none_of(m_attached.cbegin(), m_attached.cend(), [](bool attached) { return attached; }))
+                {
+                    break;
+                }
+            }
+
+            // Play the block, then publish it.
+            live = play_block(m_blocks[index % m_blocks.size()]);
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_produced = index + 1;
+            m_changed.notify_all();
+        }
+    }
+    catch (...)
+    {
+        m_error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_producer_done = true;
+    m_changed.notify_all();
+}
+
+
+//
+// Play the next block of every track, and mix them.
+//
+
+bool
+stem_player::play_block(block &b)
+{
+    // Play the tracks in step with each other, exactly as song_player does, so
+    // that voices are shared between the tracks in the same way and the mix is
+    // identical. A track that stops short has ended.
+    size_t block_size = b.samples.front().size();
+    size_t mix = m_tracks.size();
+    for (size_t track = 0; track < m_tracks.size(); ++track)
+    {
+        b.count[track] = m_running[track] ? block_size : 0;
+    }
+    size_t pos = 0;
+    bool live = std::find(m_running.cbegin(), m_running.cend(), true) != m_running.cend();
+    while (live && pos < block_size)
+    {
+        // Skip over the silence shared by every running track.
+        uint32_t silent = uint32_t(block_size - pos);
+        for (size_t track = 0; track < m_tracks.size() && silent > 0; ++track)
+        {
+            if (m_running[track])
+            {
+                silent = m_tracks[track]->silence_ahead(silent);
+            }
+        }
+        if (silent > 0)
+        {
+            for (size_t track = 0; track < m_tracks.size(); ++track)
+            {
+                if (m_running[track])
+                {
+                    m_tracks[track]->skip_silence(silent);
+                    std::fill(b.samples[track].begin() + pos, b.samples[track].begin() + pos + silent, stereo_t(0.0f));
+                }
+            }
+            std::fill(b.samples[mix].begin() + pos, b.samples[mix].begin() + pos + silent, stereo_t(0.0f));
+            pos += silent;
+            if (m_governor != nullptr)
+            {
+                m_governor->measure(silent);
+            }
+            continue;
+        }
+
+        // Play a sample of every running track and mix them.
+        stereo_t sum = 0.0;
+        live = false;
+        for (size_t track = 0; track < m_tracks.size(); ++track)
+        {
+            if (m_running[track])
+            {
+                stereo_t &s = b.samples[track][pos];
+                if (m_tracks[track]->next(s))
+                {
+                    sum += s;
+                    live = true;
+                }
+                else
+                {
+                    m_running[track] = false;
+                    b.count[track] = pos;
+                }
+            }
+        }
+        if (m_governor != nullptr)
+        {
+            m_governor->measure(1);
+        }
+        if (live)
+        {
+            b.samples[mix][pos++] = sum;
+        }
+    }
+    b.count[mix] = pos;
+    return pos == block_size;
+}
+
+
+//
+// Test whether the worker has room for another block.
+//
+
+bool
+stem_player::has_room(size_t index) const
+{
+    for (size_t channel = 0; channel < m_attached.size(); ++channel)
+    {
+        if (m_attached[channel] && index - m_consumed[channel] >= m_blocks.size())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+
+//
+// Construction.
+//
+
+stem_player::output::output(stem_player &player, size_t channel) :
+    m_player(player),
+    m_channel(channel),
+    m_current(0), m_position(0), m_holding(false), m_finished(false)
+{
+}
+
+
+//
+// Destruction. The output no longer holds up the worker.
+//
+
+stem_player::output::~output()
+{
+    std::lock_guard<std::mutex> lock(m_player.m_lock);
+    m_player.m_attached[m_channel] = false;
+    m_player.m_changed.notify_all();
+}
+
+
+//
+// Test whether the module is still generating output.
+//
+
+bool
+stem_player::output::is_running() const
+{
+    return ready();
+}
+
+
+//
+// Get the next sample.
+//
+
+bool
+stem_player::output::next(stereo_t &s)
+{
+    if (!ready())
+    {
+        s = 0.0;
+        return false;
+    }
+    s = m_player.m_blocks[m_current % m_player.m_blocks.size()].samples[m_channel][m_position++];
+    return true;
+}
+
+
+//
+// Get the number of upcoming samples known to be silent.
+//
+
+uint32_t
+stem_player::output::silence_ahead(uint32_t limit) const
+{
+    if (!ready())
+    {
+        return 0;
+    }
+    const block &b = m_player.m_blocks[m_current % m_player.m_blocks.size()];
+    const std::vector<stereo_t> &samples = b.samples[m_channel];
+    size_t end = m_position + std::min(size_t(limit), b.count[m_channel] - m_position);
+    size_t pos = m_position;
+    while (pos < end && samples[pos] == 0.0f)
+    {
+        ++pos;
+    }
+    return uint32_t(pos - m_position);
+}
+
+
+//
+// Skip over samples of silence.
+//
+
+void
+stem_player::output::skip_silence(uint32_t count)
+{
+    assert(count <= silence_ahead(count));
+    m_position += count;
+}
+
+
+//
+// Make sure the current block has a sample available.
+//
+
+bool
+stem_player::output::ready() const
+{
+    while (!m_finished)
+    {
+        // Use the current block while it has samples left. A block that is
+        // short for this channel is the last one.
+        if (m_holding)
+        {
+            const block &b = m_player.m_blocks[m_current % m_player.m_blocks.size()];
+            if (m_position < b.count[m_channel])
+            {
+                return true;
+            }
+            if (b.count[m_channel] < b.samples[m_channel].size())
+            {
+                // The channel has ended, so it no longer holds up the worker.
+                std::lock_guard<std::mutex> lock(m_player.m_lock);
+                m_player.m_attached[m_channel] = false;
+                m_player.m_changed.notify_all();
+                m_finished = true;
+                break;
+            }
+        }
+
+        // Hand the block back to the worker and wait for the next one.
+        std::unique_lock<std::mutex> lock(m_player.m_lock);
+        if (m_holding)
+        {
+            m_holding = false;
+            m_position = 0;
+            m_player.m_consumed[m_channel] = ++m_current;
+            m_player.m_changed.notify_all();
+        }
+        size_t current = m_current;
+        m_player.m_changed.wait(lock, [this, current]() { return m_player.m_produced != current || m_player.m_producer_done || m_player.m_stop; });
+        if (m_player.m_produced != current)
+        {
+            m_holding = true;
+        }
+        else if (m_player.m_error)
+        {
+            m_finished = true;
+            std::rethrow_exception(m_player.m_error);
+        }
+        else if (m_player.m_stop)
+        {
+            m_finished = true;
+            throw std::string("Aborted.");
+        }
+        else
+        {
+            m_finished = true;
+        }
+    }
+    return false;
+}
+
+
+}; //namespace psxdmh
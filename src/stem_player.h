@@ -0,0 +1,187 @@
+// psxdmh/src/stem_player.h
+// Playback of every track in a song to separate outputs in a single pass.
+// Copyright (c) 2016,2021 Ben Michell <https://www.muryan.com/>. All rights reserved.
+
+// This file is part of psxdmh.
+//
+// psxdmh is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// psxdmh is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// psxdmh.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PSXDMH_SRC_STEM_PLAYER_H
+#define PSXDMH_SRC_STEM_PLAYER_H
+
+
+#include "module.h"
+#include "track_player.h"
+#include "utility.h"
+
+
+namespace psxdmh
+{
+
+
+// Forwards.
+class lcd_file;
+class options;
+class wmd_file;
+
+
+// Playback manager for all tracks in a song, where each track is also available
+// as a stem. The tracks are played once on a worker thread, and the audio is
+// handed out in blocks to an output module for each track and one for the mix
+// of all tracks. The mix is identical to the output of song_player.
+//
+// Each output is intended to be consumed on its own thread. The worker only
+// reuses a block once every output still in use has finished with it, so the
+// outputs have to be consumed together: an output left waiting while another
+// output of the same player is consumed to the end on the same thread will
+// eventually stall the worker.
+class stem_player : public uncopyable
+{
+public:
+
+    // Construction. The caller must ensure that the WMD file and LCD set remain
+    // valid for the life of this object. The audio is handed out in the given
+    // number of blocks, each of block_size samples.
+    stem_player(size_t song_index, const wmd_file &wmd, const lcd_file &lcd, const options &opts, size_t block_size = 4096, size_t blocks = 8);
+
+    // Destruction. The worker is stopped. All outputs must be destroyed before
+    // the player.
+    ~stem_player();
+
+    // Number of tracks in the song.
+    size_t tracks() const { return m_tracks.size(); }
+
+    // Create the output for a track or for the mix. These may only be created
+    // before the player is started, and only once each. The caller takes
+    // ownership of the output.
+    module_stereo *track_output(size_t track_index);
+    module_stereo *mix_output();
+
+    // Start playing the tracks once all of the required outputs exist.
+    void start();
+
+    // Stop playing early. Any output that needs more audio throws an error.
+    void stop();
+
+    // Check if the song failed to repeat when a repeat was requested. This is
+    // only valid once the outputs have finished.
+    bool failed_to_repeat() const;
+
+    // Governor for real time extraction, or nullptr if not in use.
+    const realtime_governor *governor() const { return m_governor.get(); }
+
+private:
+
+    // Output module for one channel of the player: a track or the mix.
+    class output : public module_stereo
+    {
+    public:
+
+        // Construction and destruction.
+        output(stem_player &player, size_t channel);
+        virtual ~output();
+
+        // Test whether the module is still generating output. This waits for
+        // the worker if it hasn't yet decided.
+        virtual bool is_running() const;
+
+        // Get the next sample.
+        virtual bool next(stereo_t &s);
+
+        // Get the number of upcoming samples known to be silent. Only the
+        // silence in the current block is known ahead of time.
+        virtual uint32_t silence_ahead(uint32_t limit) const;
+
+        // Skip over samples of silence.
+        virtual void skip_silence(uint32_t count);
+
+    private:
+
+        // Make sure the current block has a sample available, taking the next
+        // block as required. Returns false once the channel has ended.
+        bool ready() const;
+
+        // Player supplying the audio, and the channel being output.
+        stem_player &m_player;
+        size_t m_channel;
+
+        // Number of the current block, the read position in it, whether the
+        // output holds it, and whether the channel has ended.
+        mutable size_t m_current;
+        mutable size_t m_position;
+        mutable bool m_holding;
+        mutable bool m_finished;
+    };
+
+    // Block of audio for every channel. The mix is the last channel. A channel
+    // with fewer samples than the block size has ended.
+    struct block
+    {
+        std::vector<std::vector<stereo_t>> samples;
+        std::vector<size_t> count;
+    };
+
+    // Worker thread playing the tracks.
+    void produce();
+
+    // Play the next block of every track, and mix them. Returns false once
+    // every track has ended.
+    bool play_block(block &b);
+
+    // Test whether the worker has room for another block. The lock must be
+    // held.
+    bool has_room(size_t index) const;
+
+    // Limiter and governor shared by the tracks, as for song_player. These
+    // must be declared before the tracks so that they outlive them.
+    std::unique_ptr<channel_limiter> m_limiter;
+    std::unique_ptr<realtime_governor> m_governor;
+
+    // Players for each track, and whether each is still running.
+    std::vector<std::unique_ptr<track_player>> m_tracks;
+    std::vector<bool> m_running;
+
+    // Ring buffer of blocks.
+    std::vector<block> m_blocks;
+
+    // Lock protecting the state below, and the condition signalled whenever it
+    // changes.
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+
+    // Number of blocks published by the worker, and whether it has published
+    // its last block.
+    size_t m_produced;
+    bool m_producer_done;
+
+    // Number of blocks each channel's output has finished with, and whether
+    // each channel has an output still in use.
+    std::vector<size_t> m_consumed;
+    std::vector<bool> m_attached;
+
+    // Whether the player has been started, and whether it has been stopped.
+    bool m_started;
+    bool m_stop;
+
+    // Exception thrown by the tracks, if any.
+    std::exception_ptr m_error;
+
+    // Worker thread.
+    std::thread m_worker;
+};
+
+
+}; //namespace psxdmh
+
+
+#endif // PSXDMH_SRC_STEM_PLAYER_H
@@ -31,25 +31,44 @@ namespace psxdmh
 // Construction.
 //
 
-track_player::track_player(size_t song_index, size_t track_index, const wmd_file &wmd, const lcd_file &lcd, const options &opts) :
+track_player::track_player(size_t song_index, size_t track_index, const wmd_file &wmd, const lcd_file &lcd, const options &opts, channel_limiter *limiter, realtime_governor *governor) :
     m_wmd(wmd), m_lcd(lcd),
-    m_sample_rate(opts.sample_rate),
-    m_sinc_window(opts.sinc_window),
+    m_sample_rate(opts.render_rate),
+    m_sinc_window(opts.linear_interpolation ? 0 : opts.sinc_window),
     m_limit_frequency(!opts.unlimited_frequency),
     m_repair_patches(opts.repair_patches),
+    m_cull_threshold(opts.strict || opts.normalize ? 0.0f : PSXDMH_SILENCE / std::max(opts.volume, mono_t(1.0))),
+    m_fast_forward(false), m_fast_forward_position(0),
     m_play_count(opts.play_count),
-    m_stream(wmd.track(song_index, track_index), opts.sample_rate * 60),
+    m_stream(wmd.track(song_index, track_index), opts.render_rate * 60),
     m_track_volume(1.0),
     m_pan_offset(0), m_stereo_width(opts.stereo_width),
-    m_unit_pitch_bend(0.0)
+    m_unit_pitch_bend(0.0),
+    m_limiter(limiter),
+    m_governor(governor)
 {
     // Get the instrument and repeat details from the track.
-    assert(opts.sample_rate > 0);
+    assert(opts.render_rate > 0);
     assert(m_stereo_width >= -1.0 && m_stereo_width <= 1.0);
     const wmd_song_track &track = wmd.track(song_index, track_index);
     m_instrument_index = track.instrument;
     m_repeat = track.repeat;
     m_repeat_start = track.repeat_start;
+    prepare_notes();
+
+    // Limit the number of voices if required.
+    if (m_limiter == nullptr && opts.max_voices > 0)
+    {
+        m_own_limiter.reset(new channel_limiter(opts.max_voices));
+        m_limiter = m_own_limiter.get();
+    }
+
+    // Govern the quality for real time extraction if required.
+    if (m_governor == nullptr && opts.realtime)
+    {
+        m_own_governor.reset(new realtime_governor(m_sample_rate, m_sinc_window));
+        m_governor = m_own_governor.get();
+    }
 }
 
 
@@ -116,6 +135,18 @@ track_player::next(stereo_t &stereo)
                     m_channels[index]->release();
                 }
             }
+
+            // Likewise for notes held while fast forwarding. Pitch bends are
+            // only needed while notes are held.
+            if (m_fast_forward)
+            {
+                auto released = [&ev](const held_note &held) { return held.note == ev.data_0; };
+                m_held_notes.erase(std::remove_if(m_held_notes.begin(), m_held_notes.end(), released), m_held_notes.end());
+                if (m_held_notes.empty())
+                {
+                    m_held_bends.clear();
+                }
+            }
             break;
 
         case music_event_code::set_instrument:
@@ -133,10 +164,15 @@ track_player::next(stereo_t &stereo)
             // Calculate the new unit pitch bend.
             m_unit_pitch_bend = mono_t(ev.data_0) / 0x2000 / 12;
 
-            // Apply the pitch bend to every active channel.
+            // Apply the pitch bend to every active channel, and remember it for
+            // the notes held while fast forwarding.
             for (index = 0; index < m_channels.size(); ++index)
             {
-                m_channels[index]->frequency(m_wmd.note_to_frequency(m_instrument_index, m_channels[index]->user_data(), m_unit_pitch_bend));
+                m_channels[index]->frequency(note_frequency(uint8_t(m_channels[index]->user_data())));
+            }
+            if (m_fast_forward && !m_held_notes.empty())
+            {
+                m_held_bends.emplace_back(m_fast_forward_position, m_unit_pitch_bend);
             }
             break;
 
@@ -230,10 +266,123 @@ track_player::next(stereo_t &stereo)
         }
     }
     assert(live || !is_running());
+    if (m_own_governor != nullptr && live)
+    {
+        m_own_governor->measure(1);
+    }
     return live;
 }
 
 
+//
+// Get the number of upcoming samples known to be silent.
+//
+
+uint32_t
+track_player::silence_ahead(uint32_t limit) const
+{
+    if (!m_channels.empty() || !m_stream.is_running())
+    {
+        return 0;
+    }
+    return m_stream.ticks_until_event(limit);
+}
+
+
+//
+// Skip over samples of silence.
+//
+
+void
+track_player::skip_silence(uint32_t count)
+{
+    // With no channels playing and no events due, each sample only advances
+    // the music stream by one tick.
+    assert(count <= silence_ahead(count));
+    m_stream.skip_ticks(count);
+    if (m_own_governor != nullptr)
+    {
+        m_own_governor->measure(count);
+    }
+}
+
+
+//
+// Advance the music without generating any audio.
+//
+
+void
+track_player::fast_forward(uint64_t count, uint64_t replay_limit)
+{
+    // As no notes are played, the track is silent between events and can skip
+    // straight to each one in turn.
+    assert(m_channels.empty());
+    assert(m_held_notes.empty());
+    m_fast_forward = true;
+    m_fast_forward_position = 0;
+    stereo_t s;
+    while (m_fast_forward_position < count && is_running())
+    {
+        uint32_t silent = silence_ahead(uint32_t(std::min(count - m_fast_forward_position, uint64_t(UINT32_MAX))));
+        if (silent > 0)
+        {
+            skip_silence(silent);
+            m_fast_forward_position += silent;
+        }
+        else
+        {
+            next(s);
+            m_fast_forward_position++;
+        }
+    }
+    m_fast_forward = false;
+
+    // Rebuild the voices of the notes that are still held. Each is played from
+    // where it started, or from the replay limit before the end if that is
+    // later, to the end of the fast forward. The pitch bends made since are
+    // followed and the output is discarded. A note that finishes on its own on
+    // the way is dropped.
+    uint64_t replay_start = count > replay_limit ? count - replay_limit : 0;
+    mono_t unit_pitch_bend = m_unit_pitch_bend;
+    for (auto &held : m_held_notes)
+    {
+        uint64_t start = std::max(held.start, replay_start);
+        m_unit_pitch_bend = held.unit_pitch_bend;
+        auto bend = std::lower_bound(m_held_bends.cbegin(), m_held_bends.cend(), held.start, [](const std::pair<uint64_t, mono_t> &b, uint64_t position) { return b.first < position; });
+        if (start > held.start)
+        {
+            for (; bend != m_held_bends.cend() && bend->first <= start; ++bend)
+            {
+                m_unit_pitch_bend = bend->second;
+            }
+        }
+        size_t channels = m_channels.size();
+        start_note(held.note, held.volume);
+        if (m_channels.size() == channels)
+        {
+            continue;
+        }
+        channel &c = *m_channels.back();
+        for (uint64_t position = start; position < count; ++position)
+        {
+            for (; bend != m_held_bends.cend() && bend->first <= position; ++bend)
+            {
+                m_unit_pitch_bend = bend->second;
+                c.frequency(note_frequency(held.note));
+            }
+            if (!c.next(s))
+            {
+                m_channels.pop_back();
+                break;
+            }
+        }
+    }
+    m_unit_pitch_bend = unit_pitch_bend;
+    m_held_notes.clear();
+    m_held_bends.clear();
+}
+
+
 //
 // Create a new channel to play a note.
 //
@@ -241,33 +390,126 @@ track_player::next(stereo_t &stereo)
 void
 track_player::start_note(uint8_t note, uint8_t volume)
 {
-    // Get the sub-instrument.
+    // Get the details of the note. Missing sub-instruments and patches are
+    // only reported once a note tries to use them.
     assert(note <= 0x7f);
     assert(volume <= 0x7f);
-    const wmd_sub_instrument &sub_instrument = m_wmd.instrument(m_instrument_index).sub_instrument(note);
+    const note_details &details = m_notes[note];
+    if (details.sub_instrument == nullptr)
+    {
+        throw std::string("Missing a sub-instrument for note $") + hex_byte(note) + ".";
+    }
+    const wmd_sub_instrument &sub_instrument = *details.sub_instrument;
+    if (details.voice == nullptr)
+    {
+        throw std::string("Unable to locate patch with id ") + int_to_string(sub_instrument.patch) + " in any LCD file.";
+    }
 
-    // Combine the master track, sub-instrument and note volumes.
-    mono_t combined_volume = m_track_volume * mono_t(sub_instrument.volume) / 0x7f * mono_t(volume) / 0x7f;
+    // Notes aren't played while fast forwarding, but are remembered until they
+    // are released.
+    if (m_fast_forward)
+    {
+        m_held_notes.push_back(held_note{note, volume, m_unit_pitch_bend, m_fast_forward_position});
+        return;
+    }
 
-    // Find the patch.
-    const patch *patch = m_lcd.patch_by_id(sub_instrument.patch);
-    if (patch == nullptr)
+    // Find a channel to play the note if the number of voices is limited.
+    if (m_limiter != nullptr && !m_limiter->make_room(sub_instrument.priority))
     {
-        throw std::string("Unable to locate patch with id ") + int_to_string(sub_instrument.patch) + " in any LCD file.";
+        return;
     }
 
-    // Map the note to a frequency.
-    uint32_t frequency = m_wmd.note_to_frequency(m_instrument_index, note, m_unit_pitch_bend);
+    // Combine the master track, sub-instrument and note volumes.
+    mono_t combined_volume = m_track_volume * mono_t(sub_instrument.volume) / 0x7f * mono_t(volume) / 0x7f;
 
     // Start the note playing. Store the note number as the channel user data.
-    uint8_t pan = (uint8_t) clamp(int(sub_instrument.pan) + m_pan_offset, 0x00, 0x7f);
-    pan = adjust_stereo_effect(pan);
-    channel *c = new channel(patch, frequency, combined_volume, pan, sub_instrument.spu_ads, sub_instrument.spu_sr, m_sample_rate, m_sinc_window, m_limit_frequency, m_repair_patches);
+    uint8_t pan = m_stereo_pan[clamp(int(sub_instrument.pan) + m_pan_offset, 0x00, 0x7f)];
+    channel *c = new (&m_arena) channel(*details.voice, note_frequency(note), combined_volume, pan, m_cull_threshold, m_sample_rate, m_governor != nullptr ? m_governor->sinc_window() : m_sinc_window, m_limit_frequency, &m_arena);
     c->user_data(note);
+    if (m_limiter != nullptr)
+    {
+        m_limiter->attach(c, sub_instrument.priority);
+    }
     m_channels.push_back(std::unique_ptr<channel>(c));
 }
 
 
+//
+// Resolve the details for every note.
+//
+
+void
+track_player::prepare_notes()
+{
+    // Create a voice for each sub-instrument with a patch. The voices are
+    // reserved up front so that pointers to them remain valid.
+    const wmd_instrument &instrument = m_wmd.instrument(m_instrument_index);
+    std::vector<const channel::voice *> sub_voices;
+    m_voices.reserve(instrument.sub_instruments.size());
+    for (auto &sub : instrument.sub_instruments)
+    {
+        const patch *patch = m_lcd.patch_by_id(sub.patch);
+        if (patch != nullptr)
+        {
+            m_voices.emplace_back(patch, sub.spu_ads, sub.spu_sr, m_repair_patches);
+            sub_voices.push_back(&m_voices.back());
+        }
+        else
+        {
+            sub_voices.push_back(nullptr);
+        }
+    }
+
+    // Map each note to the first sub-instrument covering it.
+    for (size_t note = 0; note < numberof(m_notes); ++note)
+    {
+        note_details &details = m_notes[note];
+        details.sub_instrument = nullptr;
+        details.voice = nullptr;
+        details.pitch = 0.0;
+        details.frequency = 0;
+        for (size_t sub_index = 0; sub_index < instrument.sub_instruments.size(); ++sub_index)
+        {
+            const wmd_sub_instrument &sub = instrument.sub_instruments[sub_index];
+            if (note >= sub.first_note && note <= sub.last_note)
+            {
+                assert(sub.bend_sensitivity_down == sub.bend_sensitivity_up);
+                details.sub_instrument = &sub;
+                details.voice = sub_voices[sub_index];
+                details.pitch = wmd_file::note_to_pitch(sub, uint8_t(note));
+                details.frequency = wmd_file::pitch_to_frequency(details.pitch);
+                break;
+            }
+        }
+    }
+
+    // Apply the stereo width expansion to every possible pan.
+    for (size_t pan = 0; pan < numberof(m_stereo_pan); ++pan)
+    {
+        m_stereo_pan[pan] = adjust_stereo_effect(uint8_t(pan));
+    }
+}
+
+
+//
+// Get the frequency of a note.
+//
+
+uint32_t
+track_player::note_frequency(uint8_t note) const
+{
+    // Notes are only bent when there is a pitch bend in effect.
+    assert(note < numberof(m_notes));
+    const note_details &details = m_notes[note];
+    assert(details.sub_instrument != nullptr);
+    if (m_unit_pitch_bend == 0.0)
+    {
+        return details.frequency;
+    }
+    return wmd_file::pitch_to_frequency(details.pitch + details.sub_instrument->bend_sensitivity_down * m_unit_pitch_bend);
+}
+
+
 //
 // Adjust a pan value to account for stereo width expansion.
 //
@@ -24,6 +24,7 @@
 #include "module.h"
 #include "music_stream.h"
 #include "options.h"
+#include "statistics.h"
 
 
 namespace psxdmh
@@ -33,6 +34,7 @@ namespace psxdmh
 // Forwards.
 class lcd_file;
 class wmd_file;
+struct wmd_sub_instrument;
 
 
 // Playback manager for a single track.
@@ -41,8 +43,11 @@ class track_player : public module_stereo
 public:
 
     // Construction. The caller must ensure that the WMD file and LCD set remain
-    // valid for the life of this object.
-    track_player(size_t song_index, size_t track_index, const wmd_file &wmd, const lcd_file &lcd, const options &opts);
+    // valid for the life of this object. When the options limit the number of
+    // voices or ask for real time extraction, the limiter and governor are
+    // shared with the other tracks of the song. If they aren't given the track
+    // creates its own.
+    track_player(size_t song_index, size_t track_index, const wmd_file &wmd, const lcd_file &lcd, const options &opts, channel_limiter *limiter = nullptr, realtime_governor *governor = nullptr);
 
     // Test whether the track playback is still running. This includes any
     // channels which haven't finished playing a note yet, even if all music
@@ -53,28 +58,83 @@ public:
     // together all currently playing notes for this track.
     virtual bool next(stereo_t &stereo);
 
+    // Get the number of upcoming samples known to be silent. The track is
+    // silent while no channels are playing until the next event is due.
+    virtual uint32_t silence_ahead(uint32_t limit) const;
+
+    // Skip over samples of silence.
+    virtual void skip_silence(uint32_t count);
+
+    // Advance the music by a number of samples without generating any audio.
+    // Events are processed as usual, but notes are not played while fast
+    // forwarding. The voices of notes that are still held at the end are
+    // rebuilt by playing them with the output discarded, so that they carry on
+    // as if they had been played all along. To bound the cost, a note is only
+    // played for at most replay_limit samples: one held for longer starts that
+    // far before the end instead, so its envelope has had time to settle but a
+    // looping patch may be at a different point in its loop. This may only be
+    // used before any audio has been generated.
+    void fast_forward(uint64_t count, uint64_t replay_limit);
+
     // Check if the track failed to repeat when a repeat was requested.
     bool failed_to_repeat() const { return m_play_count > 1; }
 
+    // Governor for real time extraction, or nullptr if not in use.
+    const realtime_governor *governor() const { return m_governor; }
+
 private:
 
     // Create a new channel to play a note. Valid notes are 0x00 to 0x7f, and
     // valid volumes are 0x00 to 0x7f.
     void start_note(uint8_t note, uint8_t volume);
 
+    // Resolve the voice, tuning, and pan details for every note the track's
+    // instrument can play.
+    void prepare_notes();
+
+    // Get the frequency of a note, taking into account the current pitch bend.
+    uint32_t note_frequency(uint8_t note) const;
+
     // Adjust a pan value to account for stereo width expansion.
     uint8_t adjust_stereo_effect(uint8_t pan) const;
 
+    // Details of a note started while fast forwarding that has yet to be
+    // released: the note, its volume, the pitch bend in effect when it
+    // started, and the position of its start.
+    struct held_note
+    {
+        uint8_t note;
+        uint8_t volume;
+        mono_t unit_pitch_bend;
+        uint64_t start;
+    };
+
+    // Details of a note resolved when the track is loaded.
+    struct note_details
+    {
+        // Sub-instrument playing the note, or nullptr if the instrument has no
+        // sub-instrument for the note.
+        const wmd_sub_instrument *sub_instrument;
+
+        // Voice for the sub-instrument, or nullptr if its patch is missing.
+        const channel::voice *voice;
+
+        // Pitch of the note before any pitch bending, and the frequency of the
+        // note when there is no pitch bend.
+        double pitch;
+        uint32_t frequency;
+    };
+
     // WMD file supplying music data.
     const wmd_file &m_wmd;
 
     // LCD file supplying patches.
     const lcd_file &m_lcd;
 
-    // Output sample rate.
+    // Rate at which the track is rendered.
     const uint32_t m_sample_rate;
 
-    // Resampling configuration.
+    // Resampling configuration. A window of 0 selects linear interpolation.
     const uint32_t m_sinc_window;
 
     // Whether to enforce the maximum playback frequency limit of a real PSX.
@@ -83,6 +143,21 @@ private:
     // Whether to repair patches.
     const bool m_repair_patches;
 
+    // Level below which released channels are culled, or 0 to never cull.
+    // Culling is disabled when normalizing as the final gain isn't known.
+    const mono_t m_cull_threshold;
+
+    // Set while fast forwarding, when notes are not played, and the number of
+    // samples fast forwarded so far.
+    bool m_fast_forward;
+    uint64_t m_fast_forward_position;
+
+    // Notes started while fast forwarding that have yet to be released, in the
+    // order they were started, and the position and new unit pitch bend of
+    // each pitch bend made while any of them were held.
+    std::vector<held_note> m_held_notes;
+    std::vector<std::pair<uint64_t, mono_t>> m_held_bends;
+
     // Number of remaining times to play the track. A value of 0 means repeat
     // indefinitely, while other values play exactly that many times.
     uint32_t m_play_count;
@@ -110,6 +185,31 @@ private:
     // Current pitch bend at a sensitivity of 1.
     mono_t m_unit_pitch_bend;
 
+    // Voices for each of the instrument's sub-instruments that have a patch.
+    std::vector<channel::voice> m_voices;
+
+    // Details for each note, indexed by note number.
+    note_details m_notes[0x80];
+
+    // Pan values adjusted for stereo width expansion, indexed by pan.
+    uint8_t m_stereo_pan[0x80];
+
+    // Limiter for the number of voices playing at once, and the limiter owned
+    // by this track if it wasn't given one. Either may be nullptr. These must
+    // be declared before the channels so that they outlive them.
+    channel_limiter *m_limiter;
+    std::unique_ptr<channel_limiter> m_own_limiter;
+
+    // Governor for real time extraction, and the governor owned by this track
+    // if it wasn't given one. Either may be nullptr. Only the owner of the
+    // governor reports the samples generated to it.
+    realtime_governor *m_governor;
+    std::unique_ptr<realtime_governor> m_own_governor;
+
+    // Arena supplying the memory for channels. This must be declared before
+    // the channels so that it outlives them.
+    arena m_arena;
+
     // Active channels.
     std::vector<std::unique_ptr<channel>> m_channels;
 };
@@ -282,6 +282,90 @@ time_now()
 }
 
 
+// Time the current thread has spent waiting for its output to be consumed.
+static thread_local double g_output_wait_time = 0.0;
+
+
+//
+// Retrieve the time the calling thread has spent waiting for its output to be
+// consumed.
+//
+
+double
+output_wait_time()
+{
+    return g_output_wait_time;
+}
+
+
+//
+// Record time the calling thread has spent waiting for its output to be
+// consumed.
+//
+
+void
+add_output_wait_time(double seconds)
+{
+    g_output_wait_time += seconds;
+}
+
+
+// Flag set when an interrupt is requested.
+static std::atomic<bool> g_interrupted(false);
+
+
+//
+// Request that the current operation be interrupted.
+//
+
+void
+request_interrupt()
+{
+    g_interrupted.store(true, std::memory_order_relaxed);
+}
+
+
+//
+// Throw if an interrupt has been requested.
+//
+
+void
+check_interrupt()
+{
+    if (g_interrupted.load(std::memory_order_relaxed))
+    {
+        throw std::string("Aborted.");
+    }
+}
+
+
+//
+// Constructor.
+//
+
+sigint_blocker::sigint_blocker()
+{
+#if defined(PSXDMH_TARGET_MACOS)
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &m_previous);
+#endif // PSXDMH_TARGET_MACOS
+}
+
+
+//
+// Destructor.
+//
+
+sigint_blocker::~sigint_blocker()
+{
+#if defined(PSXDMH_TARGET_MACOS)
+    pthread_sigmask(SIG_SETMASK, &m_previous, nullptr);
+#endif // PSXDMH_TARGET_MACOS
+}
+
+
 //  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 
@@ -324,6 +408,90 @@ type_of_file(std::string file)
 }
 
 
+//
+// Get the size and modification time of a file or directory.
+//
+
+bool
+file_stamp(std::string file, uint64_t &size, int64_t &modified)
+{
+#if defined(PSXDMH_TARGET_WINDOWS)
+    struct _stat64 st;
+    if (_stat64(file.c_str(), &st) != 0)
+#else // Target.
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0)
+#endif // Target.
+    {
+        size = 0;
+        modified = 0;
+        return false;
+    }
+    size = uint64_t(st.st_size);
+    modified = int64_t(st.st_mtime);
+    return true;
+}
+
+
+//
+// Directory for temporary files.
+//
+
+std::string
+temp_directory()
+{
+#if defined(PSXDMH_TARGET_WINDOWS)
+    char path[MAX_PATH + 1];
+    DWORD length = GetTempPathA(sizeof(path), path);
+    return length > 0 && length < sizeof(path) ? std::string(path, length) : std::string(".");
+#else // Target.
+    const char *path = getenv("TMPDIR");
+    return path != nullptr && *path != '\0' ? std::string(path) : std::string("/tmp");
+#endif // Target.
+}
+
+
+//
+// Create a new, empty file with a unique name.
+//
+
+std::string
+create_temp_file(std::string prefix)
+{
+    std::vector<char> name(prefix.begin(), prefix.end());
+    name.insert(name.end(), { 'X', 'X', 'X', 'X', 'X', 'X', '\0' });
+#if defined(PSXDMH_TARGET_WINDOWS)
+    int fd = _mktemp_s(name.data(), name.size()) == 0 ? _open(name.data(), _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, _S_IREAD | _S_IWRITE) : -1;
+    if (fd < 0 || _close(fd) != 0)
+#else // Target.
+    int fd = mkstemp(name.data());
+    if (fd < 0 || close(fd) != 0)
+#endif // Target.
+    {
+        throw std::string("Unable to create a temporary file for '") + prefix + "'.";
+    }
+    return std::string(name.data());
+}
+
+
+//
+// Rename a file, replacing any existing file.
+//
+
+void
+replace_file(std::string old_name, std::string new_name)
+{
+#if defined(PSXDMH_TARGET_WINDOWS)
+    if (!MoveFileExA(old_name.c_str(), new_name.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else // Target.
+    if (rename(old_name.c_str(), new_name.c_str()) != 0)
+#endif // Target.
+    {
+        throw std::string("Unable to rename '") + old_name + "' to '" + new_name + "'.";
+    }
+}
+
+
 //
 // Test if a file is interactive (a terminal).
 //
@@ -339,4 +507,15 @@ is_interactive(FILE *file)
 }
 
 
+//
+// Test if a file name refers to standard output.
+//
+
+bool
+is_standard_output(std::string file)
+{
+    return file == "-";
+}
+
+
 }; //namespace psxdmh
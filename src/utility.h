@@ -101,6 +101,46 @@ extern std::string word_wrap(std::string text, size_t indent, size_t width);
 // this is only of use for determining relative time.
 double time_now();
 
+// Time the calling thread has spent blocked waiting for the audio it produced
+// to be consumed, in seconds. Anything that makes a producer wait for its
+// consumer records the time here, so that the producer's own speed can be
+// measured without it.
+double output_wait_time();
+void add_output_wait_time(double seconds);
+
+// Interruption of a long running operation, such as by Ctrl-C. Requesting an
+// interrupt only sets a lock-free flag, so it may be done from a signal
+// handler on any thread. Loops doing lengthy work call check_interrupt, which
+// throws once an interrupt has been requested.
+void request_interrupt();
+void check_interrupt();
+
+
+// Blocks SIGINT on the calling thread for the lifetime of the object. Threads
+// started meanwhile inherit the blocked signal.
+class sigint_blocker : public uncopyable
+{
+public:
+    sigint_blocker();
+    ~sigint_blocker();
+
+private:
+#if defined(PSXDMH_TARGET_MACOS)
+    // Signal mask to restore.
+    sigset_t m_previous;
+#endif // PSXDMH_TARGET_MACOS
+};
+
+
+// Start a worker thread. SIGINT is blocked on the thread so that Ctrl-C is
+// always handled by the main thread.
+template<typename... Args>
+std::thread start_worker(Args &&...args)
+{
+    sigint_blocker blocker;
+    return std::thread(std::forward<Args>(args)...);
+}
+
 
 //  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
@@ -121,10 +161,33 @@ extern std::string combine_paths(std::string path, std::string file);
 extern file_type type_of_file(std::string file);
 
 
+// Get the size and modification time (in seconds) of a file or directory.
+// Returns false if it doesn't exist.
+extern bool file_stamp(std::string file, uint64_t &size, int64_t &modified);
+
+
+// Directory for temporary files.
+extern std::string temp_directory();
+
+
+// Create a new, empty file with a unique name made by appending characters to
+// the given prefix, and return the name. Throws if the file can't be created.
+extern std::string create_temp_file(std::string prefix);
+
+
+// Rename a file, replacing any existing file of the new name. Throws on
+// failure.
+extern void replace_file(std::string old_name, std::string new_name);
+
+
 // Test if a file is interactive (a terminal).
 extern bool is_interactive(FILE *file);
 
 
+// Test if a file name refers to standard output, given as "-".
+extern bool is_standard_output(std::string file);
+
+
 }; //namespace psxdmh
 
 
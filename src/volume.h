@@ -41,7 +41,7 @@ public:
     }
 
     // Test whether the module is still generating output.
-    virtual bool is_running() const { return this->source()->is_running(); }
+    virtual bool is_running() const { return this->source_running(); }
 
     // Get the next sample.
     virtual bool next(S &s)
@@ -51,6 +51,10 @@ public:
         return live;
     }
 
+    // Silence passes through unchanged.
+    virtual uint32_t silence_ahead(uint32_t limit) const { return this->source()->silence_ahead(limit); }
+    virtual void skip_silence(uint32_t count) { this->source()->skip_silence(count); }
+
 private:
 
     // Volume scaling.
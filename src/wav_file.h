@@ -20,7 +20,9 @@
 #define PSXDMH_SRC_WAV_FILE_H
 
 
+#include "async_writer.h"
 #include "endian.h"
+#include "mapped_file.h"
 #include "module.h"
 #include "safe_file.h"
 #include "sample.h"
@@ -30,7 +32,17 @@ namespace psxdmh
 {
 
 
-// WAV file writer. All errors are reported by a thrown std::string.
+// WAV file writer. Files reserve space for a ds64 chunk in a JUNK chunk, and
+// are converted to RF64 when closed if the data has grown past 4 GB, so they
+// are written in one pass whatever their length. Standard output, given as
+// "-", can't be patched when closed, so the WAV header written there uses the
+// streaming convention of setting the RIFF and data lengths to 0xffffffff.
+// Alternatively raw samples can be written there without a header.
+//
+// Samples are normally written as 16-bit PCM. A file can instead be written
+// with unclipped 32-bit float samples and then rescaled, which converts it to
+// 16-bit PCM in place through a writable mapping. All errors are reported by a
+// thrown std::string.
 template <typename S> class wav_file : public uncopyable
 {
 public:
@@ -38,9 +50,8 @@ public:
     // Construction.
     wav_file() :
         m_file(nullptr),
-        m_riff_length_offset(0), m_data_length_offset(0),
-        m_samples(0),
-        m_max_samples((0xffffffffUL - m_header_size) / (sizeof(uint16_t) * (is_stereo() ? 2 : 1)))
+        m_sample_rate(0), m_float_samples(false), m_unscaled(false),
+        m_samples(0)
     {
     }
 
@@ -58,52 +69,84 @@ public:
         }
     }
 
-    // Write the WAV file from source. The return value gives the number of
-    // samples written.
-    uint32_t write(module<S> *source, std::string file_name, uint32_t sample_rate)
+    // Write the WAV file from source. If raw is set and the file is standard
+    // output, only the samples are written. If float_samples is set the file
+    // holds 32-bit float samples until rescale is called, which can't be done
+    // for standard output. The return value gives the number of samples
+    // written.
+    uint32_t write(module<S> *source, std::string file_name, uint32_t sample_rate, bool raw = false, bool float_samples = false)
     {
         // Open the file.
         assert(source != nullptr);
         assert(sample_rate > 0);
         assert(m_file == nullptr);
-        open(file_name, sample_rate);
+        assert(!float_samples || !is_standard_output(file_name));
+        m_sample_rate = sample_rate;
+        m_float_samples = float_samples;
+        m_unscaled = float_samples;
+        open(file_name, raw);
+
+        // Extract and write all the source samples.
+        if (float_samples)
+        {
+            write_samples<uint32_t>(source);
+        }
+        else
+        {
+            write_samples<int16_t>(source);
+        }
 
-        // Extract and write all the source samples. Collect the samples in
-        // batches to avoid excessive write calls to the file.
-        const size_t buffer_samples = 4096;
-        std::vector<int16_t> sample_buffer;
-        S s;
-        do
+        // Close the file. This patches the header to match the data written.
+        close();
+        return uint32_t(m_samples);
+    }
+
+    // Scale the float samples of a file that has been written by gain and
+    // convert them to 16-bit PCM, clipping as usual. Each converted sample is
+    // half the size of the original, so the conversion works forwards through
+    // the file without overwriting data it has yet to read, and the file is
+    // then truncated.
+    void rescale(mono_t gain)
+    {
+        assert(m_file == nullptr && m_unscaled);
+        size_t data_offset = header(0).size();
+        size_t values = size_t(m_samples) * channels();
         {
-            // Write a set of samples.
-            sample_buffer.clear();
-            while (sample_buffer.size() < buffer_samples && source->next(s))
+            mapped_file file(m_file_name, true);
+            if (file.size() != data_offset + values * sizeof(float))
             {
-                buffer_sample(sample_buffer, s);
-                if (++m_samples > m_max_samples)
-                {
-                    throw std::string("Maximum WAV file size exceeded.");
-                }
+                throw std::string("Failed reading from '") + m_file_name + "'.";
             }
-            if (!sample_buffer.empty())
+            uint8_t *data = file.writable_data() + data_offset;
+            for (size_t index = 0; index < values; ++index)
             {
-                m_file->write(sample_buffer.data(), sample_buffer.size() * sizeof(int16_t));
+                if ((index & 0xfffff) == 0)
+                {
+                    check_interrupt();
+                }
+                uint32_t bits;
+                memcpy(&bits, data + index * sizeof(float), sizeof(bits));
+                bits = uint32_as_le(bits);
+                float value;
+                memcpy(&value, &bits, sizeof(value));
+                int16_t pcm = int16_as_le(sample_to_int(mono_t(value * gain)));
+                memcpy(data + index * sizeof(int16_t), &pcm, sizeof(pcm));
             }
+            m_float_samples = false;
+            std::vector<uint8_t> pcm_header = header(m_samples);
+            memcpy(file.writable_data(), pcm_header.data(), pcm_header.size());
+            file.truncate(data_offset + values * sizeof(int16_t));
         }
-        while (!sample_buffer.empty());
-
-        // Close the file. This patches the header to match the data written.
-        close();
-        return m_samples;
+        m_unscaled = false;
     }
 
-    // Check if the file is open.
-    bool is_file_open() const { return m_file != nullptr; }
+    // Check if the file is open, or has yet to be rescaled.
+    bool is_file_open() const { return m_file != nullptr || m_unscaled; }
 
     // Abort the writing of the WAV file.
     void abort()
     {
-        if (m_file != nullptr)
+        if (m_file != nullptr || m_unscaled)
         {
             // Ignore any exceptions.
             try
@@ -113,66 +156,161 @@ public:
             catch (...)
             {
             }
+            m_unscaled = false;
 
-            // Remove the file.
-            remove(m_file_name.c_str());
+            // Remove the file. Standard output is left alone.
+            if (!is_standard_output(m_file_name))
+            {
+                remove(m_file_name.c_str());
+            }
         }
     }
 
 private:
 
-    // Open the file.
-    void open(std::string file_name, uint32_t sample_rate)
+    // Extract and write all the source samples, with T as the type of the
+    // stored sample values. Collect the samples in batches, which are written
+    // to the file in the background while the next are generated.
+    template <typename T> void write_samples(module<S> *source)
+    {
+        async_writer writer(*m_file);
+        const size_t buffer_samples = 4096;
+        std::vector<T> sample_buffer;
+        S s;
+        do
+        {
+            // Write a set of samples.
+            check_interrupt();
+            sample_buffer.clear();
+            size_t samples = 0;
+            while (samples < buffer_samples)
+            {
+                // Silence known ahead of time is written without being
+                // generated.
+                uint32_t silent = source->silence_ahead(uint32_t(buffer_samples - samples));
+                if (silent > 0)
+                {
+                    source->skip_silence(silent);
+                    sample_buffer.resize(sample_buffer.size() + silent * channels(), 0);
+                }
+                else if (source->next(s))
+                {
+                    buffer_sample(sample_buffer, s);
+                    silent = 1;
+                }
+                else
+                {
+                    break;
+                }
+                samples += silent;
+                m_samples += silent;
+                if (m_samples > m_max_samples)
+                {
+                    throw std::string("Maximum WAV file length exceeded.");
+                }
+            }
+            if (!sample_buffer.empty())
+            {
+                writer.write(sample_buffer.data(), sample_buffer.size() * sizeof(T));
+            }
+        }
+        while (!sample_buffer.empty());
+        writer.flush();
+    }
+
+    // Open the file and write a provisional header.
+    void open(std::string file_name, bool raw)
     {
-        // Open the file.
         assert(m_file == nullptr);
         m_file_name = file_name;
         m_file.reset(new safe_file(m_file_name.c_str(), file_mode::write));
-
-        // Write the file header. First the RIFF chunk. The size field needs to
-        // be patched later.
-        m_file->write("RIFF", 4);
-        m_riff_length_offset = m_file->tell();
-        m_file->write_32_le(0);
-
-        // Write the WAVE chunk: PCM, mono/stereo, sample rate, 16 bits/sample.
-        m_file->write("WAVEfmt ", 8);
-        m_file->write_32_le(16);
-        m_file->write_16_le(1);
-        m_file->write_16_le(is_stereo() ? 2 : 1);
-        m_file->write_32_le(sample_rate);
-        size_t channels = is_stereo() ? 2 : 1;
-        m_file->write_32_le(uint32_t(sizeof(uint16_t) * sample_rate * channels));
-        m_file->write_16_le(uint16_t(sizeof(uint16_t) * channels));
-        m_file->write_16_le(16);
-
-        // Write the data chunk header. The size field needs to be patched
-        // later.
-        m_file->write("data", 4);
-        m_data_length_offset = m_file->tell();
-        m_file->write_32_le(0);
+        if (!m_file->is_stream() || !raw)
+        {
+            std::vector<uint8_t> provisional = header(0);
+            m_file->write(provisional.data(), provisional.size());
+        }
     }
 
     // Close the file and patch the header.
     void close()
     {
-        // Patch the file and data lengths.
         if (m_file != nullptr)
         {
-            m_file->seek(m_riff_length_offset);
-            size_t sample_bytes = m_samples * sizeof(int16_t) * (is_stereo() ? 2 : 1);
-            m_file->write_32_le(m_wave_chunk_size + m_data_chunk_size + uint32_t(sample_bytes));
-            m_file->seek(m_data_length_offset);
-            m_file->write_32_le(uint32_t(sample_bytes));
+            if (!m_file->is_stream())
+            {
+                std::vector<uint8_t> complete = header(m_samples);
+                m_file->seek(0);
+                m_file->write(complete.data(), complete.size());
+            }
+            m_file->close();
             m_file.reset();
         }
     }
 
-    // Whether the audio is mono or stereo.
-    bool is_stereo() const
+    // Build the header for a file holding a number of samples. The header is
+    // always the same size, so it can be written provisionally when the file
+    // is opened and replaced when it is closed.
+    std::vector<uint8_t> header(uint64_t samples) const
+    {
+        std::vector<uint8_t> bytes;
+        auto put = [&bytes](const char *id) { bytes.insert(bytes.end(), id, id + 4); };
+        auto put_16 = [&bytes](uint16_t value) { bytes.push_back(uint8_t(value)); bytes.push_back(uint8_t(value >> 8)); };
+        auto put_32 = [&put_16](uint32_t value) { put_16(uint16_t(value)); put_16(uint16_t(value >> 16)); };
+        auto put_64 = [&put_32](uint64_t value) { put_32(uint32_t(value)); put_32(uint32_t(value >> 32)); };
+
+        // Work out the lengths. Files too large for the 32-bit lengths are
+        // RF64: the JUNK chunk becomes the ds64 chunk holding the 64-bit
+        // lengths, and the 32-bit lengths are set to 0xffffffff. Standard
+        // output has no JUNK chunk, and the lengths are unknown.
+        bool stream = m_file != nullptr && m_file->is_stream();
+        uint32_t value_size = m_float_samples ? sizeof(float) : sizeof(int16_t);
+        uint64_t sample_bytes = samples * value_size * channels();
+        uint64_t riff_bytes = 4 + (stream ? 0 : 8 + m_ds64_size) + 8 + 16 + 8 + sample_bytes;
+        bool rf64 = !stream && riff_bytes > 0xffffffff;
+
+        // The RIFF chunk, and the JUNK chunk reserving space for the ds64
+        // chunk of an RF64 file.
+        put(rf64 ? "RF64" : "RIFF");
+        put_32(stream || rf64 ? 0xffffffff : uint32_t(riff_bytes));
+        put("WAVE");
+        if (rf64)
+        {
+            put("ds64");
+            put_32(m_ds64_size);
+            put_64(riff_bytes);
+            put_64(sample_bytes);
+            put_64(samples);
+            put_32(0);
+        }
+        else if (!stream)
+        {
+            put("JUNK");
+            put_32(m_ds64_size);
+            bytes.resize(bytes.size() + m_ds64_size, 0);
+        }
+
+        // The format chunk: PCM or float, mono/stereo, sample rate, and bits
+        // per sample.
+        put("fmt ");
+        put_32(16);
+        put_16(m_float_samples ? 3 : 1);
+        put_16(uint16_t(channels()));
+        put_32(m_sample_rate);
+        put_32(m_sample_rate * value_size * channels());
+        put_16(uint16_t(value_size * channels()));
+        put_16(uint16_t(value_size * 8));
+
+        // The data chunk header.
+        put("data");
+        put_32(stream || rf64 ? 0xffffffff : uint32_t(sample_bytes));
+        return bytes;
+    }
+
+    // Number of channels.
+    static unsigned channels()
     {
         assert(sizeof(S) == sizeof(mono_t) || sizeof(S) == sizeof(stereo_t));
-        return sizeof(S) == sizeof(stereo_t);
+        return sizeof(S) == sizeof(stereo_t) ? 2 : 1;
     }
 
     static void buffer_sample(std::vector<int16_t> &buffer, mono_t s)
@@ -186,33 +324,57 @@ private:
         buffer.push_back(int16_as_le(sample_to_int(s.right)));
     }
 
+    static void buffer_sample(std::vector<uint32_t> &buffer, mono_t s)
+    {
+        buffer.push_back(float_as_le(s));
+    }
+
+    static void buffer_sample(std::vector<uint32_t> &buffer, stereo_t s)
+    {
+        buffer.push_back(float_as_le(s.left));
+        buffer.push_back(float_as_le(s.right));
+    }
+
+    // Bits of a float sample in little-endian byte order.
+    static uint32_t float_as_le(float s)
+    {
+        uint32_t bits;
+        memcpy(&bits, &s, sizeof(bits));
+        return uint32_as_le(bits);
+    }
+
     // Name of the file.
     std::string m_file_name;
 
     // File wrapper.
     std::unique_ptr<safe_file> m_file;
 
-    // Offsets to length fields in the file.
-    size_t m_riff_length_offset;
-    size_t m_data_length_offset;
+    // Sample rate of the file.
+    uint32_t m_sample_rate;
+
+    // Whether the file holds float samples, and whether they have yet to be
+    // rescaled.
+    bool m_float_samples;
+    bool m_unscaled;
 
     // Number of samples written to the file.
-    uint32_t m_samples;
+    uint64_t m_samples;
 
-    // Number of bytes in the WAV file header, RIFF chunk, and WAVE chunk.
-    static const uint32_t m_header_size;
-    static const uint32_t m_wave_chunk_size;
-    static const uint32_t m_data_chunk_size;
+    // Number of bytes in the body of the ds64 chunk: the RIFF, data, and sample
+    // counts, and an empty table of other chunk sizes.
+    static const uint32_t m_ds64_size;
 
-    // Maximum number of samples allowed (maximum size of a WAV file is 4 GB).
-    const uint32_t m_max_samples;
+    // Maximum number of samples allowed. Files have no limit on their size, but
+    // the number of samples is reported as a 32-bit value.
+    static const uint64_t m_max_samples;
 };
 
 
-// Number of bytes in the WAV file header.
-template <typename S> const uint32_t wav_file<S>::m_header_size = 44;
-template <typename S> const uint32_t wav_file<S>::m_wave_chunk_size = 28;
-template <typename S> const uint32_t wav_file<S>::m_data_chunk_size = 8;
+// Number of bytes in the body of the ds64 chunk.
+template <typename S> const uint32_t wav_file<S>::m_ds64_size = 28;
+
+// Maximum number of samples allowed.
+template <typename S> const uint64_t wav_file<S>::m_max_samples = 0xffffffff;
 
 
 // Types for mono and stereo WAV file writers.
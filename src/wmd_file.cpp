@@ -20,6 +20,7 @@
 
 #include "channel.h"
 #include "envelope.h"
+#include "mapped_file.h"
 #include "music_stream.h"
 #include "safe_file.h"
 #include "utility.h"
@@ -71,6 +72,33 @@ wmd_file::track(size_t song_index, size_t track_index) const
 }
 
 
+//
+// Mark the IDs of the patches used by the instruments in a song.
+//
+
+void
+wmd_file::song_patches(size_t song_index, std::vector<bool> &patches) const
+{
+    // Tracks with an invalid instrument are skipped: the error is reported when
+    // the track is played.
+    assert(song_index < m_songs.size());
+    for (auto &track : m_songs[song_index].tracks)
+    {
+        if (track.instrument < m_instruments.size())
+        {
+            for (auto &sub : m_instruments[track.instrument].sub_instruments)
+            {
+                if (sub.patch >= patches.size())
+                {
+                    patches.resize(size_t(sub.patch) + 1, false);
+                }
+                patches[sub.patch] = true;
+            }
+        }
+    }
+}
+
+
 //
 // Convert a raw note value to a frequency, taking into account tuning and pitch
 // bending.
@@ -82,11 +110,30 @@ wmd_file::note_to_frequency(size_t instrument_index, uint8_t note, mono_t unit_p
     // Adjust the note for the tuning and pitch bend.
     const wmd_sub_instrument &sub_instrument = instrument(instrument_index).sub_instrument(note);
     assert(sub_instrument.bend_sensitivity_down == sub_instrument.bend_sensitivity_up);
+    return pitch_to_frequency(note_to_pitch(sub_instrument, note) + sub_instrument.bend_sensitivity_down * unit_pitch_bend);
+}
+
+
+//
+// Convert a raw note value to a pitch.
+//
+
+double
+wmd_file::note_to_pitch(const wmd_sub_instrument &sub_instrument, uint8_t note)
+{
     double tuning = sub_instrument.tuning + double(sub_instrument.fine_tuning) / 256;
-    double adjusted_note = (note - tuning) / 12.0 + sub_instrument.bend_sensitivity_down * unit_pitch_bend;
+    return (note - tuning) / 12.0;
+}
+
 
-    // Map the note to a frequency.
-    return (uint32_t) std::max(1, int32_t(44100.0 * pow(2.0, adjusted_note) + 0.5));
+//
+// Convert a pitch to a frequency.
+//
+
+uint32_t
+wmd_file::pitch_to_frequency(double pitch)
+{
+    return (uint32_t) std::max(1, int32_t(44100.0 * pow(2.0, pitch) + 0.5));
 }
 
 
@@ -97,10 +144,22 @@ wmd_file::note_to_frequency(size_t instrument_index, uint8_t note, mono_t unit_p
 void
 wmd_file::parse(std::string file_name)
 {
-    // The file must start with the signature "SPSX" and a version of 1.
+    auto mapped = std::make_shared<const mapped_file>(file_name);
+    parse(data_span(mapped, 0, mapped->size()), file_name);
+}
+
+
+//
+// Load from data in memory.
+//
+
+void
+wmd_file::parse(const data_span &data, std::string name)
+{
+    // The data must start with the signature "SPSX" and a version of 1.
     m_songs.clear();
     m_instruments.clear();
-    safe_file file(file_name, file_mode::read);
+    data_reader file(data, name);
     if (file.read_32_le() != PSXDMH_SPSX_SIGNATURE)
     {
         throw std::string("Not a WMD file (bad signature).");
@@ -218,9 +277,8 @@ wmd_file::parse(std::string file_name)
             uint32_t data_length = file.read_32_le();
             track.repeat_start = track.repeat ? file.read_32_le() : 0;
 
-            // Store a pointer to the music data and skip over it.
-            track.data.resize(data_length);
-            file.read(track.data.data(), data_length);
+            // Refer to the music data in place and skip over it.
+            track.data = file.read_span(data_length);
         }
     }
 }
@@ -232,6 +290,19 @@ wmd_file::parse(std::string file_name)
 
 void
 wmd_file::write(std::string file_name) const
+{
+    safe_file wmd_file(file_name.c_str(), file_mode::write);
+    write(wmd_file);
+    wmd_file.close();
+}
+
+
+//
+// Store the contents of this object at the current position in a file.
+//
+
+void
+wmd_file::write(safe_file &wmd_file) const
 {
     // Count the number of sub-instruments.
     assert(!is_empty());
@@ -243,7 +314,6 @@ wmd_file::write(std::string file_name) const
     }
 
     // Write the file.
-    safe_file wmd_file(file_name.c_str(), file_mode::write);
     wmd_file.write_32_le(PSXDMH_SPSX_SIGNATURE);
     wmd_file.write_32_le(PSXDMH_SPSX_VERSION);
     wmd_file.write_16_le((uint16_t) songs());
@@ -302,7 +372,6 @@ wmd_file::write(std::string file_name) const
             wmd_file.write(track_iter->data.data(), track_iter->data.size());
         }
     }
-    wmd_file.close();
 }
 
 
@@ -20,6 +20,7 @@
 #define PSXDMH_SRC_WMD_FILE_H
 
 
+#include "mapped_file.h"
 #include "sample.h"
 
 
@@ -28,6 +29,7 @@ namespace psxdmh
 
 
 // Forwards.
+class safe_file;
 struct wmd_instrument;
 struct wmd_song;
 struct wmd_sub_instrument;
@@ -62,10 +64,22 @@ public:
     // Get an instrument by index.
     const wmd_instrument &instrument(size_t index) const { assert(index < m_instruments.size()); return m_instruments[index]; }
 
+    // Mark the IDs of the patches used by the instruments in a song. The
+    // vector is extended as needed to hold the highest patch ID used.
+    void song_patches(size_t song_index, std::vector<bool> &patches) const;
+
     // Convert a raw note value to a frequency, taking into account tuning and
     // pitch bending.
     uint32_t note_to_frequency(size_t instrument_index, uint8_t note, mono_t unit_pitch_bend) const;
 
+    // Convert a raw note value to a pitch in octaves relative to the natural
+    // playback frequency, taking into account tuning but not pitch bending.
+    static double note_to_pitch(const wmd_sub_instrument &sub_instrument, uint8_t note);
+
+    // Convert a pitch in octaves relative to the natural playback frequency to
+    // a frequency.
+    static uint32_t pitch_to_frequency(double pitch);
+
     // Access to the bytes of unknown purpose.
     const uint8_t *unknown_0() const { return m_unknown_0; }
     size_t unknown_0_size() const { return sizeof(m_unknown_0); }
@@ -73,10 +87,18 @@ public:
     size_t unknown_1_size() const { return sizeof(m_unknown_1); }
 
     // Load from a file. The current contents of this object are overwritten.
+    // The file is memory mapped, and the music data of the tracks refers to it
+    // rather than holding a copy.
     void parse(std::string file_name);
 
-    // Store the contents of this object in a file.
+    // Load from data in memory, such as part of a mapped file. The music data
+    // of the tracks refers to the data. The name is used in error messages.
+    void parse(const data_span &data, std::string name);
+
+    // Store the contents of this object in a file, or at the current position
+    // in a file that is already open.
     void write(std::string file_name) const;
+    void write(safe_file &file) const;
 
     // Dump details about the WMD file.
     void dump(bool detailed) const;
@@ -120,7 +142,7 @@ struct wmd_song_track
 
     // Music data encoded in a MIDI-like form. The music_stream class is used to
     // parse this data.
-    std::vector<uint8_t> data;
+    data_span data;
 
     // Unknown bytes at the start of the track header. All songs have 01 18 80
     // 00 01 28, and all sound effects have 01 01 64 00 00 28. The second byte